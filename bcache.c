@@ -0,0 +1,1018 @@
+/*
+ * file:        bcache.c
+ * description: block buffer cache (see bcache.h), used by the block
+ *              layer in misc.c when mounted with -cache.
+ *
+ * A fixed number of block buffers, found through a hash table on the
+ * block number and replaced LRU or 2Q (see "replacement" below). Only
+ * clean, unpinned buffers can be replaced, so replacement never has to
+ * write anything out and pinned blocks stay.
+ *
+ * Writes are write-back: they only update the cache and mark the
+ * buffer dirty. A flusher thread writes dirty buffers out in LBA order
+ * every FLUSH_INTERVAL_MS, or as soon as half of the dirty limit (the
+ * dirty ratio times the cache size) is dirty. A writer that finds the
+ * limit reached, counting buffers still being written, waits for the
+ * flusher (throttling). bcache_sync writes out everything. With a dirty
+ * ratio of 0 writes go through to the backend instead.
+ *
+ * Readahead: bcache_prefetch queues blocks the file system expects to
+ * be read soon, and a reader thread reads them in, in the background,
+ * RA_CHUNK blocks per backend request, as file data. A read that
+ * misses a block the reader is busy with waits for it rather than
+ * reading it a second time. At most a quarter of the cache is queued,
+ * so that blocks read ahead are not pushed out before they are used.
+ * When the queue is empty the same thread works through the warm-up
+ * list of bcache_warm, filling free buffers only.
+ *
+ * Under a memory budget (budget.c) the cache is made big enough to
+ * take the whole budget, and charges a buffer to it when the buffer
+ * first takes a block. budget_balance takes buffers back (bc_shrink)
+ * when the budget is better spent on the file system's caches; their
+ * pages go back to the system, unless the buffers are in huge pages.
+ *
+ * The backend is never called with cache_lock held. A block missed by
+ * a read is read into the caller's buffer and copied into the cache
+ * afterwards, unless a write came in meanwhile (write_seq changed):
+ * the read may then have returned data older than the write.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bcache.h"
+#include "budget.h"
+
+#define BCACHE_ALIGN      4096  /* buffers are usable for O_DIRECT */
+#define HUGE_ALIGN        (2 << 20)  /* x86-64 huge page */
+#define FLUSH_INTERVAL_MS 1000
+#define FLUSH_CHUNK       1024  /* blocks per backend request */
+#define RA_QUEUE          1024  /* blocks waiting to be read ahead */
+#define RA_CHUNK          256   /* blocks per readahead request */
+#define BCACHE_REFILL     4     /* a miss costs a device read (budget.c) */
+
+struct bc_list;
+
+struct bc_ent {
+    lba_t           lba;        /* -1 if the buffer is free */
+    int             pins;
+    int             dirty;      /* newer than the backend's copy */
+    int             wb;         /* being written out by flush_once */
+    uint64_t        seq;        /* when it went on a1in (FIFO order) */
+    struct bc_ent  *hnext;      /* hash chain */
+    struct bc_ent  *prev, *next;
+    struct bc_list *list;       /* list it is on, NULL while not replaceable */
+    struct bc_list *q;          /* list it goes on when replaceable */
+    char           *data;
+};
+
+/* Replacement. The buffers that may be replaced (clean and unpinned)
+ * are on one of three lists, most recently used first:
+ *   freel - buffers holding no block, used first
+ *   am    - the main LRU list
+ *   a1in  - with BCACHE_2Q, a FIFO of data blocks seen only once
+ * With BCACHE_LRU every block goes on am. With BCACHE_2Q a data block
+ * starts on a1in, and only gets onto am if it is asked for again
+ * after being pushed out of a1in, while its number is still in the
+ * a1out ghost FIFO. A hit while it is still on a1in does not promote
+ * it, and a buffer that was off a1in for a while (written, pinned)
+ * goes back where it was, not to the front. A scan through a big file
+ * therefore only churns a1in, which is held to a quarter of the cache
+ * while am has anything in it. Metadata (the priority class) skips
+ * a1in, so inode and directory blocks are only displaced by blocks
+ * used more recently.
+ */
+struct bc_list {
+    struct bc_ent head;
+    int           n;
+};
+
+static struct bc_ent  *ents;
+static char           *bufs_mem;
+static struct bc_ent **hash;
+static unsigned        hash_mask;
+static struct bc_list  freel, am, a1in;
+static int             policy;
+static uint64_t        a1in_seq;             /* last bc_ent.seq handed out */
+static lba_t          *ghost;                /* a1out */
+static int            *ghost_next, *ghost_hash;
+static int             ghost_size, ghost_head, ghost_n;
+static int             cache_size;
+static int             bufs_huge;           /* in huge pages: kept at bc_shrink */
+static bcache_io_fn    cache_io;
+static uint64_t        write_seq;
+static struct bcache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* write-back state. 'ndirty' counts dirty buffers, 'nwb' those being
+ * written; both are unclean. wb_lock serializes flush_once, and is
+ * taken before cache_lock.
+ */
+static int             dirty_limit;         /* 0: write-through */
+static int             ndirty, nwb;
+static int             wb_error;            /* for the next bcache_sync */
+static int             wb_error_new;        /* not yet reported by bcache_writeback */
+static struct bc_ent **wb_ents;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  clean_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       flusher;
+static int             flusher_running, flusher_stop, flusher_kicked;
+
+/* readahead queue (a ring) and the thread reading it */
+static lba_t           ra_queue[RA_QUEUE];
+static int             ra_head, ra_n;
+static lba_t           ra_busy[RA_CHUNK];    /* being read right now */
+static int             ra_nbusy;
+static char           *ra_mem;              /* RA_CHUNK buffers */
+static pthread_cond_t  ra_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  ra_done = PTHREAD_COND_INITIALIZER;
+static pthread_t       reader;
+static int             reader_running, reader_stop;
+
+/* blocks to load at startup (bcache_warm), in LBA order */
+static lba_t          *warm;
+static int             warm_n, warm_pos;
+
+static unsigned hash_of(lba_t lba)
+{
+    return (unsigned)(((uint64_t)lba * 0x9e3779b97f4a7c15ULL) >> 32) & hash_mask;
+}
+
+static void list_init(struct bc_list *l)
+{
+    l->head.prev = l->head.next = &l->head;
+    l->n = 0;
+}
+
+static void list_del(struct bc_ent *e)
+{
+    if (e->list == NULL)
+        return;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->list->n--;
+    e->list = NULL;
+}
+
+static void list_add(struct bc_list *l, struct bc_ent *e, int mru)
+{
+    struct bc_ent *at = mru ? &l->head : l->head.prev;
+    e->next = at->next;
+    e->prev = at;
+    at->next->prev = e;
+    at->next = e;
+    e->list = l;
+    l->n++;
+}
+
+static struct bc_ent *list_tail(struct bc_list *l)
+{
+    return l->n > 0 ? l->head.prev : NULL;
+}
+
+/* a1in is a FIFO: put 'e' back behind every buffer that came in
+ * after it. Those returning are mostly recent, so search from the front.
+ */
+static void list_add_fifo(struct bc_list *l, struct bc_ent *e)
+{
+    struct bc_ent *at = &l->head;
+    while (at->next != &l->head && at->next->seq > e->seq)
+        at = at->next;
+    e->next = at->next;
+    e->prev = at;
+    at->next->prev = e;
+    at->next = e;
+    e->list = l;
+    l->n++;
+}
+
+/* a buffer is on its replacement list only while it is clean and
+ * unpinned; put it on or take it off to match its state, at the front
+ * if it was just used (in arrival order on a1in)
+ */
+static void relist(struct bc_ent *e, int mru)
+{
+    list_del(e);
+    if (e->pins == 0 && !e->dirty && !e->wb) {
+        if (e->q == &a1in)
+            list_add_fifo(e->q, e);
+        else
+            list_add(e->q, e, mru);
+    }
+}
+
+/* the a1out ghost FIFO: a ring of block numbers, with hash chains
+ * through ghost_next for lookup. A slot whose block was taken back
+ * holds -1 until it reaches the end of the ring.
+ */
+static void ghost_unlink(int i)
+{
+    int *pp = &ghost_hash[hash_of(ghost[i])];
+    while (*pp != i)
+        pp = &ghost_next[*pp];
+    *pp = ghost_next[i];
+    ghost[i] = -1;
+}
+
+static void ghost_add(lba_t lba)
+{
+    if (ghost_n == ghost_size) {
+        if (ghost[ghost_head] >= 0)
+            ghost_unlink(ghost_head);
+        ghost_head = (ghost_head + 1) % ghost_size;
+        ghost_n--;
+    }
+    int i = (ghost_head + ghost_n++) % ghost_size;
+    ghost[i] = lba;
+    ghost_next[i] = ghost_hash[hash_of(lba)];
+    ghost_hash[hash_of(lba)] = i;
+}
+
+/* 1 if 'lba' is remembered in a1out (and forget it), 0 if not
+ */
+static int ghost_take(lba_t lba)
+{
+    for (int i = ghost_hash[hash_of(lba)]; i >= 0; i = ghost_next[i]) {
+        if (ghost[i] == lba) {
+            ghost_unlink(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct bc_ent *lookup(lba_t lba)
+{
+    struct bc_ent *e = hash[hash_of(lba)];
+    while (e != NULL && e->lba != lba)
+        e = e->hnext;
+    return e;
+}
+
+static void unhash(struct bc_ent *e)
+{
+    struct bc_ent **pp = &hash[hash_of(e->lba)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->lba = -1;
+    stats.used--;
+}
+
+/* the cached block to give up: the oldest on a1in if a1in is over its
+ * share of the blocks cached (or am is empty), else the least recently
+ * used on am. NULL if none can be.
+ */
+static struct bc_ent *oldest(void)
+{
+    if (a1in.n > 0 && (a1in.n > stats.used / 4 || am.n == 0))
+        return list_tail(&a1in);
+    if (am.n > 0)
+        return list_tail(&am);
+    return NULL;
+}
+
+/* the buffer to replace: a free one if any, else oldest(). NULL if
+ * nothing can be replaced.
+ */
+static struct bc_ent *victim(void)
+{
+    if (freel.n > 0)
+        return list_tail(&freel);
+    return oldest();
+}
+
+/* a buffer for block 'lba' of class 'cls', taking over the victim.
+ * NULL if there is no clean unpinned buffer.
+ */
+static struct bc_ent *bc_alloc(lba_t lba, int cls)
+{
+    struct bc_ent *e = victim();
+    if (e == NULL)
+        return NULL;
+    if (e->lba >= 0) {
+        if (e->q == &a1in)
+            ghost_add(e->lba);
+        unhash(e);
+        stats.evictions++;
+    } else {
+        budget_charge(BUDGET_BCACHE, 1);
+    }
+    e->lba = lba;
+    e->hnext = hash[hash_of(lba)];
+    hash[hash_of(lba)] = e;
+    stats.used++;
+
+    /* 2Q: data goes on probation unless seen recently; metadata never */
+    if (policy == BCACHE_2Q && cls == BCACHE_DATA && !ghost_take(lba)) {
+        e->q = &a1in;
+        e->seq = ++a1in_seq;
+    } else
+        e->q = &am;
+    relist(e, 1);
+    return e;
+}
+
+/* a cached block was asked for again (and may have changed state):
+ * it moves to the front of am; except that with 2Q a data block on
+ * a1in keeps its place there, a1in being a FIFO
+ */
+static void touch(struct bc_ent *e, int cls)
+{
+    if (e->q == &a1in && cls == BCACHE_DATA) {
+        if (e->list == &a1in && e->pins == 0 && !e->dirty && !e->wb)
+            return;
+    } else {
+        e->q = &am;
+    }
+    relist(e, 1);
+}
+
+/* forget the buffer's block, dirty or not. Not for buffers being
+ * written out.
+ */
+static void drop(struct bc_ent *e)
+{
+    if (e->pins > 0)
+        stats.pinned--;
+    if (e->dirty) {
+        ndirty--;
+        pthread_cond_broadcast(&clean_cond);
+    }
+    e->pins = e->dirty = 0;
+    unhash(e);
+    e->q = &freel;
+    relist(e, 0);
+    budget_charge(BUDGET_BCACHE, -1);
+}
+
+/* give a buffer back to the memory budget (see budget.h) */
+static int bc_shrink(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct bc_ent *e = oldest();
+    if (e != NULL) {
+        if (e->q == &a1in)
+            ghost_add(e->lba);
+        stats.evictions++;
+        drop(e);
+        if (!bufs_huge)
+            madvise(e->data, FS_BLOCK_SIZE, MADV_DONTNEED);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return e != NULL;
+}
+
+int bcache_active(void)
+{
+    return cache_size > 0;
+}
+
+int bcache_write_back(void)
+{
+    return cache_size > 0 && dirty_limit > 0;
+}
+
+/* memory a cache of 'nblocks' takes, buffers and bookkeeping: for
+ * each block its buffer, entry, write-back slot, up to two hash slots
+ * (the table is a power of two) and half a ghost; and the readahead
+ * buffers
+ */
+static size_t cache_bytes(size_t nblocks)
+{
+    size_t per = FS_BLOCK_SIZE + sizeof(struct bc_ent) + sizeof(struct bc_ent *) +
+        2 * (sizeof(struct bc_ent *) + sizeof(int)) + (sizeof(lba_t) + sizeof(int)) / 2;
+    return nblocks * per + (size_t)RA_CHUNK * FS_BLOCK_SIZE;
+}
+
+int bcache_blocks_for(size_t bytes)
+{
+    size_t fixed = cache_bytes(0), per = cache_bytes(1) - fixed;
+    if (bytes <= fixed)
+        return 0;
+    size_t n = (bytes - fixed) / per;
+    return n > INT_MAX ? INT_MAX : (int)n;
+}
+
+int bcache_init(int nblocks, int dirty_pct, int pol, int huge, bcache_io_fn io)
+{
+    if (nblocks <= 0 || dirty_pct < 0 || dirty_pct > 100 ||
+        (pol != BCACHE_LRU && pol != BCACHE_2Q))
+        return -EINVAL;
+    bcache_free();
+
+    unsigned nhash = 1;
+    while (nhash < nblocks)
+        nhash <<= 1;
+    ghost_size = nblocks / 2 + 1;
+    ents = calloc(nblocks, sizeof(*ents));
+    hash = calloc(nhash, sizeof(*hash));
+    wb_ents = calloc(nblocks, sizeof(*wb_ents));
+    ghost = calloc(ghost_size, sizeof(*ghost));
+    ghost_next = calloc(ghost_size, sizeof(*ghost_next));
+    ghost_hash = malloc(nhash * sizeof(*ghost_hash));
+    if (ents == NULL || hash == NULL || wb_ents == NULL || ghost == NULL ||
+        ghost_next == NULL || ghost_hash == NULL ||
+        posix_memalign((void **)&bufs_mem, huge ? HUGE_ALIGN : BCACHE_ALIGN,
+                       (size_t)nblocks * FS_BLOCK_SIZE) != 0) {
+        bufs_mem = NULL;
+        bcache_free();
+        return -ENOMEM;
+    }
+#ifdef MADV_HUGEPAGE
+    /* only a hint: without transparent huge pages it does nothing */
+    if (huge && madvise(bufs_mem, (size_t)nblocks * FS_BLOCK_SIZE, MADV_HUGEPAGE) < 0)
+        perror("bcache: madvise(MADV_HUGEPAGE)");
+#endif
+    if (posix_memalign((void **)&ra_mem, BCACHE_ALIGN,
+                       (size_t)RA_CHUNK * FS_BLOCK_SIZE) != 0) {
+        ra_mem = NULL;
+        bcache_free();
+        return -ENOMEM;
+    }
+    hash_mask = nhash - 1;
+    for (unsigned i = 0; i < nhash; i++)
+        ghost_hash[i] = -1;
+    ghost_head = ghost_n = 0;
+    policy = pol;
+    bufs_huge = huge;
+
+    list_init(&freel);
+    list_init(&am);
+    list_init(&a1in);
+    for (int i = 0; i < nblocks; i++) {
+        ents[i].lba = -1;
+        ents[i].data = bufs_mem + (size_t)i * FS_BLOCK_SIZE;
+        ents[i].q = &freel;
+        relist(&ents[i], 0);
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.size = cache_size = nblocks;
+    dirty_limit = (int)((long)nblocks * dirty_pct / 100);
+    if (dirty_pct > 0 && dirty_limit == 0)
+        dirty_limit = 1;
+    ndirty = nwb = wb_error = wb_error_new = 0;
+    ra_head = ra_n = 0;
+    cache_io = io;
+
+    struct budget_cache bc = {FS_BLOCK_SIZE, BCACHE_REFILL, bc_shrink};
+    budget_register(BUDGET_BCACHE, &bc);
+    budget_reserve(cache_bytes(nblocks) - (size_t)nblocks * FS_BLOCK_SIZE);
+    return 0;
+}
+
+/* the caller must bcache_sync first, or dirty blocks are lost
+ */
+void bcache_free(void)
+{
+    if (flusher_running) {
+        pthread_mutex_lock(&cache_lock);
+        flusher_stop = 1;
+        pthread_cond_signal(&flush_cond);
+        pthread_mutex_unlock(&cache_lock);
+        pthread_join(flusher, NULL);
+        flusher_running = 0;
+    }
+    if (reader_running) {
+        pthread_mutex_lock(&cache_lock);
+        reader_stop = 1;
+        pthread_cond_signal(&ra_cond);
+        pthread_mutex_unlock(&cache_lock);
+        pthread_join(reader, NULL);
+        reader_running = 0;
+    }
+    if (cache_size > 0) {
+        budget_charge(BUDGET_BCACHE, -stats.used);
+        budget_reserve(-(long)(cache_bytes(cache_size) - (size_t)cache_size * FS_BLOCK_SIZE));
+    }
+    free(ents);
+    free(hash);
+    free(wb_ents);
+    free(bufs_mem);
+    free(ra_mem);
+    free(warm);
+    free(ghost);
+    free(ghost_next);
+    free(ghost_hash);
+    ents = NULL;
+    hash = NULL;
+    wb_ents = NULL;
+    bufs_mem = NULL;
+    ra_mem = NULL;
+    warm = NULL;
+    warm_n = warm_pos = 0;
+    ghost = NULL;
+    ghost_next = ghost_hash = NULL;
+    list_init(&freel);
+    list_init(&am);
+    list_init(&a1in);
+    cache_size = 0;
+}
+
+static int cmp_lba(const void *a, const void *b)
+{
+    lba_t x = (*(struct bc_ent **)a)->lba, y = (*(struct bc_ent **)b)->lba;
+    return (x > y) - (x < y);
+}
+
+static int cmp_lba_val(const void *a, const void *b)
+{
+    lba_t x = *(const lba_t *)a, y = *(const lba_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* write out every buffer dirty right now, in LBA order, so that runs
+ * of consecutive blocks become single transfers. Called with wb_lock
+ * held. A buffer written again while it is out is dirty once more,
+ * and goes out next time.
+ */
+static void flush_once(void)
+{
+    int n = 0, rv = 0;
+
+    // 1. collect the dirty buffers; while out they can't be replaced
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < cache_size && ndirty > 0; i++) {
+        struct bc_ent *e = &ents[i];
+        if (!e->dirty)
+            continue;
+        e->dirty = 0;
+        e->wb = 1;
+        ndirty--;
+        wb_ents[n++] = e;
+    }
+    nwb += n;
+    pthread_mutex_unlock(&cache_lock);
+    if (n == 0)
+        return;
+
+    // 2. write them, sorted
+    qsort(wb_ents, n, sizeof(*wb_ents), cmp_lba);
+    for (int k = 0; k < n; k += FLUSH_CHUNK) {
+        int cnt = (n - k < FLUSH_CHUNK) ? n - k : FLUSH_CHUNK;
+        void *bufs[cnt];
+        lba_t lbas[cnt];
+        for (int i = 0; i < cnt; i++) {
+            bufs[i] = wb_ents[k + i]->data;
+            lbas[i] = wb_ents[k + i]->lba;
+        }
+        if (cache_io(1, bufs, lbas, cnt) < 0)
+            rv = -EIO;
+    }
+
+    // 3. clean again (if not rewritten); writers may be waiting on that.
+    //    a1in buffers go back to their place in the FIFO (see relist)
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < n; i++) {
+        wb_ents[i]->wb = 0;
+        relist(wb_ents[i], 1);
+    }
+    nwb -= n;
+    stats.writebacks += n;
+    if (rv < 0) {
+        /* the data is lost to the backend, like a failed write; the
+         * next bcache_sync reports it */
+        fprintf(stderr, "block cache: write-back failed\n");
+        wb_error = wb_error_new = rv;
+    }
+    pthread_cond_broadcast(&clean_cond);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void *flusher_main(void *arg)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (!flusher_stop) {
+        if (!flusher_kicked) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&flush_cond, &cache_lock, &ts);
+        }
+        flusher_kicked = 0;
+        if (flusher_stop || ndirty == 0)
+            continue;
+        pthread_mutex_unlock(&cache_lock);
+        pthread_mutex_lock(&wb_lock);
+        flush_once();
+        pthread_mutex_unlock(&wb_lock);
+        pthread_mutex_lock(&cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+/* wake the flusher. Started on first use, as bcache_init runs before
+ * fuse_main forks. Called with cache_lock held.
+ */
+static void kick(void)
+{
+    if (!flusher_running) {
+        flusher_stop = 0;
+        flusher_running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+    }
+    flusher_kicked = 1;
+    pthread_cond_signal(&flush_cond);
+}
+
+/* copy the blocks read into the cache, if no write may have
+ * overtaken the read (see above)
+ */
+static void fill(void **bufs, const lba_t *lbas, int n, int cls, uint64_t seq)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < n && write_seq == seq; i++) {
+        if (lookup(lbas[i]) != NULL)
+            continue;
+        struct bc_ent *e = bc_alloc(lbas[i], cls);
+        if (e == NULL)
+            break;
+        memcpy(e->data, bufs[i], FS_BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    budget_balance();
+}
+
+/* 1 if the reader is reading any of blocks 'lbas' in right now.
+ * Called with cache_lock held.
+ */
+static int ra_busy_any(const lba_t *lbas, int n)
+{
+    for (int i = 0; i < n && ra_nbusy > 0; i++) {
+        for (int j = 0; j < ra_nbusy; j++) {
+            if (ra_busy[j] == lbas[i])
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static int bc_read(void **bufs, const lba_t *lbas, int n, int cls)
+{
+    void *mbufs[n];
+    lba_t mlbas[n];
+    int nmiss = 0, nhit = 0;
+
+    // 1. copy out what is cached, and list the misses
+    pthread_mutex_lock(&cache_lock);
+    while (ra_busy_any(lbas, n))
+        pthread_cond_wait(&ra_done, &cache_lock);
+    for (int i = 0; i < n; i++) {
+        struct bc_ent *e = lookup(lbas[i]);
+        if (e != NULL) {
+            memcpy(bufs[i], e->data, FS_BLOCK_SIZE);
+            touch(e, cls);
+            stats.hits++;
+            nhit++;
+        } else {
+            mbufs[nmiss] = bufs[i];
+            mlbas[nmiss++] = lbas[i];
+            stats.misses++;
+        }
+    }
+    uint64_t seq = write_seq;
+    pthread_mutex_unlock(&cache_lock);
+    if (nhit > 0)
+        budget_hits(BUDGET_BCACHE, nhit);
+    if (nmiss == 0)
+        return 0;
+
+    // 2. read the misses in one request, then keep copies of them
+    if (cache_io(0, mbufs, mlbas, nmiss) < 0)
+        return -EIO;
+    fill(mbufs, mlbas, nmiss, cls, seq);
+    return 0;
+}
+
+/* write-through: the backend first, then the cached copies are
+ * updated, or dropped if the write failed and the block's contents
+ * are unknown. New blocks are cached too, as the file system usually
+ * reads back what it just wrote.
+ */
+static int bc_write_through(void **bufs, const lba_t *lbas, int n, int cls)
+{
+    int rv = cache_io(1, bufs, lbas, n);
+
+    pthread_mutex_lock(&cache_lock);
+    write_seq++;
+    for (int i = 0; i < n; i++) {
+        struct bc_ent *e = lookup(lbas[i]);
+        if (rv < 0) {
+            if (e != NULL)
+                drop(e);
+            continue;
+        }
+        if (e == NULL && (e = bc_alloc(lbas[i], cls)) == NULL)
+            continue;
+        memcpy(e->data, bufs[i], FS_BLOCK_SIZE);
+        touch(e, cls);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+/* write-back: only the cache is updated. Blocks that find no clean
+ * buffer to take over go straight to the backend, and count as a write
+ * again once they are there (a read that missed them meanwhile may
+ * have fetched the old contents).
+ */
+static int bc_write_back(void **bufs, const lba_t *lbas, int n, int cls)
+{
+    void *dbufs[n];
+    lba_t dlbas[n];
+    int ndirect = 0;
+
+    pthread_mutex_lock(&cache_lock);
+
+    // 1. throttle: wait for the flusher while too much is unclean
+    while (ndirty + nwb >= dirty_limit) {
+        kick();
+        stats.throttled++;
+        pthread_cond_wait(&clean_cond, &cache_lock);
+    }
+
+    // 2. copy in and mark dirty
+    write_seq++;
+    for (int i = 0; i < n; i++) {
+        struct bc_ent *e = lookup(lbas[i]);
+        if (e == NULL && (e = bc_alloc(lbas[i], cls)) == NULL) {
+            dbufs[ndirect] = bufs[i];
+            dlbas[ndirect++] = lbas[i];
+            continue;
+        }
+        memcpy(e->data, bufs[i], FS_BLOCK_SIZE);
+        if (!e->dirty) {
+            e->dirty = 1;
+            ndirty++;
+        }
+        touch(e, cls);
+    }
+    if (ndirty >= (dirty_limit + 1) / 2 || !flusher_running)
+        kick();
+    pthread_mutex_unlock(&cache_lock);
+
+    if (ndirect == 0)
+        return 0;
+    int rv = cache_io(1, dbufs, dlbas, ndirect);
+    pthread_mutex_lock(&cache_lock);
+    write_seq++;
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+static void *reader_main(void *arg)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (!reader_stop) {
+        if (ra_n == 0 && warm_pos == warm_n) {
+            pthread_cond_wait(&ra_cond, &cache_lock);
+            continue;
+        }
+
+        // 1. take the next chunk of the readahead queue, or else of the
+        //    warm-up list (as far as there are free buffers for it),
+        //    that is still not cached
+        void *bufs[RA_CHUNK];
+        lba_t lbas[RA_CHUNK];
+        int n = 0;
+        int cls = (ra_n > 0) ? BCACHE_DATA : BCACHE_META;
+        if (cls == BCACHE_META && freel.n == 0)
+            warm_pos = warm_n;
+        while (n < RA_CHUNK) {
+            lba_t lba;
+            if (cls == BCACHE_DATA && ra_n > 0) {
+                lba = ra_queue[ra_head];
+                ra_head = (ra_head + 1) % RA_QUEUE;
+                ra_n--;
+            } else if (cls == BCACHE_META && warm_pos < warm_n && n < freel.n) {
+                lba = warm[warm_pos++];
+            } else {
+                break;
+            }
+            if (lookup(lba) == NULL) {
+                bufs[n] = ra_mem + (size_t)n * FS_BLOCK_SIZE;
+                ra_busy[n] = lba;
+                lbas[n++] = lba;
+            }
+        }
+        ra_nbusy = n;
+        uint64_t seq = write_seq;
+        pthread_mutex_unlock(&cache_lock);
+
+        // 2. read it and keep it, as for a read miss
+        int rv = (n > 0) ? cache_io(0, bufs, lbas, n) : -1;
+        if (rv == 0)
+            fill(bufs, lbas, n, cls, seq);
+        pthread_mutex_lock(&cache_lock);
+        if (rv == 0 && cls == BCACHE_DATA)
+            stats.prefetched += n;
+        else if (rv == 0)
+            stats.warmed += n;
+        ra_nbusy = 0;
+        pthread_cond_broadcast(&ra_done);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+/* start the reader if it isn't running; called with cache_lock held */
+static void start_reader(void)
+{
+    /* started on first use, like the flusher */
+    if (!reader_running) {
+        reader_stop = 0;
+        reader_running = pthread_create(&reader, NULL, reader_main, NULL) == 0;
+    }
+    pthread_cond_signal(&ra_cond);
+}
+
+int bcache_prefetch(const lba_t *lbas, int n)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i, queued = 0;
+    int max = (cache_size / 4 < RA_QUEUE) ? cache_size / 4 : RA_QUEUE;
+    for (i = 0; i < n; i++) {
+        if (lookup(lbas[i]) != NULL)
+            continue;
+        if (ra_n >= max)
+            break;
+        ra_queue[(ra_head + ra_n++) % RA_QUEUE] = lbas[i];
+        queued++;
+    }
+    if (queued > 0)
+        start_reader();
+    pthread_mutex_unlock(&cache_lock);
+    return i;
+}
+
+int bcache_hot(lba_t *lbas, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    // 1. blocks that can't be replaced (pinned, dirty) are in use
+    for (int i = 0; i < cache_size && n < max; i++) {
+        if (ents[i].lba >= 0 && ents[i].list == NULL)
+            lbas[n++] = ents[i].lba;
+    }
+    // 2. then the main list, most recently used first
+    for (struct bc_ent *e = am.head.next; e != &am.head && n < max; e = e->next)
+        lbas[n++] = e->lba;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+void bcache_warm(const lba_t *lbas, int n)
+{
+    if (n > cache_size)
+        n = cache_size;
+    lba_t *list = malloc(n * sizeof(*list));
+    if (list == NULL || n == 0) {
+        free(list);
+        return;
+    }
+    memcpy(list, lbas, n * sizeof(*list));
+    qsort(list, n, sizeof(*list), cmp_lba_val);
+
+    pthread_mutex_lock(&cache_lock);
+    free(warm);
+    warm = list;
+    warm_n = n;
+    warm_pos = 0;
+    start_reader();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int bcache_rwv(int write, void **bufs, const lba_t *lbas, int n, int cls)
+{
+    if (!write)
+        return bc_read(bufs, lbas, n, cls);
+    int rv = dirty_limit > 0 ? bc_write_back(bufs, lbas, n, cls) :
+        bc_write_through(bufs, lbas, n, cls);
+    budget_balance();
+    return rv;
+}
+
+int bcache_sync(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    flush_once();
+    pthread_mutex_unlock(&wb_lock);
+
+    pthread_mutex_lock(&cache_lock);
+    int rv = wb_error;
+    wb_error = wb_error_new = 0;
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+int bcache_writeback(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (ndirty > 0)
+        kick();
+    int rv = wb_error_new;
+    wb_error_new = 0;
+    pthread_mutex_unlock(&cache_lock);
+    return rv;
+}
+
+int bcache_pin(lba_t lba)
+{
+    char buf[FS_BLOCK_SIZE];
+    void *bufs[1] = {buf};
+
+    for (;;) {
+        // 1. already cached: take it off the LRU list
+        pthread_mutex_lock(&cache_lock);
+        struct bc_ent *e = lookup(lba);
+        if (e != NULL) {
+            if (e->pins++ == 0) {
+                relist(e, 1);
+                stats.pinned++;
+            }
+            pthread_mutex_unlock(&cache_lock);
+            return 0;
+        }
+        if (victim() == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return -ENOSPC;
+        }
+        uint64_t seq = write_seq;
+        pthread_mutex_unlock(&cache_lock);
+
+        // 2. otherwise read it in and try again
+        if (cache_io(0, bufs, &lba, 1) < 0)
+            return -EIO;
+        fill(bufs, &lba, 1, BCACHE_META, seq);
+    }
+}
+
+void bcache_unpin(lba_t lba)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct bc_ent *e = lookup(lba);
+    if (e != NULL && e->pins > 0 && --e->pins == 0) {
+        relist(e, 1);
+        stats.pinned--;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* the buffer of a block in [start, end) that is being written out,
+ * or NULL
+ */
+static struct bc_ent *find_wb(lba_t start, lba_t end)
+{
+    for (int i = 0; i < cache_size && nwb > 0; i++) {
+        if (ents[i].wb && ents[i].lba >= start && ents[i].lba < end)
+            return &ents[i];
+    }
+    return NULL;
+}
+
+void bcache_invalidate(lba_t start, lba_t end)
+{
+    pthread_mutex_lock(&cache_lock);
+    write_seq++;
+
+    /* a block being written out must land before it is forgotten, or
+     * it could land after whatever changed the block underneath us */
+    while (find_wb(start, end) != NULL)
+        pthread_cond_wait(&clean_cond, &cache_lock);
+
+    if (end - start <= cache_size) {
+        for (lba_t lba = start; lba < end; lba++) {
+            struct bc_ent *e = lookup(lba);
+            if (e != NULL)
+                drop(e);
+        }
+    } else {
+        /* a large range: cheaper to go over the whole cache */
+        for (int i = 0; i < cache_size; i++) {
+            if (ents[i].lba >= start && ents[i].lba < end)
+                drop(&ents[i]);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void bcache_get_stats(struct bcache_stats *st)
+{
+    pthread_mutex_lock(&cache_lock);
+    *st = stats;
+    st->dirty = ndirty + nwb;
+    pthread_mutex_unlock(&cache_lock);
+}
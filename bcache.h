@@ -0,0 +1,103 @@
+/*
+ * file:        bcache.h
+ * description: block buffer cache, used by the block layer in misc.c
+ *              between the file system and the backends
+ */
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fs5600.h"
+
+/* how the cache reaches the blocks below it (a backend's rwv)
+ */
+typedef int (*bcache_io_fn)(int write, void **bufs, const lba_t *lbas, int n);
+
+/* replacement policies */
+enum { BCACHE_LRU, BCACHE_2Q };
+
+/* block classes: metadata is kept in preference to file data */
+enum { BCACHE_META, BCACHE_DATA };
+
+struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;    /* blocks written out by the flusher or sync */
+    uint64_t throttled;     /* times a writer waited for the flusher */
+    uint64_t prefetched;    /* blocks read ahead */
+    uint64_t warmed;        /* blocks loaded by bcache_warm */
+    int      size;          /* blocks the cache can hold */
+    int      used;
+    int      pinned;
+    int      dirty;         /* not yet written back */
+};
+
+/* set up a cache of 'nblocks' blocks on top of 'io', replaced by
+ * 'policy'. Up to 'dirty_pct' percent of it may hold blocks not yet
+ * written back; 0 makes it write-through. With 'huge' the buffers are
+ * put in (transparent) huge pages if the kernel has them. Returns 0,
+ * or -errno.
+ */
+int  bcache_init(int nblocks, int dirty_pct, int policy, int huge, bcache_io_fn io);
+
+/* the most blocks a cache can have in 'bytes' of memory, counting its
+ * bookkeeping as well as the buffers
+ */
+int  bcache_blocks_for(size_t bytes);
+void bcache_free(void);
+int  bcache_active(void);
+
+/* 1 if the cache is set up and write-back, so that a write may stay in
+ * memory until the flusher or bcache_sync gets to it
+ */
+int  bcache_write_back(void);
+
+/* same as the backend's rwv, but through the cache, for blocks of
+ * class 'cls'. Returns 0 or -EIO; with write-back, errors writing a
+ * block back are only reported by bcache_sync and bcache_writeback.
+ * Keeps per-block state on the stack: the block layer passes at most
+ * a batch (BLOCK_BATCH in misc.c) at a time.
+ */
+int  bcache_rwv(int write, void **bufs, const lba_t *lbas, int n, int cls);
+
+/* read blocks 'lbas' into the cache in the background, as file data
+ * expected to be read soon. Blocks already cached are skipped. Returns
+ * how many of 'lbas' were taken; the rest found the readahead queue
+ * full.
+ */
+int  bcache_prefetch(const lba_t *lbas, int n);
+
+/* bcache_hot lists up to 'max' cached blocks worth having cached
+ * again after a restart, most valuable first: those in use, then the
+ * main LRU list (2Q's A1in is left out). Returns how many.
+ * bcache_warm reads blocks 'lbas' (such a list) into free buffers in
+ * the background, in LBA order, after any readahead.
+ */
+int  bcache_hot(lba_t *lbas, int max);
+void bcache_warm(const lba_t *lbas, int n);
+
+/* bcache_sync writes back every dirty block and waits for it;
+ * bcache_writeback only starts doing so. bcache_sync returns -EIO if
+ * a write-back failed since the last bcache_sync, bcache_writeback
+ * only the first time it sees that failure; 0 otherwise.
+ */
+int  bcache_sync(void);
+int  bcache_writeback(void);
+
+/* keep block 'lba' in the cache until unpinned (pins nest).
+ * Returns 0, -EIO, or -ENOSPC if every cache block is pinned.
+ */
+int  bcache_pin(lba_t lba);
+void bcache_unpin(lba_t lba);
+
+/* drop blocks [start, end) from the cache; their contents changed
+ * underneath it
+ */
+void bcache_invalidate(lba_t start, lba_t end);
+
+void bcache_get_stats(struct bcache_stats *st);
+
+#endif
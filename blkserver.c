@@ -0,0 +1,163 @@
+/*
+ * file:        blkserver.c
+ * description: stand-in remote block store, for testing the -remote
+ *              backend. Serves an image (or image set) through the
+ *              block layer in misc.c, one thread per connection.
+ *
+ *  usage: ./blkserver disk.img[,disk2.img...] unix:/path | tcp:[host]:port
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "remote.h"
+
+extern void block_init(char *file);
+extern int block_read(void *buf, lba_t lba, int nblks);
+extern int block_write(void *buf, lba_t lba, int nblks);
+extern int block_flush(void);
+
+static int recv_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_full(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        while (cnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* answer requests on one connection until the client goes away
+ */
+static void *serve(void *arg)
+{
+    int fd = (intptr_t)arg;
+    void *buf;
+
+    if (posix_memalign(&buf, 4096, (size_t)BLKP_MAX_BLKS * FS_BLOCK_SIZE) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct blkp_req req;
+    while (recv_full(fd, &req, sizeof(req)) == 0) {
+        struct blkp_rsp rsp = {BLKP_MAGIC, 0};
+        struct iovec iov[2];
+        size_t len = (size_t)req.nblks * FS_BLOCK_SIZE;
+
+        if (req.magic != BLKP_MAGIC || req.nblks > BLKP_MAX_BLKS)
+            break;
+
+        switch (req.op) {
+        case BLKP_READ:
+            rsp.status = block_read(buf, req.lba, req.nblks);
+            break;
+        case BLKP_WRITE:
+            if (recv_full(fd, buf, len) < 0)
+                goto out;
+            /* block 0 is never written (see block_write) */
+            rsp.status = (req.lba > 0) ? block_write(buf, req.lba, req.nblks) : -EIO;
+            break;
+        case BLKP_FLUSH:
+            rsp.status = block_flush();
+            break;
+        default:
+            rsp.status = -EINVAL;
+        }
+
+        iov[0].iov_base = &rsp;
+        iov[0].iov_len = sizeof(rsp);
+        iov[1].iov_base = buf;
+        iov[1].iov_len = len;
+        int cnt = (req.op == BLKP_READ && rsp.status == 0) ? 2 : 1;
+        if (send_full(fd, iov, cnt) < 0)
+            break;
+    }
+out:
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int one = 1;
+
+    if (argc != 3) {
+        printf("usage: ./blkserver disk.img[,disk2.img...] unix:/path | tcp:[host]:port\n");
+        exit(1);
+    }
+    block_init(argv[1]);
+
+    int family = blkp_addr(argv[2], &sa, &len);
+    if (family < 0) {
+        printf("bad address: %s\n", argv[2]);
+        exit(1);
+    }
+    int lfd = socket(family, SOCK_STREAM, 0);
+    if (family == AF_UNIX)
+        unlink(((struct sockaddr_un *)&sa)->sun_path);
+    else
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, len) < 0 ||
+        listen(lfd, 16) < 0) {
+        printf("cannot listen on %s: %s\n", argv[2], strerror(errno));
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            exit(1);
+        }
+        pthread_t t;
+        if (pthread_create(&t, NULL, serve, (void *)(intptr_t)fd) != 0)
+            close(fd);
+        else
+            pthread_detach(t);
+    }
+}
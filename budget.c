@@ -0,0 +1,149 @@
+/*
+ * file:        budget.c
+ * description: memory accountant for lab5fuse -mem (see budget.h).
+ *
+ * Every cache charges its entries to one byte counter as it takes
+ * them, and gets nothing back until it gives them up; none has a share
+ * of its own. When the counter is over the budget, budget_balance asks
+ * the cache whose memory is currently worth least for an entry, and
+ * goes on until it is under again. What memory is worth is the cache's
+ * recent hits per byte it holds, times what a miss in it costs (a
+ * block cache miss goes to the device; an inode, dentry or path is
+ * rebuilt from blocks that are mostly still cached). Hits are halved
+ * every BUDGET_DECAY entries charged, so the ranking follows the
+ * workload: a scan through big files leaves the block cache with a
+ * low hit rate for the memory it took, and it is the one to give it
+ * back. No cache is shrunk below BUDGET_MIN entries.
+ *
+ * budget_lock is only ever taken last, and nothing is called with it
+ * held; budget_balance calls the caches' shrink with no lock of its
+ * own, one thread at a time (another thread finding it busy leaves it
+ * to the one that has it).
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "budget.h"
+
+#define BUDGET_DECAY 4096       /* entries charged between halving hits */
+#define BUDGET_MIN   16         /* entries no cache is shrunk below */
+
+static struct budget_cache caches[BUDGET_NCACHES];
+static int                 nents[BUDGET_NCACHES];
+static struct budget_stats stats;
+static int                 since_decay;
+static pthread_mutex_t     budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t     balance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void budget_init(size_t bytes)
+{
+    pthread_mutex_lock(&budget_lock);
+    memset(stats.hits, 0, sizeof(stats.hits));
+    memset(stats.shrunk, 0, sizeof(stats.shrunk));
+    stats.limit = bytes;
+    since_decay = 0;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+size_t budget_limit(void)
+{
+    return stats.limit;
+}
+
+void budget_register(int id, const struct budget_cache *c)
+{
+    pthread_mutex_lock(&budget_lock);
+    caches[id] = *c;
+    stats.bytes[id] = nents[id] * c->ent_bytes;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+static void recount(void)
+{
+    stats.used = stats.fixed;
+    for (int i = 0; i < BUDGET_NCACHES; i++)
+        stats.used += stats.bytes[i];
+}
+
+void budget_reserve(long bytes)
+{
+    pthread_mutex_lock(&budget_lock);
+    stats.fixed += bytes;
+    recount();
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void budget_charge(int id, int n)
+{
+    pthread_mutex_lock(&budget_lock);
+    nents[id] += n;
+    stats.bytes[id] = nents[id] * caches[id].ent_bytes;
+    recount();
+    if (n > 0 && (since_decay += n) >= BUDGET_DECAY) {
+        for (int i = 0; i < BUDGET_NCACHES; i++)
+            stats.hits[i] /= 2;
+        since_decay = 0;
+    }
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void budget_hits(int id, int n)
+{
+    pthread_mutex_lock(&budget_lock);
+    stats.hits[id] += n;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+/* the cache to take an entry from: the lowest (hits * refill + 1) per
+ * byte among those above BUDGET_MIN that haven't failed this round
+ * (the 1 makes the biggest go first while nothing has hits). -1 if
+ * we're within budget or no cache is left. Called with budget_lock.
+ */
+static int pick(int failed)
+{
+    int best = -1;
+    double best_val = 0;
+
+    if (stats.used <= stats.limit)
+        return -1;
+    for (int i = 0; i < BUDGET_NCACHES; i++) {
+        if (caches[i].shrink == NULL || nents[i] <= BUDGET_MIN || (failed & (1 << i)))
+            continue;
+        double val = ((double)stats.hits[i] * caches[i].refill + 1) / stats.bytes[i];
+        if (best < 0 || val < best_val) {
+            best = i;
+            best_val = val;
+        }
+    }
+    return best;
+}
+
+void budget_balance(void)
+{
+    if (stats.limit == 0 || pthread_mutex_trylock(&balance_lock) != 0)
+        return;
+    int failed = 0;
+    for (;;) {
+        pthread_mutex_lock(&budget_lock);
+        int id = pick(failed);
+        pthread_mutex_unlock(&budget_lock);
+        if (id < 0)
+            break;
+        if (caches[id].shrink()) {
+            pthread_mutex_lock(&budget_lock);
+            stats.shrunk[id]++;
+            pthread_mutex_unlock(&budget_lock);
+        } else {
+            failed |= 1 << id;
+        }
+    }
+    pthread_mutex_unlock(&balance_lock);
+}
+
+void budget_get_stats(struct budget_stats *st)
+{
+    pthread_mutex_lock(&budget_lock);
+    *st = stats;
+    pthread_mutex_unlock(&budget_lock);
+}
@@ -0,0 +1,65 @@
+/*
+ * file:        budget.h
+ * description: one memory budget shared by the block cache (bcache.c)
+ *              and the inode, dentry and path caches of fs5600.c
+ */
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* the caches that share the budget */
+enum { BUDGET_BCACHE, BUDGET_ICACHE, BUDGET_DCACHE, BUDGET_PCACHE, BUDGET_NCACHES };
+
+/* what the accountant needs to know about a cache. 'shrink' gives up
+ * the entry the cache would replace next and returns 1, or returns 0
+ * if it has nothing it can give up right now (all pinned or dirty, or
+ * its lock is busy); it must not wait for its own lock, as the thread
+ * asking may hold it.
+ */
+struct budget_cache {
+    size_t ent_bytes;           /* memory one entry takes */
+    int    refill;              /* relative cost of a miss */
+    int  (*shrink)(void);
+};
+
+struct budget_stats {
+    size_t   limit;             /* 0: no budget */
+    size_t   used;              /* fixed + every cache's entries */
+    size_t   fixed;             /* tables held for the whole mount */
+    size_t   bytes[BUDGET_NCACHES];
+    uint64_t hits[BUDGET_NCACHES];     /* recent (decayed) */
+    uint64_t shrunk[BUDGET_NCACHES];   /* entries given up to the budget */
+};
+
+/* set the budget to 'bytes' (0: no limit, the caches keep their own
+ * sizes). What is charged already stays charged.
+ */
+void budget_init(size_t bytes);
+size_t budget_limit(void);
+
+/* cache 'id' takes part. Entries charged before are kept. */
+void budget_register(int id, const struct budget_cache *c);
+
+/* 'bytes' of tables held until released with a negative 'bytes' */
+void budget_reserve(long bytes);
+
+/* cache 'id' took 'n' more entries (n < 0: gave them up). Never
+ * shrinks anything, so it may be called with the cache's lock held.
+ */
+void budget_charge(int id, int n);
+
+/* cache 'id' answered 'n' lookups without a miss */
+void budget_hits(int id, int n);
+
+/* while over budget, take an entry from the cache whose memory is
+ * worth least: recent hits per byte, weighted by the refill cost.
+ * Call it after charging, with no cache lock held. Gives up if no
+ * cache can shrink; the next charge tries again.
+ */
+void budget_balance(void);
+
+void budget_get_stats(struct budget_stats *st);
+
+#endif
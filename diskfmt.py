@@ -1,6 +1,9 @@
 from ctypes import *
 
 MAGIC = 0x30303635
+FEAT_LBA64 = 0x1
+FEAT_BITMAP = 0x2
+BITMAP_BITS = 4096 * 8                  # blocks per bitmap block
 
 class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
@@ -10,7 +13,13 @@ class dirent(Structure):
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("flags", c_uint),
+                ("_pad0", c_uint),
+                ("disk_sz64", c_ulonglong),
+                ("bitmap_blocks", c_uint),
+                ("_pad1", c_uint),
+                ("bitmap_ext", c_ulonglong),
+                ("_pad", c_char * 4056)]
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -21,6 +30,16 @@ class inode(Structure):
                 ("size", c_int),
                 ("ptrs", c_uint * 1019)]
 
+# inode of an image with FEAT_LBA64 set
+class inode64(Structure):
+    _fields_ = [("uid", c_ushort),
+                ("gid", c_ushort),
+                ("mode", c_uint),
+                ("ctime", c_uint),
+                ("mtime", c_uint),
+                ("size", c_longlong),
+                ("ptrs", c_ulonglong * 509)]
+
 class bitmap(Structure):
     _fields_ = [("vals", c_uint * 1024)]
     def get(self, i):
@@ -36,6 +55,18 @@ class bitmap(Structure):
             n = n & (mask ^ 0xffffffff)
         self.vals[i // 32] = n
 
+# the whole block bitmap: block 1, then (with FEAT_BITMAP) the blocks
+# from bitmap_ext on
+class bitmaps(object):
+    def __init__(self, maps):
+        self.maps = maps
+    def get(self, i):
+        if i // BITMAP_BITS >= len(self.maps):
+            return False
+        return self.maps[i // BITMAP_BITS].get(i % BITMAP_BITS)
+    def set(self, i, val):
+        self.maps[i // BITMAP_BITS].set(i % BITMAP_BITS, val)
+
 S_IFMT  = 0o0170000  # bit mask for the file type bit field
 S_IFREG = 0o0100000  # regular file
 S_IFDIR = 0o0040000  # directory
@@ -21,8 +21,14 @@
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "fs5600.h"
+#include "budget.h"
 
 
 /* if you don't understand why you can't use these system calls here,
@@ -45,87 +51,1656 @@
  *   to/from memory "buf".
  *     (see implementations in misc.c)
  */
-extern int block_read(void *buf, int lba, int nblks);
-extern int block_write(void *buf, int lba, int nblks);
+extern int block_read(void *buf, lba_t lba, int nblks);
+extern int block_write(void *buf, lba_t lba, int nblks);
 
+/* vectored versions: transfer "n" blocks, block i going between
+ *   memory "bufs[i]" and block id "lbas[i]".
+ *   The blocks need not be contiguous on disk; use these when a
+ *   request touches several blocks so they move in one call.
+ */
+extern int block_readv(void **bufs, const lba_t *lbas, int n);
+extern int block_writev(void **bufs, const lba_t *lbas, int n);
+
+/* the same for file data, as opposed to metadata (inodes, directories,
+ *   the bitmap): the buffer cache keeps metadata in preference.
+ */
+extern int block_data_readv(void **bufs, const lba_t *lbas, int n);
+extern int block_data_writev(void **bufs, const lba_t *lbas, int n);
+
+/* make everything written so far durable on the image, including
+ *   blocks still dirty in the buffer cache. In RAM-disk mode this is a
+ *   checkpoint: the blocks changed since the last one are written back.
+ * block_writeback starts writing back dirty cached blocks without
+ *   waiting. Both report -EIO for an earlier failed write-back:
+ *   block_flush any since the last flush, block_writeback each once.
+ */
+extern int block_flush(void);
+extern int block_writeback(void);
+
+/* 1 if block_write may leave blocks in memory until block_writeback or
+ *   block_flush (a write-back buffer cache), 0 if every write reaches
+ *   the backend before it returns.
+ */
+extern int block_write_back(void);
+
+/* block_map returns a pointer to block "lba" inside the mapped image,
+ *   or NULL when the image is not mapped (see block_mmap_init).
+ * block_advise passes an access pattern hint (POSIX_FADV_*) for a
+ *   range of blocks down to the host.
+ */
+extern void *block_map(lba_t lba);
+extern void block_advise(lba_t lba, int nblks, int advice);
+
+/* start reading "n" file data blocks "lbas" that will be read soon, in
+ *   the background (into the buffer cache, or the host's page cache).
+ *   Returns how many were taken, from the first; the buffer cache may
+ *   have no room for the rest yet.
+ */
+extern int block_prefetch(const lba_t *lbas, int n);
+
+/* keep a block in the buffer cache (if mounted with one) until
+ *   unpinned, for metadata needed by every operation.
+ */
+extern int block_pin(lba_t lba);
+extern void block_unpin(lba_t lba);
+
+/* block_warm_save records which blocks are hot in the buffer cache, in
+ *   a file next to the image; block_warm_load starts reading them back
+ *   into the cache in the background, after a restart.
+ */
+extern int block_warm_save(void);
+extern int block_warm_load(void);
+
+/* one-block scratch buffers, aligned so they can be used for
+ *   O_DIRECT I/O. Use these instead of FS_BLOCK_SIZE arrays on the
+ *   stack for blocks passed to block_read/block_write.
+ */
+extern void *block_buf_get(void);
+extern void block_buf_put(void *buf);
+
+/* start copying the blocks in use to any out-of-date copy of a
+ *   mirrored image set, in the background (no-op otherwise).
+ */
+extern void block_resync(const unsigned char *map, lba_t nblocks);
+
+/* block_discard tells the host that blocks are no longer in use (their
+ *   space may be released); block_zeroed is 1 if a block is known to
+ *   read back as zeros, so zero-filling it can be skipped.
+ */
+extern void block_discard(lba_t lba, int nblks);
+extern int block_zeroed(lba_t lba);
+
+/* Get block "lba" for reading: a pointer straight into the image
+ * mapping if there is one, otherwise the block is read into "buf".
+ * Returns NULL on I/O error.
+ */
+static const void *block_get(lba_t lba, void *buf)
+{
+    const void *p = block_map(lba);
+    if (p != NULL) {
+        return p;
+    }
+    return block_read(buf, lba, 1) < 0 ? NULL : buf;
+}
+
+
+
+// === FS global states ===
+
+lba_t num_blocks = 0;
+
+/* set when the image is in FS_FEAT_LBA64 format (struct fs_inode64) */
+int fs_lba64 = 0;
+
+
+/* bitmap functions
+ */
+void bit_set(unsigned char *map, lba_t i)
+{
+    map[i/8] |= (1 << (i%8));
+}
+void bit_clear(unsigned char *map, lba_t i)
+{
+    map[i/8] &= ~(1 << (i%8));
+}
+int bit_test(unsigned char *map, lba_t i)
+{
+    return map[i/8] & (1 << (i%8));
+}
+
+
+
+/* The block bitmap, one bit per block. Block 1 holds the first
+ * BITMAP_BITS bits; an FS_FEAT_BITMAP image keeps the rest in the
+ * blocks from sb.bitmap_ext on. It is read in whole at mount (one
+ * block per 128 MiB of image), where its bits are counted, and a
+ * change writes back only the bitmap block it is in. 'bitmap_used'
+ * follows every change, so statfs doesn't have to count. Blocks past
+ * what the bitmap covers (on an image of more than BITMAP_BITS blocks
+ * without FS_FEAT_BITMAP) count as in use: they are never allocated,
+ * and a block number there, as from a damaged inode, is never looked
+ * up in or freed from the bitmap.
+ */
+#define BITMAP_BITS (FS_BLOCK_SIZE * 8)     /* per bitmap block */
+
+static unsigned char *block_bitmap;         /* bitmap_nblocks blocks */
+static lba_t  bitmap_nblocks, bitmap_ext;
+static lba_t  bitmap_bits;                  /* blocks it covers */
+static lba_t  bitmap_used;                  /* bits set */
+static lba_t  bitmap_next;                  /* where the next search starts */
+static lba_t *bitmap_runmax;                /* per bitmap block; see alloc_run */
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static lba_t bitmap_lba(lba_t k) {
+    return k == 0 ? 1 : bitmap_ext + k - 1;
+}
+
+/* write back the bitmap block holding bit 'i'. With bitmap_lock held.
+ */
+static int bitmap_put(lba_t i) {
+    lba_t k = i / BITMAP_BITS;
+    return block_write(block_bitmap + k * FS_BLOCK_SIZE, bitmap_lba(k), 1);
+}
+
+/* the bits set, counted a 64-bit word at a time. With bitmap_lock
+ * held.
+ */
+static lba_t bitmap_count(void) {
+    lba_t n = 0;
+    for (lba_t w = 0; w * 64 < bitmap_bits; w++) {
+        uint64_t v;
+        memcpy(&v, block_bitmap + w * 8, sizeof(v));
+        if (bitmap_bits - w * 64 < 64) {
+            // (only the bits of blocks that exist)
+            v &= ~(uint64_t)0 >> (64 - (bitmap_bits - w * 64));
+        }
+        n += __builtin_popcountll(v);
+    }
+    return n;
+}
+
+/* count the bits set; if that isn't what bitmap_used says, say so and
+ * believe the bitmap. Returns the count. Run at mount and unmount, and
+ * callable from a test or checker at any time.
+ */
+lba_t bitmap_verify(void) {
+    pthread_mutex_lock(&bitmap_lock);
+    lba_t n = bitmap_count();
+    if (n != bitmap_used) {
+        fprintf(stderr, "bitmap: %lld blocks in use, counted %lld\n",
+                (long long)bitmap_used, (long long)n);
+        bitmap_used = n;
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    return n;
+}
+
+/* (re)allocate the bitmap for the current image and read it in with
+ * one request; 0, -ENOMEM or -EIO
+ */
+static int bitmap_init(void) {
+    free(block_bitmap);
+    free(bitmap_runmax);
+    block_bitmap = calloc(bitmap_nblocks, FS_BLOCK_SIZE);
+    bitmap_runmax = malloc(bitmap_nblocks * sizeof(*bitmap_runmax));
+    void **bufs = calloc(bitmap_nblocks, sizeof(*bufs));
+    lba_t *lbas = calloc(bitmap_nblocks, sizeof(*lbas));
+    int rv = -ENOMEM;
+    if (block_bitmap != NULL && bitmap_runmax != NULL && bufs != NULL && lbas != NULL) {
+        for (lba_t k = 0; k < bitmap_nblocks; k++) {
+            bufs[k] = block_bitmap + k * FS_BLOCK_SIZE;
+            lbas[k] = bitmap_lba(k);
+            bitmap_runmax[k] = -1;
+        }
+        rv = block_readv(bufs, lbas, bitmap_nblocks) < 0 ? -EIO : 0;
+    }
+    free(bufs);
+    free(lbas);
+    bitmap_next = 0;
+    bitmap_used = (rv == 0) ? bitmap_count() : 0;
+    return rv;
+}
+
+/* nonzero if block 'i' is in use (or out of range)
+ */
+int bitmap_test(lba_t i) {
+    if (i < 0 || i >= bitmap_bits) {
+        return 1;
+    }
+    pthread_mutex_lock(&bitmap_lock);
+    int rv = bit_test(block_bitmap, i);
+    pthread_mutex_unlock(&bitmap_lock);
+    return rv;
+}
+
+/* mark block 'i' in use, or free, on disk too. 0 or -EIO (also for a
+ * block the bitmap doesn't cover).
+ */
+int bitmap_mark(lba_t i, int used) {
+    if (i < 0 || i >= bitmap_bits) {
+        return -EIO;
+    }
+    pthread_mutex_lock(&bitmap_lock);
+    if (!bit_test(block_bitmap, i) != !used) {
+        bitmap_used += used ? 1 : -1;
+    }
+    if (used) {
+        bit_set(block_bitmap, i);
+    } else {
+        bit_clear(block_bitmap, i);
+        bitmap_runmax[i / BITMAP_BITS] = -1;
+    }
+    int rv = bitmap_put(i) < 0 ? -EIO : 0;
+    pthread_mutex_unlock(&bitmap_lock);
+    return rv;
+}
+
+/* word 'w' of the bitmap: the bits of blocks 64w .. 64w+63, lowest
+ * block in the lowest bit. With bitmap_lock held.
+ */
+static uint64_t bitmap_word(lba_t w) {
+    uint64_t v;
+    memcpy(&v, block_bitmap + w * 8, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* the first word in [w, end) with a block in it whose bit is not
+ * 'bit' (so a free block if 'bit' is 1, a used one if 0), or 'end'.
+ * Built with AVX2, runs of words of nothing but 'bit' go 256 bits at
+ * a time.
+ */
+static lba_t bitmap_skip(lba_t w, lba_t end, int bit) {
+    uint64_t all = bit ? ~(uint64_t)0 : 0;
+#ifdef __AVX2__
+    const __m256i ones = _mm256_set1_epi64x(-1);
+#endif
+    while (w < end) {
+#ifdef __AVX2__
+        if (w % 4 == 0 && w + 4 <= end) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(block_bitmap + w * 8));
+            if (bit ? _mm256_testc_si256(x, ones) : _mm256_testz_si256(x, x)) {
+                w += 4;
+                continue;
+            }
+        }
+#endif
+        if (bitmap_word(w) != all) {
+            break;
+        }
+        w++;
+    }
+    return w;
+}
+
+/* first block in [start, end) whose bit is not 'bit', or 'end': the
+ * first free block if 'bit' is 1, the first used one if 0. With
+ * bitmap_lock held. Looks at a 64-bit word at a time.
+ */
+static lba_t bitmap_scan(lba_t start, lba_t end, int bit) {
+    if (start >= end) {
+        return end;
+    }
+    uint64_t flip = bit ? 0 : ~(uint64_t)0;
+
+    // (blocks before start count as 'bit')
+    lba_t w = start / 64;
+    uint64_t v = (bitmap_word(w) ^ flip) | (((uint64_t)1 << (start % 64)) - 1);
+    while (w * 64 < end) {
+        if (v != ~(uint64_t)0) {
+            lba_t b = w * 64 + __builtin_ctzll(~v);
+            return b < end ? b : end;
+        }
+        w = bitmap_skip(w + 1, (end + 63) / 64, bit);
+        if (w * 64 < end) {
+            v = bitmap_word(w) ^ flip;
+        }
+    }
+    return end;
+}
+
+/* first run of 'n' free blocks in [lo, hi), or -1. The longest run
+ * seen, if longer than '*best_len', goes in '*best' / '*best_len'.
+ * With bitmap_lock held.
+ */
+static lba_t bitmap_run(lba_t lo, lba_t hi, lba_t n, lba_t *best, lba_t *best_len) {
+    lba_t s = bitmap_scan(lo, hi, 1);
+    while (s < hi) {
+        lba_t e = bitmap_scan(s, hi, 0);
+        if (e - s >= n) {
+            return s;
+        }
+        if (e - s > *best_len) {
+            *best = s;
+            *best_len = e - s;
+        }
+        s = bitmap_scan(e, hi, 1);
+    }
+    return -1;
+}
+
+/* Allocate a run of up to 'n' contiguous blocks: 'n' if there is a
+ * free run that long, else the longest there is. Returns how many,
+ * the first at *start; or -ENOSPC or -EIO.
+ *
+ * The search is next fit: it starts where the last allocation ended
+ * and wraps around, so a run of allocations doesn't rescan the blocks
+ * in use before it. It goes one bitmap block (group of BITMAP_BITS
+ * blocks) at a time, and runs don't cross groups. bitmap_runmax is the
+ * free-extent index: for each group, a bound on its longest free run,
+ * learned when a search goes through the whole group and forgotten
+ * when a block in it is freed. Groups known to have no run long
+ * enough are passed over without looking at them.
+ */
+lba_t alloc_run(lba_t n, lba_t *start) {
+    pthread_mutex_lock(&bitmap_lock);
+    if (bitmap_next >= bitmap_bits) {
+        bitmap_next = 0;
+    }
+
+    // 1. a run of n, from the cursor on, through every group and back
+    //    to the cursor
+    lba_t g0 = bitmap_next / BITMAP_BITS;
+    lba_t s = -1, best = -1, best_len = 0;
+    for (lba_t k = 0; k <= bitmap_nblocks && s < 0; k++) {
+        lba_t g = (g0 + k) % bitmap_nblocks;
+        lba_t lo = g * BITMAP_BITS;
+        lba_t hi = (lo + BITMAP_BITS < bitmap_bits) ? lo + BITMAP_BITS : bitmap_bits;
+        int whole = 1;
+        if (k == 0 && bitmap_next > lo) {
+            lo = bitmap_next;
+            whole = 0;
+        } else if (k == bitmap_nblocks) {
+            hi = bitmap_next;
+            whole = 0;
+        }
+        if (lo >= hi || (bitmap_runmax[g] >= 0 && bitmap_runmax[g] < n)) {
+            continue;
+        }
+        lba_t gbest = -1, glen = 0;
+        s = bitmap_run(lo, hi, n, &gbest, &glen);
+        if (s < 0 && whole) {
+            bitmap_runmax[g] = glen;
+        }
+        if (glen > best_len) {
+            best = gbest;
+            best_len = glen;
+        }
+    }
+
+    // 2. a run across the cursor is in neither half of its group: look
+    //    at the whole of it
+    if (s < 0 && bitmap_next % BITMAP_BITS != 0 &&
+        !(bitmap_runmax[g0] >= 0 && bitmap_runmax[g0] < n)) {
+        lba_t lo = g0 * BITMAP_BITS;
+        lba_t hi = (lo + BITMAP_BITS < bitmap_bits) ? lo + BITMAP_BITS : bitmap_bits;
+        lba_t gbest = -1, glen = 0;
+        s = bitmap_run(lo, hi, n, &gbest, &glen);
+        if (s < 0) {
+            bitmap_runmax[g0] = glen;
+        }
+        if (glen > best_len) {
+            best = gbest;
+            best_len = glen;
+        }
+    }
+
+    // 3. else the longest run there is, which may be in a group passed
+    //    over above or not looked at since a block in it was freed
+    for (lba_t g = 0; s < 0 && g < bitmap_nblocks; g++) {
+        if (bitmap_runmax[g] < 0 || bitmap_runmax[g] > best_len) {
+            lba_t lo = g * BITMAP_BITS;
+            lba_t hi = (lo + BITMAP_BITS < bitmap_bits) ? lo + BITMAP_BITS : bitmap_bits;
+            lba_t gbest = -1, glen = 0;
+            bitmap_run(lo, hi, n, &gbest, &glen);
+            bitmap_runmax[g] = glen;
+            if (glen > best_len) {
+                best = gbest;
+                best_len = glen;
+            }
+        }
+    }
+    if (s < 0) {
+        s = best;
+        n = best_len;
+    }
+    if (n == 0 || s < 0) {
+        pthread_mutex_unlock(&bitmap_lock);
+        return -ENOSPC;
+    }
+
+    // 4. mark it in use, and write back its bitmap block (a run is
+    //    always within one)
+    for (lba_t b = s; b < s + n; b++) {
+        bit_set(block_bitmap, b);
+    }
+    if (bitmap_put(s) < 0) {
+        for (lba_t b = s; b < s + n; b++) {
+            bit_clear(block_bitmap, b);
+        }
+        pthread_mutex_unlock(&bitmap_lock);
+        return -EIO;
+    }
+    bitmap_used += n;
+    bitmap_next = s + n;
+    pthread_mutex_unlock(&bitmap_lock);
+
+    *start = s;
+    return n;
+}
+
+/*
+ * Allocate a free block from the disk.
+ *
+ * success - return free block number
+ * no free block - return -ENOSPC
+ *
+ * hint:
+ *   - bit_set/bit_test might be useful.
+ */
+lba_t alloc_blk() {
+    // A run of one block, from where the last allocation left off
+    lba_t i;
+    lba_t n = alloc_run(1, &i);
+
+    // (-ENOSPC if no free block is found)
+    return n < 0 ? n : i;
+}
+
+void inode_forget(lba_t inum);   /* see the inode cache below */
+
+/*
+ * Return a block to disk, which can be used later.
+ *
+ * hint:
+ *   - bit_clear might be useful.
+ */
+void free_blk(lba_t i) {
+    // printf("\nfreeing block #%d\n", i);
+    // (not a block the file system could have allocated)
+    if (i <= 0 || i >= bitmap_bits) {
+        return;
+    }
+
+    // Clear the corresponding bit in the block bitmap, on disk too
+    bitmap_mark(i, 0);
+
+    // An inode cached for this block must not be written over its
+    // next use
+    inode_forget(i);
+
+    // Let the host release the space (if mounted with -discard)
+    block_discard(i, 1);
+}
+
+
+// === FS global states ===
+
+int DIR_ENTRY_NUM = FS_BLOCK_SIZE / sizeof(struct fs_dirent);
+
+
+// === inode conversion ===
+
+/* number of block pointers in an inode of this image */
+int inode_nptrs(void) {
+    return fs_lba64 ? NUM_PTRS_INODE64 : NUM_PTRS_INODE;
+}
+
+/* pointer "i" of an on-disk inode block, in either format */
+lba_t raw_inode_ptr(const void *raw, int i) {
+    if (fs_lba64) {
+        return ((const struct fs_inode64 *)raw)->ptrs[i];
+    }
+    return ((const struct fs_inode *)raw)->ptrs[i];
+}
+
+/* on-disk inode block (either format) -> in-memory inode */
+void inode_from_disk(struct fs_inode_mem *in, const void *raw) {
+    const struct fs_inode *d32 = raw;
+    const struct fs_inode64 *d64 = raw;
+
+    memset(in, 0, sizeof(*in));
+    in->uid = d32->uid;     // the header fields line up in both formats
+    in->gid = d32->gid;
+    in->mode = d32->mode;
+    in->ctime = d32->ctime;
+    in->mtime = d32->mtime;
+    in->size = fs_lba64 ? d64->size : d32->size;
+    for (int i = 0; i < inode_nptrs(); i++) {
+        in->ptrs[i] = raw_inode_ptr(raw, i);
+    }
+}
+
+/* in-memory inode -> on-disk inode block of this image's format */
+void inode_to_disk(void *raw, const struct fs_inode_mem *in) {
+    memset(raw, 0, FS_BLOCK_SIZE);
+    if (fs_lba64) {
+        struct fs_inode64 *d64 = raw;
+        d64->uid = in->uid;
+        d64->gid = in->gid;
+        d64->mode = in->mode;
+        d64->ctime = in->ctime;
+        d64->mtime = in->mtime;
+        d64->size = in->size;
+        for (int i = 0; i < NUM_PTRS_INODE64; i++) {
+            d64->ptrs[i] = in->ptrs[i];
+        }
+    } else {
+        struct fs_inode *d32 = raw;
+        d32->uid = in->uid;
+        d32->gid = in->gid;
+        d32->mode = in->mode;
+        d32->ctime = in->ctime;
+        d32->mtime = in->mtime;
+        d32->size = in->size;
+        for (int i = 0; i < NUM_PTRS_INODE; i++) {
+            d32->ptrs[i] = in->ptrs[i];
+        }
+    }
+}
+
+/**
+ * Read inode "inum" from disk into its in-memory form.
+ * Returns 0 or -EIO.
+ */
+static int inode_read_disk(lba_t inum, struct fs_inode_mem *in) {
+    void *raw = block_buf_get();
+    const void *p = (raw != NULL) ? block_get(inum, raw) : NULL;
+    if (p != NULL) {
+        inode_from_disk(in, p);
+    }
+    block_buf_put(raw);
+    return p != NULL ? 0 : -EIO;
+}
+
+/**
+ * Write the in-memory inode back to block "inum".
+ * Returns 0 or -EIO.
+ */
+static int inode_write_disk(lba_t inum, struct fs_inode_mem *in) {
+    void *raw = block_buf_get();
+    if (raw == NULL) {
+        return -EIO;
+    }
+    inode_to_disk(raw, in);
+    int rv = block_write(raw, inum, 1);
+    block_buf_put(raw);
+    return rv < 0 ? -EIO : 0;
+}
+
+
+// === inode cache ===
+
+/* Decoded inodes, by inode number, so that stats and small reads of
+ * hot files don't go to the block layer at all. Over a write-back
+ * buffer cache inode_write only updates the cached copy and marks it
+ * dirty; dirty inodes are written when they are evicted (least
+ * recently used first) and by inode_sync. Otherwise (no buffer cache,
+ * -dirty 0, the RAM backend) it writes through, so an inode is no less
+ * durable than the blocks around it. Entries are allocated as they are
+ * needed, up to icache_size, and charged to the memory budget, which
+ * may take the oldest back (icache_shrink). fs_icache_size(0) turns the
+ * cache off, and if it can't be allocated every call goes to disk.
+ */
+#define ICACHE_SIZE 512         /* inodes (default); about 8 KB each */
+
+struct icache_ent {
+    lba_t inum;                 /* -1 if unused */
+    int   dirty;
+    struct icache_ent *hnext;   /* hash chain */
+    struct icache_ent *prev, *next;   /* LRU list, most recent first */
+    struct fs_inode_mem in;
+};
+
+static struct icache_ent **icache_hash;    /* NULL: no cache */
+static int icache_size = ICACHE_SIZE;       /* most entries */
+static int icache_n;                        /* entries allocated */
+static struct icache_ent *icache_head, *icache_tail;
+static int icache_err;          /* a write-back failed since inode_sync */
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct icache_ent **icache_bucket(lba_t inum) {
+    return &icache_hash[(uint64_t)inum % (2 * icache_size)];
+}
+
+static struct icache_ent *icache_lookup(lba_t inum) {
+    struct icache_ent *e = *icache_bucket(inum);
+    while (e != NULL && e->inum != inum) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void icache_unhash(struct icache_ent *e) {
+    struct icache_ent **pp = icache_bucket(e->inum);
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    e->inum = -1;
+}
+
+static void icache_unlink(struct icache_ent *e) {
+    *(e->prev ? &e->prev->next : &icache_head) = e->next;
+    *(e->next ? &e->next->prev : &icache_tail) = e->prev;
+}
+
+/* move to the front (mru) or the back of the LRU list */
+static void icache_move(struct icache_ent *e, int mru) {
+    icache_unlink(e);
+    if (mru) {
+        e->prev = NULL;
+        e->next = icache_head;
+        *(icache_head ? &icache_head->prev : &icache_tail) = e;
+        icache_head = e;
+    } else {
+        e->next = NULL;
+        e->prev = icache_tail;
+        *(icache_tail ? &icache_tail->next : &icache_head) = e;
+        icache_tail = e;
+    }
+}
+
+/* Take an entry for "inum": a new one while there is room for it, else
+ * the least recently used, writing it back if it is dirty. Returns NULL
+ * if there is none or that write fails (the entry stays cached and
+ * dirty); the caller then goes to disk itself.
+ */
+static struct icache_ent *icache_alloc(lba_t inum) {
+    struct icache_ent *e = NULL;
+    if (icache_n < icache_size && (e = malloc(sizeof(*e))) != NULL) {
+        // (at the back, so it is the one taken below)
+        e->inum = -1;
+        e->dirty = 0;
+        e->next = NULL;
+        e->prev = icache_tail;
+        *(icache_tail ? &icache_tail->next : &icache_head) = e;
+        icache_tail = e;
+        icache_n++;
+        budget_charge(BUDGET_ICACHE, 1);
+    }
+    e = icache_tail;
+    if (e == NULL) {
+        return NULL;
+    }
+    if (e->dirty) {
+        if (inode_write_disk(e->inum, &e->in) < 0) {
+            icache_err = -EIO;
+            return NULL;
+        }
+        e->dirty = 0;
+    }
+    if (e->inum >= 0) {
+        icache_unhash(e);
+    }
+    e->inum = inum;
+    struct icache_ent **b = icache_bucket(inum);
+    e->hnext = *b;
+    *b = e;
+    return e;
+}
+
+/* Give the least recently used entry back to the memory budget,
+ * writing it back first if it is dirty (see budget.h).
+ */
+static int icache_shrink(void) {
+    if (pthread_mutex_trylock(&icache_lock) != 0) {
+        return 0;
+    }
+    struct icache_ent *e = icache_tail;
+    if (e != NULL && e->dirty && inode_write_disk(e->inum, &e->in) < 0) {
+        icache_err = -EIO;
+        e = NULL;
+    }
+    if (e != NULL) {
+        if (e->inum >= 0) {
+            icache_unhash(e);
+        }
+        icache_unlink(e);
+        free(e);
+        icache_n--;
+        budget_charge(BUDGET_ICACHE, -1);
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return e != NULL;
+}
+
+/* Free every entry, without writing anything back */
+static void icache_clear(void) {
+    while (icache_head != NULL) {
+        struct icache_ent *e = icache_head;
+        icache_head = e->next;
+        free(e);
+    }
+    icache_tail = NULL;
+    budget_charge(BUDGET_ICACHE, -icache_n);
+    icache_n = 0;
+}
+
+/* Empty the cache and free its table, to be set up for a new size */
+static void icache_free(void) {
+    icache_clear();
+    if (icache_hash != NULL) {
+        free(icache_hash);
+        icache_hash = NULL;
+        budget_reserve(-(long)(2 * icache_size * sizeof(*icache_hash)));
+    }
+}
+
+/* Set up the cache, or empty it without writing anything back (at
+ * mount, the image may not be the one the old entries came from).
+ */
+static void icache_init(void) {
+    icache_clear();
+    if (icache_hash == NULL && icache_size > 0) {
+        icache_hash = calloc(2 * icache_size, sizeof(*icache_hash));
+        if (icache_hash == NULL) {
+            fprintf(stderr, "cannot allocate the inode cache, running without it\n");
+            return;
+        }
+        budget_reserve(2 * icache_size * sizeof(*icache_hash));
+    }
+    if (icache_hash == NULL) {
+        return;
+    }
+    memset(icache_hash, 0, 2 * icache_size * sizeof(*icache_hash));
+    icache_err = 0;
+    struct budget_cache c = {sizeof(struct icache_ent), 1, icache_shrink};
+    budget_register(BUDGET_ICACHE, &c);
+}
+
+/* Make the cache hold "n" inodes, 0 for no cache (lab5fuse -noicache),
+ * from the next fs_init on; not while mounted. A memory budget
+ * (fs_cache_budget) leaves a cache turned off that way off.
+ */
+void fs_icache_size(int n) {
+    icache_free();
+    icache_size = n > 0 ? n : 0;
+}
+
+/**
+ * Get inode "inum" in its in-memory form, from the inode cache or disk.
+ * Returns 0 or -EIO.
+ */
+int inode_read(lba_t inum, struct fs_inode_mem *in) {
+    if (icache_hash == NULL) {
+        return inode_read_disk(inum, in);
+    }
+    int rv = 0, hit = 0;
+    pthread_mutex_lock(&icache_lock);
+    struct icache_ent *e = icache_lookup(inum);
+    if (e != NULL) {
+        *in = e->in;
+        hit = 1;
+    } else if ((rv = inode_read_disk(inum, in)) == 0 &&
+               (e = icache_alloc(inum)) != NULL) {
+        e->in = *in;
+    }
+    if (e != NULL) {
+        icache_move(e, 1);
+    }
+    pthread_mutex_unlock(&icache_lock);
+    if (hit) {
+        budget_hits(BUDGET_ICACHE, 1);
+    } else {
+        budget_balance();
+    }
+    return rv;
+}
+
+/**
+ * Read the "n" inodes "inums" into "ins"; the ones not cached are read
+ * from disk in one batch. Returns 0 or -EIO.
+ */
+int inode_readv(const lba_t *inums, struct fs_inode_mem *ins, int n) {
+    void **bufs = calloc(n, sizeof(void *));
+    lba_t *lbas = calloc(n, sizeof(lba_t));
+    int *idx = calloc(n, sizeof(int));
+    int nmiss = 0, nhit = 0, rv = 0;
+    if (n > 0 && (bufs == NULL || lbas == NULL || idx == NULL)) {
+        rv = -ENOMEM;
+        goto out;
+    }
+
+    // 1. copy out the cached ones, collect the rest
+    pthread_mutex_lock(&icache_lock);
+    for (int i = 0; i < n; i++) {
+        struct icache_ent *e = (icache_hash != NULL) ? icache_lookup(inums[i]) : NULL;
+        if (e != NULL) {
+            ins[i] = e->in;
+            icache_move(e, 1);
+            nhit++;
+        } else {
+            lbas[nmiss] = inums[i];
+            idx[nmiss++] = i;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    // 2. read the misses in one call and decode them
+    for (int i = 0; i < nmiss && rv == 0; i++) {
+        if ((bufs[i] = block_buf_get()) == NULL) {
+            rv = -ENOMEM;
+        }
+    }
+    if (rv == 0 && nmiss > 0 && block_readv(bufs, lbas, nmiss) < 0) {
+        rv = -EIO;
+    }
+    pthread_mutex_lock(&icache_lock);
+    for (int i = 0; i < nmiss && rv == 0; i++) {
+        inode_from_disk(&ins[idx[i]], bufs[i]);
+        // (dirtied by someone else in the meantime: the cache is newer)
+        struct icache_ent *e = NULL;
+        if (icache_hash != NULL && (e = icache_lookup(lbas[i])) == NULL &&
+            (e = icache_alloc(lbas[i])) != NULL) {
+            e->in = ins[idx[i]];
+        } else if (e != NULL) {
+            ins[idx[i]] = e->in;
+        }
+        if (e != NULL) {
+            icache_move(e, 1);
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+    for (int i = 0; i < nmiss; i++) {
+        block_buf_put(bufs[i]);
+    }
+    if (nhit > 0) {
+        budget_hits(BUDGET_ICACHE, nhit);
+    }
+    budget_balance();
+
+out:
+    free(bufs);
+    free(lbas);
+    free(idx);
+    return rv;
+}
+
+/* Store inode "inum" in the cache, and write it to the block layer
+ * too if "through" (or if it can't be cached). Returns 0 or -EIO.
+ */
+static int icache_store(lba_t inum, struct fs_inode_mem *in, int through) {
+    if (icache_hash == NULL) {
+        return inode_write_disk(inum, in);
+    }
+    int rv = 0;
+    pthread_mutex_lock(&icache_lock);
+    struct icache_ent *e = icache_lookup(inum);
+    if (e == NULL) {
+        e = icache_alloc(inum);
+    }
+    if (e != NULL) {
+        e->in = *in;
+        icache_move(e, 1);
+    }
+    if (e == NULL || through) {
+        rv = inode_write_disk(inum, in);
+    }
+    if (e != NULL) {
+        e->dirty = (!through || rv < 0);
+    }
+    pthread_mutex_unlock(&icache_lock);
+    budget_balance();
+    return rv;
+}
+
+/**
+ * Store inode "inum". Over a write-back buffer cache this only updates
+ * the cached copy; it reaches the disk at eviction or inode_sync.
+ * Returns 0 or -EIO.
+ */
+int inode_write(lba_t inum, struct fs_inode_mem *in) {
+    return icache_store(inum, in, !block_write_back());
+}
+
+/**
+ * Store inode "inum" and hand it to the block layer now, whatever the
+ * cache mode: for a new inode, before a directory entry names it.
+ * Returns 0 or -EIO.
+ */
+int inode_write_through(lba_t inum, struct fs_inode_mem *in) {
+    return icache_store(inum, in, 1);
+}
+
+/**
+ * Drop inode "inum" from the cache without writing it back: its block
+ * was freed, and may be reused for anything.
+ */
+void inode_forget(lba_t inum) {
+    if (icache_hash == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&icache_lock);
+    struct icache_ent *e = icache_lookup(inum);
+    if (e != NULL) {
+        icache_unhash(e);
+        e->dirty = 0;
+        icache_move(e, 0);
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
+
+/**
+ * Write every dirty cached inode to the block layer.
+ * Returns -EIO if that, or an eviction since the last call, failed.
+ */
+int inode_sync(void) {
+    if (icache_hash == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&icache_lock);
+    int rv = icache_err;
+    icache_err = 0;
+    for (struct icache_ent *e = icache_head; e != NULL; e = e->next) {
+        if (e->dirty) {
+            if (inode_write_disk(e->inum, &e->in) < 0) {
+                rv = -EIO;
+            } else {
+                e->dirty = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return rv;
+}
+
+
+// === dentry cache ===
+
+/* Results of looking a name up in a directory: (parent inum, name) ->
+ * child inum, or -ENOENT for a name known not to exist (so the probes
+ * of create and mkdir don't read the directory block). Replacement is
+ * CLOCK. Every change to a directory must update or drop its entries:
+ * create/mkdir, unlink/rmdir and rename do, after writing the directory
+ * block. Each such update bumps a generation number; a lookup takes the
+ * number before it reads a directory, and its answer is only cached if
+ * nothing changed meanwhile (it may be stale otherwise). Entries are
+ * allocated as needed, up to dcache_size, and charged to the memory
+ * budget like those of the inode cache. Without memory for the table
+ * nothing is cached.
+ */
+#define DCACHE_SIZE 4096        /* entries (default) */
+#define DCACHE_NAME 28
+
+struct dcache_ent {
+    lba_t parent;               /* -1 if unused */
+    int   inum;                 /* or -ENOENT */
+    int   ref;                  /* used since the clock hand passed */
+    char  name[DCACHE_NAME];
+    struct dcache_ent *hnext;
+    struct dcache_ent *prev, *next;   /* clock ring */
+};
+
+static struct dcache_ent **dcache_hash;    /* NULL: no cache */
+static int dcache_size = DCACHE_SIZE;       /* most entries */
+static int dcache_n;
+static struct dcache_ent *dcache_hand;      /* NULL while empty */
+static uint64_t dcache_gen;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dcache_ent **dcache_bucket(lba_t parent, const char *name) {
+    uint64_t h = (uint64_t)parent * 0x9e3779b97f4a7c15ull;
+    for (const char *c = name; *c; c++) {
+        h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+    }
+    return &dcache_hash[h % (2 * dcache_size)];
+}
+
+static struct dcache_ent *dcache_find(lba_t parent, const char *name) {
+    struct dcache_ent *e = *dcache_bucket(parent, name);
+    while (e != NULL && (e->parent != parent || strcmp(e->name, name) != 0)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void dcache_unhash(struct dcache_ent *e) {
+    struct dcache_ent **pp = dcache_bucket(e->parent, e->name);
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    e->parent = -1;
+}
+
+/* the entry the clock hand stops at: the first unused one, or not
+ * used since the hand last passed it. The ring must not be empty.
+ */
+static struct dcache_ent *dcache_victim(void) {
+    while (dcache_hand->parent >= 0 && dcache_hand->ref) {
+        dcache_hand->ref = 0;
+        dcache_hand = dcache_hand->next;
+    }
+    return dcache_hand;
+}
+
+/* take entry "e" off the ring, and free it */
+static void dcache_release(struct dcache_ent *e) {
+    if (e->parent >= 0) {
+        dcache_unhash(e);
+    }
+    if (e->next == e) {
+        dcache_hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (dcache_hand == e) {
+            dcache_hand = e->next;
+        }
+    }
+    free(e);
+    dcache_n--;
+    budget_charge(BUDGET_DCACHE, -1);
+}
+
+/* give the entry the clock hand stops at back to the memory budget */
+static int dcache_shrink(void) {
+    if (pthread_mutex_trylock(&dcache_lock) != 0) {
+        return 0;
+    }
+    int done = (dcache_hand != NULL);
+    if (done) {
+        dcache_release(dcache_victim());
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return done;
+}
+
+/* empty the cache and free its table, to be set up for a new size */
+static void dcache_free(void) {
+    while (dcache_hand != NULL) {
+        dcache_release(dcache_hand);
+    }
+    if (dcache_hash != NULL) {
+        free(dcache_hash);
+        dcache_hash = NULL;
+        budget_reserve(-(long)(2 * dcache_size * sizeof(*dcache_hash)));
+    }
+}
+
+/* empty the cache (at mount) */
+static void dcache_init(void) {
+    while (dcache_hand != NULL) {
+        dcache_release(dcache_hand);
+    }
+    if (dcache_hash == NULL && dcache_size > 0) {
+        dcache_hash = calloc(2 * dcache_size, sizeof(*dcache_hash));
+        if (dcache_hash == NULL) {
+            return;
+        }
+        budget_reserve(2 * dcache_size * sizeof(*dcache_hash));
+    }
+    if (dcache_hash == NULL) {
+        return;
+    }
+    memset(dcache_hash, 0, 2 * dcache_size * sizeof(*dcache_hash));
+    struct budget_cache c = {sizeof(struct dcache_ent), 1, dcache_shrink};
+    budget_register(BUDGET_DCACHE, &c);
+}
+
+/**
+ * Look "name" up in directory "parent". Returns 1 and sets *inum (to
+ * the child, or -ENOENT) if the answer is cached, 0 otherwise.
+ */
+int dcache_lookup(lba_t parent, const char *name, int *inum) {
+    if (dcache_hash == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_ent *e = dcache_find(parent, name);
+    if (e != NULL) {
+        *inum = e->inum;
+        e->ref = 1;
+        budget_hits(BUDGET_DCACHE, 1);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return e != NULL;
+}
+
+/* store "name" in "parent" -> "inum". Called with dcache_lock held. */
+static void dcache_put(lba_t parent, const char *name, int inum) {
+    struct dcache_ent *e = dcache_find(parent, name);
+    if (e == NULL) {
+        // a new entry while there is room for one, just behind the
+        // hand (it gets a full turn); else the one the hand stops at
+        if (dcache_n < dcache_size && (e = malloc(sizeof(*e))) != NULL) {
+            if (dcache_hand == NULL) {
+                e->prev = e->next = dcache_hand = e;
+            } else {
+                e->next = dcache_hand;
+                e->prev = dcache_hand->prev;
+                e->prev->next = e;
+                dcache_hand->prev = e;
+            }
+            dcache_n++;
+            budget_charge(BUDGET_DCACHE, 1);
+        } else if (dcache_hand != NULL) {
+            e = dcache_victim();
+            dcache_hand = e->next;
+            if (e->parent >= 0) {
+                dcache_unhash(e);
+            }
+        } else {
+            return;
+        }
+        e->parent = parent;
+        strcpy(e->name, name);
+        struct dcache_ent **b = dcache_bucket(parent, name);
+        e->hnext = *b;
+        *b = e;
+    }
+    e->inum = inum;
+    e->ref = 1;
+}
+
+/**
+ * The current generation, to pass to dcache_fill: take it before
+ * reading the directory.
+ */
+uint64_t dcache_generation(void) {
+    pthread_mutex_lock(&dcache_lock);
+    uint64_t gen = dcache_gen;
+    pthread_mutex_unlock(&dcache_lock);
+    return gen;
+}
+
+/**
+ * Record that "name" in directory "parent" is "inum" (-ENOENT: does
+ * not exist), as the directory now says after a change to it. Names
+ * too long to be in a directory are not cached.
+ */
+void dcache_add(lba_t parent, const char *name, int inum) {
+    if (dcache_hash == NULL || strlen(name) >= DCACHE_NAME) {
+        return;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    dcache_put(parent, name, inum);
+    pthread_mutex_unlock(&dcache_lock);
+    budget_balance();
+}
+
+/**
+ * Same as dcache_add, for what a lookup found in the directory: not
+ * cached if any directory changed since generation "gen".
+ */
+void dcache_fill(lba_t parent, const char *name, int inum, uint64_t gen) {
+    if (dcache_hash == NULL || strlen(name) >= DCACHE_NAME) {
+        return;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    if (dcache_gen == gen) {
+        dcache_put(parent, name, inum);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    budget_balance();
+}
+
+/**
+ * Drop what is cached for "name" in directory "parent".
+ */
+void dcache_forget(lba_t parent, const char *name) {
+    if (dcache_hash == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    struct dcache_ent *e = dcache_find(parent, name);
+    if (e != NULL) {
+        dcache_unhash(e);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Drop every entry of directory "parent" (it was removed).
+ */
+void dcache_forget_dir(lba_t parent) {
+    if (dcache_hash == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    struct dcache_ent *e = dcache_hand;
+    for (int i = 0; i < dcache_n; i++, e = e->next) {
+        if (e->parent == parent) {
+            dcache_unhash(e);
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+// === path cache ===
+
+/* Whole paths that resolved before: path -> inum, so a repeated
+ * lookup of a deep path is one hash probe instead of a walk. Only
+ * paths that exist, and only in the form FUSE passes them ("/a/b",
+ * no empty components, no trailing '/'), so that dropping a path and
+ * everything under it (pcache_forget) finds every entry it has to.
+ * As with the dentry cache, every pcache_forget bumps a generation
+ * number, and a walk's answer is only cached if it didn't change while
+ * the walk ran. Replacement is CLOCK, and entries are allocated and
+ * charged to the memory budget as for the dentry cache. Without memory
+ * for the table nothing is cached.
+ */
+#define PCACHE_SIZE 4096        /* entries (default) */
+#define PCACHE_PATH 288         /* 10 levels of 27-character names */
+
+struct pcache_ent {
+    uint64_t hash;
+    int   inum;                 /* -1 if unused */
+    int   ref;
+    struct pcache_ent *hnext;
+    struct pcache_ent *prev, *next;   /* clock ring */
+    char  path[PCACHE_PATH];
+};
+
+static struct pcache_ent **pcache_hash;    /* NULL: no cache */
+static int pcache_size = PCACHE_SIZE;       /* most entries */
+static int pcache_n;
+static struct pcache_ent *pcache_hand;      /* NULL while empty */
+static uint64_t pcache_gen;
+static pthread_mutex_t pcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* hash of "path", or 0 if it can't be cached */
+static uint64_t pcache_key(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    const char *c = path;
+    if (*c != '/') {
+        return 0;
+    }
+    for (; *c; c++) {
+        if (c[0] == '/' && (c[1] == '/' || c[1] == '\0')) {
+            return 0;
+        }
+        h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+    }
+    return (c - path < PCACHE_PATH && h != 0) ? h : 0;
+}
+
+static struct pcache_ent *pcache_find(const char *path, uint64_t h) {
+    struct pcache_ent *e = pcache_hash[h % (2 * pcache_size)];
+    while (e != NULL && (e->hash != h || strcmp(e->path, path) != 0)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void pcache_unhash(struct pcache_ent *e) {
+    struct pcache_ent **pp = &pcache_hash[e->hash % (2 * pcache_size)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    e->inum = -1;
+}
+
+/* as dcache_victim */
+static struct pcache_ent *pcache_victim(void) {
+    while (pcache_hand->inum >= 0 && pcache_hand->ref) {
+        pcache_hand->ref = 0;
+        pcache_hand = pcache_hand->next;
+    }
+    return pcache_hand;
+}
+
+/* take entry "e" off the ring, and free it */
+static void pcache_release(struct pcache_ent *e) {
+    if (e->inum >= 0) {
+        pcache_unhash(e);
+    }
+    if (e->next == e) {
+        pcache_hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (pcache_hand == e) {
+            pcache_hand = e->next;
+        }
+    }
+    free(e);
+    pcache_n--;
+    budget_charge(BUDGET_PCACHE, -1);
+}
+
+/* give the entry the clock hand stops at back to the memory budget */
+static int pcache_shrink(void) {
+    if (pthread_mutex_trylock(&pcache_lock) != 0) {
+        return 0;
+    }
+    int done = (pcache_hand != NULL);
+    if (done) {
+        pcache_release(pcache_victim());
+    }
+    pthread_mutex_unlock(&pcache_lock);
+    return done;
+}
 
+/* empty the cache and free its table, to be set up for a new size */
+static void pcache_free(void) {
+    while (pcache_hand != NULL) {
+        pcache_release(pcache_hand);
+    }
+    if (pcache_hash != NULL) {
+        free(pcache_hash);
+        pcache_hash = NULL;
+        budget_reserve(-(long)(2 * pcache_size * sizeof(*pcache_hash)));
+    }
+}
 
-/* bitmap functions
+/* empty the cache (at mount, and when pcache_forget can't tell what
+ * to drop)
  */
-void bit_set(unsigned char *map, int i)
-{
-    map[i/8] |= (1 << (i%8));
-}
-void bit_clear(unsigned char *map, int i)
-{
-    map[i/8] &= ~(1 << (i%8));
+static void pcache_init(void) {
+    while (pcache_hand != NULL) {
+        pcache_release(pcache_hand);
+    }
+    if (pcache_hash == NULL && pcache_size > 0) {
+        pcache_hash = calloc(2 * pcache_size, sizeof(*pcache_hash));
+        if (pcache_hash == NULL) {
+            return;
+        }
+        budget_reserve(2 * pcache_size * sizeof(*pcache_hash));
+    }
+    if (pcache_hash == NULL) {
+        return;
+    }
+    memset(pcache_hash, 0, 2 * pcache_size * sizeof(*pcache_hash));
+    struct budget_cache c = {sizeof(struct pcache_ent), 1, pcache_shrink};
+    budget_register(BUDGET_PCACHE, &c);
 }
-int bit_test(unsigned char *map, int i)
-{
-    return map[i/8] & (1 << (i%8));
+
+/**
+ * Returns the cached inum of "path", or -1.
+ */
+int pcache_lookup(const char *path) {
+    uint64_t h = pcache_key(path);
+    if (h == 0 || pcache_hash == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&pcache_lock);
+    struct pcache_ent *e = pcache_find(path, h);
+    int inum = -1;
+    if (e != NULL) {
+        inum = e->inum;
+        e->ref = 1;
+        budget_hits(BUDGET_PCACHE, 1);
+    }
+    pthread_mutex_unlock(&pcache_lock);
+    return inum;
 }
 
+/**
+ * The current generation, to pass to pcache_add: take it before
+ * walking the path.
+ */
+uint64_t pcache_generation(void) {
+    pthread_mutex_lock(&pcache_lock);
+    uint64_t gen = pcache_gen;
+    pthread_mutex_unlock(&pcache_lock);
+    return gen;
+}
 
+/**
+ * Record that "path" resolves to "inum", unless something was dropped
+ * from the cache since generation "gen".
+ */
+void pcache_add(const char *path, int inum, uint64_t gen) {
+    uint64_t h = pcache_key(path);
+    if (h == 0 || pcache_hash == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pcache_lock);
+    if (pcache_gen != gen) {
+        pthread_mutex_unlock(&pcache_lock);
+        return;
+    }
+    struct pcache_ent *e = pcache_find(path, h);
+    if (e == NULL) {
+        // as in dcache_put
+        if (pcache_n < pcache_size && (e = malloc(sizeof(*e))) != NULL) {
+            if (pcache_hand == NULL) {
+                e->prev = e->next = pcache_hand = e;
+            } else {
+                e->next = pcache_hand;
+                e->prev = pcache_hand->prev;
+                e->prev->next = e;
+                pcache_hand->prev = e;
+            }
+            pcache_n++;
+            budget_charge(BUDGET_PCACHE, 1);
+        } else if (pcache_hand != NULL) {
+            e = pcache_victim();
+            pcache_hand = e->next;
+            if (e->inum >= 0) {
+                pcache_unhash(e);
+            }
+        } else {
+            pthread_mutex_unlock(&pcache_lock);
+            return;
+        }
+        e->hash = h;
+        strcpy(e->path, path);
+        e->hnext = pcache_hash[h % (2 * pcache_size)];
+        pcache_hash[h % (2 * pcache_size)] = e;
+    }
+    e->inum = inum;
+    e->ref = 1;
+    pthread_mutex_unlock(&pcache_lock);
+    budget_balance();
+}
 
-unsigned char block_bitmap[FS_BLOCK_SIZE];
-/*
- * Allocate a free block from the disk.
- *
- * success - return free block number
- * no free block - return -ENOSPC
- *
- * hint:
- *   - bit_set/bit_test might be useful.
+/**
+ * Drop "path" from the cache and, if "subtree", every path under it
+ * (a directory was renamed or removed). The whole cache goes if
+ * "path" is not in the form above.
  */
-int alloc_blk() {
-    // Read the block bitmap from the disk
-    if (block_read(block_bitmap, 1, 1) < 0) {
-        return -EIO;
+void pcache_forget(const char *path, int subtree) {
+    uint64_t h = pcache_key(path);
+    size_t len = strlen(path);
+    if (pcache_hash == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pcache_lock);
+    pcache_gen++;
+    if (h == 0) {
+        // (not a form we cache, so we can't tell what is under it)
+        pcache_init();
+        pthread_mutex_unlock(&pcache_lock);
+        return;
+    }
+    struct pcache_ent *e = pcache_find(path, h);
+    if (e != NULL) {
+        pcache_unhash(e);
+    }
+    e = pcache_hand;
+    for (int i = 0; subtree && i < pcache_n; i++, e = e->next) {
+        if (e->inum >= 0 && strncmp(e->path, path, len) == 0 && e->path[len] == '/') {
+            pcache_unhash(e);
+        }
     }
+    pthread_mutex_unlock(&pcache_lock);
+}
 
-    // Find the first free block by checking each bit in the block bitmap
-    int total_blocks = FS_BLOCK_SIZE * 8; // each bit represents a block
-    for (int i = 0; i < total_blocks; i++) {
-        if (!bit_test(block_bitmap, i)) {
-            // Mark the found block as used
-            bit_set(block_bitmap, i);
 
-            // Write the updated block bitmap back to the disk
-            if (block_write(block_bitmap, 1, 1) < 0) {
-                return -EIO;
-            }
+// === memory budget ===
 
-            // Return the free block number
-            return i;
-        }
+/* With a memory budget (lab5fuse -mem) the inode, dentry and path
+ * caches and the buffer cache share it (budget.c): each charges its
+ * entries to the budget as it takes them, and when the total goes over
+ * it the cache whose memory is worth least gives some back, whichever
+ * that is. So the caches aren't sized from the budget up front, only
+ * capped: each of the three here may grow to BUDGET_MAX_PCT of it, if
+ * the others have let go of that much. Their hash tables are sized for
+ * those caps and held for the whole mount, as is the buffer cache's
+ * bookkeeping. What the block layer holds besides the buffer cache is
+ * taken off the budget before it gets here (block_mem in misc.c).
+ */
+#define BUDGET_MAX_PCT  25
+#define BUDGET_MIN_ENTS 16
+
+static int budget_ents(size_t bytes, int pct, size_t ent_size) {
+    size_t n = bytes / 100 * pct / (ent_size + 2 * sizeof(void *));
+    return n < BUDGET_MIN_ENTS ? BUDGET_MIN_ENTS : n > INT_MAX / 2 ? INT_MAX / 2 : n;
+}
+
+/* memory the caches take with these numbers of entries */
+static size_t budget_bytes(size_t ni, size_t nd, size_t np) {
+    return ni * (sizeof(struct icache_ent) + 2 * sizeof(void *)) +
+        nd * (sizeof(struct dcache_ent) + 2 * sizeof(void *)) +
+        np * (sizeof(struct pcache_ent) + 2 * sizeof(void *));
+}
+
+/* share a budget of 'bytes' between the caches, before fs_init (any
+ * cached entries are dropped, so not while mounted), and set '*left'
+ * to the bytes left for the buffer cache once the hash tables are
+ * taken off: all of the rest, as it shares the budget too. Returns 0,
+ * or -EINVAL if 'bytes' doesn't even cover the smallest caches
+ * (BUDGET_MIN_ENTS entries each); nothing is changed then.
+ */
+int fs_cache_budget(size_t bytes, size_t *left) {
+    // 0. the smallest caches must fit
+    int min_icache = (icache_size > 0) ? BUDGET_MIN_ENTS : 0;
+    if (bytes < budget_bytes(min_icache, BUDGET_MIN_ENTS, BUDGET_MIN_ENTS)) {
+        return -EINVAL;
     }
 
-    // If no free block is found, return -ENOSPC
-    return -ENOSPC;
+    // 1. drop caches of the old sizes; fs_init sets them up again
+    icache_free();
+    dcache_free();
+    pcache_free();
+
+    // 2. the most each may grow to
+    if (icache_size > 0) {
+        icache_size = budget_ents(bytes, BUDGET_MAX_PCT, sizeof(struct icache_ent));
+    }
+    dcache_size = budget_ents(bytes, BUDGET_MAX_PCT, sizeof(struct dcache_ent));
+    pcache_size = budget_ents(bytes, BUDGET_MAX_PCT, sizeof(struct pcache_ent));
+
+    // 3. the rest is shared, with the buffer cache too
+    size_t tables = 2 * sizeof(void *) * ((size_t)icache_size + dcache_size + pcache_size);
+    budget_init(bytes);
+    *left = bytes > tables ? bytes - tables : 0;
+    return 0;
 }
 
-/*
- * Return a block to disk, which can be used later.
- *
- * hint:
- *   - bit_clear might be useful.
+
+// === readahead ===
+
+/* Sequential read detection, per file (one slot per inode number
+ * modulo RA_FILES; another file in the slot starts over). A read that
+ * starts where the last one ended (or in its last block) is sequential
+ * and doubles the readahead window, from RA_MIN up to RA_MAX blocks;
+ * any other read closes it. Blocks up to a window past the end of the
+ * read are prefetched whenever less than half a window of them is
+ * already on its way, so the next batch is requested while the
+ * reader is still consuming the last one. Blocks the buffer cache
+ * had no room for are asked for again on the next read. On a mapped
+ * image the host is also told when a file turns sequential (the rest
+ * of the file) and when it stops being so; not on every read.
  */
-void free_blk(int i) {
-    // printf("\nfreeing block #%d\n", i);
-    // Clear the corresponding bit in the block bitmap
-    bit_clear(block_bitmap, i);
+#define RA_FILES 64
+#define RA_MIN   8              /* blocks */
+#define RA_MAX   256
+
+struct ra_state {
+    lba_t inum;                 /* 0 if unused */
+    int   next;                 /* block index the next read starts at */
+    int   window;               /* 0: not sequential */
+    int   ahead;                /* prefetched up to here (exclusive) */
+    int   advised;              /* blocks from here on advised sequential, -1 none */
+};
 
-    // Write the updated block bitmap back to the disk
-    block_write(block_bitmap, 1, 1);
+static struct ra_state ra_files[RA_FILES];
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* pass "advice" down for blocks [from, to) of a file, one call per
+ * run of consecutive blocks; only for a mapped image
+ */
+static void advise_blocks(const struct fs_inode_mem *in, int from, int to, int advice) {
+    if (from >= to || block_map(in->ptrs[from]) == NULL) {
+        return;
+    }
+    for (int i = from, run = 1; i < to; i++, run++) {
+        if (i == to - 1 || in->ptrs[i + 1] != in->ptrs[i] + 1) {
+            block_advise(in->ptrs[i] - run + 1, run, advice);
+            run = 0;
+        }
+    }
 }
 
+/**
+ * Note a read of blocks [first, last] of file "inum", and prefetch
+ * ahead of it if the file is being read sequentially.
+ */
+void file_readahead(lba_t inum, const struct fs_inode_mem *in, int first, int last) {
+    int nptrs = (in->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    lba_t lbas[RA_MAX];
+    int n = 0;
+    int seq_from = -1, rand_from = -1;
+
+    pthread_mutex_lock(&ra_lock);
+    struct ra_state *ra = &ra_files[inum % RA_FILES];
+
+    // 1. grow the window if this read follows the last one, else close
+    //    it; note when the pattern changes for the host (step 3)
+    if (ra->inum == inum && (first == ra->next || first == ra->next - 1)) {
+        ra->window = (ra->window == 0) ? RA_MIN : ra->window * 2;
+        if (ra->window > RA_MAX) {
+            ra->window = RA_MAX;
+        }
+        if (ra->advised < 0) {
+            seq_from = ra->advised = first;
+        }
+    } else {
+        if (ra->inum == inum) {
+            rand_from = ra->advised;
+        }
+        ra->inum = inum;
+        ra->window = 0;
+        ra->ahead = 0;
+        ra->advised = -1;
+    }
+    ra->next = last + 1;
 
-// === FS global states ===
+    // 2. top the prefetched blocks up to a window past this read
+    if (ra->ahead < last + 1) {
+        ra->ahead = last + 1;
+    }
+    int end = last + 1 + ra->window;
+    if (end > nptrs) {
+        end = nptrs;
+    }
+    if (ra->window > 0 && ra->ahead - (last + 1) < ra->window / 2) {
+        for (int i = ra->ahead; i < end; i++) {
+            lbas[n++] = in->ptrs[i];
+        }
+        ra->ahead += block_prefetch(lbas, n);
+    }
+    pthread_mutex_unlock(&ra_lock);
 
-uint32_t num_blocks = 0;
+    // 3. a mapped image reads ahead aggressively only where told to
+    //    (block_mmap_init defaults to random), so follow the pattern
+    if (rand_from >= 0) {
+        advise_blocks(in, rand_from, nptrs, POSIX_FADV_RANDOM);
+    }
+    if (seq_from >= 0) {
+        advise_blocks(in, seq_from, nptrs, POSIX_FADV_SEQUENTIAL);
+    }
+}
 
-int DIR_ENTRY_NUM = FS_BLOCK_SIZE / sizeof(struct fs_dirent);
+/* forget the read pattern of every file (at mount) */
+static void readahead_init(void) {
+    memset(ra_files, 0, sizeof(ra_files));
+    for (int i = 0; i < RA_FILES; i++) {
+        ra_files[i].advised = -1;
+    }
+}
 
 
 // === FS helper functions ===
@@ -180,45 +1755,34 @@ int DIR_ENTRY_NUM = FS_BLOCK_SIZE / sizeof(struct fs_dirent);
  *  - there are several functionalities that you will reuse; it's better to
  *  implement them in other functions.
  */
-void print_node_info(int inode_num, struct fs_inode curr_inode) {
+void print_node_info(int inode_num, struct fs_inode_mem curr_inode) {
     printf("inode#=%d\n",inode_num);
     printf("uid=%d\n", curr_inode.uid);
     printf("gid=%d\n", curr_inode.gid);
     printf("mode=%o\n", curr_inode.mode);
-    printf("size=%d\n", curr_inode.size);
+    printf("size=%lld\n", (long long) curr_inode.size);
     printf("ctime=%d\n", curr_inode.ctime);
     printf("ctime=%d\n", curr_inode.mtime);
 
 }
 /**
- * Given a path of string type, retrieve its inode number.
+ * Walk the path components `tokens` starting from the root inode and
+ * return the inode number of the last one. Inodes come from the inode
+ * cache; `dir_buf` is a one-block scratch buffer for directory blocks.
  */
-int path2inum(const char *path) {
-    char *_path = strdup(path);
-    char *token;
-    char *tokens[10]; // 11 excl root dir.
-    int depth = 0;
-    
-    // 1. Store all the dir name of the path in an array `tokens`.
-    token = strtok(_path, "/");
-    while (token != NULL) {
-        tokens[depth] = token;
-        depth++;
-        token = strtok(NULL, "/");
-    }
-    
+static int path2inum_walk(char **tokens, int depth, void *dir_buf) {
+    // (directories read from here on may change under us; what is
+    // found in them is only cached if none did)
+    uint64_t dgen = dcache_generation();
+
     // 2. Start from root dir inode.
     int curr_inode_num = 2; 
-    if (depth == 0) {
-        return curr_inode_num;
-    }
 
-    // 3. Init inode cache.
-    struct fs_inode inode_mem; 
+    // 3. Get the root inode (usually cached).
+    struct fs_inode_mem inode_mem;
 
     // If cannot read this inode root from disk, quit immediately.
-    if (block_read(&inode_mem, curr_inode_num, 1) < 0) {
-        free(_path);
+    if (inode_read(curr_inode_num, &inode_mem) < 0) {
         printf("p2i=cannot read this inode root\n");
         return -EIO;
     }
@@ -227,41 +1791,46 @@ int path2inum(const char *path) {
     for (int token_i = 0; token_i < depth; token_i++) {
 
         char* token_name = tokens[token_i];
-        // printf("token_i=%d, token_name=%s\n",token_i, token_name);
-        // printf("isdir=%d\n",S_ISDIR(curr_inode.mode));
         
         // 4.1. make sure this is a directory. If it's not a dir, we cannot find the token name.
         if (!S_ISDIR(inode_mem.mode)) {
-            free(_path);
             printf("p2i=this is not a dir\n");
             return -ENOTDIR;
         }
 
-        // 4.2. Load all the entries and find one that match the token name
+        // 4.2. Look the token up in the dentry cache. On a miss, load all the
+        // entries and find one that match the token name, and cache the answer.
         // - Get all its entries from disk (4096/32B = 128 entries) to memory.
         // - Note: DIR_ENTRY_NUM = FS_BLOCK_SIZE / sizeof(struct fs_dirent).
         int token_found = 0;
-        struct fs_dirent dir_entries[DIR_ENTRY_NUM];
-        if (block_read(dir_entries, inode_mem.ptrs[0], 1) < 0) {
-            free(_path);
-            printf("p2i=cannot read entries\n");
-            return -EIO;
-        }
-
-        // 4.3 Iterate through all the entries to find one that matches the current token name.
-        for (int dir_entry_i = 0; dir_entry_i < DIR_ENTRY_NUM; dir_entry_i++) {
-            // printf("entry name %d=%s, tokenname=%s\n", dir_entry_i, dir_entries[dir_entry_i].name, token_name);
-            if (strcmp(dir_entries[dir_entry_i].name, token_name ) == 0 && dir_entries[dir_entry_i].valid == 1) {
-                // printf("entry name MATCH\n");
-                curr_inode_num = dir_entries[dir_entry_i].inode;
+        int next_inode_num;
+        if (dcache_lookup(curr_inode_num, token_name, &next_inode_num)) {
+            if (next_inode_num >= 0) {
+                curr_inode_num = next_inode_num;
                 token_found = 1;
-                break;
             }
+        } else {
+            const struct fs_dirent *dir_entries = block_get(inode_mem.ptrs[0], dir_buf);
+            if (dir_entries == NULL) {
+                printf("p2i=cannot read entries\n");
+                return -EIO;
+            }
+
+            // 4.3 Iterate through all the entries to find one that matches the current token name.
+            int parent_inode_num = curr_inode_num;
+            for (int dir_entry_i = 0; dir_entry_i < DIR_ENTRY_NUM; dir_entry_i++) {
+                if (strcmp(dir_entries[dir_entry_i].name, token_name ) == 0 && dir_entries[dir_entry_i].valid == 1) {
+                    curr_inode_num = dir_entries[dir_entry_i].inode;
+                    token_found = 1;
+                    break;
+                }
+            }
+            dcache_fill(parent_inode_num, token_name, token_found ? curr_inode_num : -ENOENT,
+                        dgen);
         }
 
         // 4.4 If token not found, return error.
         if (!token_found) {
-            free(_path);
             return -ENOENT; // File or dir not found error.
 
         // 4.5 If found, get the inode. This could be another directory or a file inode.
@@ -269,8 +1838,7 @@ int path2inum(const char *path) {
 
             // If this is not the last token, get the inode for next iteraton.
             if (token_i < depth -1) {
-                if (block_read(&inode_mem, curr_inode_num, 1) < 0) {
-                    free(_path);
+                if (inode_read(curr_inode_num, &inode_mem) < 0) {
                     printf("p2i=cannot read inode for next iteration\n");
                     return -EIO;
                 }
@@ -282,6 +1850,50 @@ int path2inum(const char *path) {
     return curr_inode_num;
 }
 
+/**
+ * Given a path of string type, retrieve its inode number.
+ */
+int path2inum(const char *path) {
+    // 0. A path resolved before is a single probe of the path cache.
+    uint64_t pgen = pcache_generation();
+    int inum = pcache_lookup(path);
+    if (inum >= 0) {
+        return inum;
+    }
+
+    char *_path = strdup(path);
+    char *token;
+    char *tokens[10]; // 11 excl root dir.
+    int depth = 0;
+    
+    // 1. Store all the dir name of the path in an array `tokens`.
+    token = strtok(_path, "/");
+    while (token != NULL) {
+        tokens[depth] = token;
+        depth++;
+        token = strtok(NULL, "/");
+    }
+    if (depth == 0) {
+        free(_path);
+        return 2; // root dir inode.
+    }
+
+    // 2-4. Walk the tokens using a scratch block from the aligned pool.
+    void *dir_buf = block_buf_get();
+    inum = -ENOMEM;
+    if (dir_buf != NULL) {
+        inum = path2inum_walk(tokens, depth, dir_buf);
+    }
+    block_buf_put(dir_buf);
+    free(_path);
+
+    // 5. Remember the answer if the path exists.
+    if (inum >= 0) {
+        pcache_add(path, inum, pgen);
+    }
+    return inum;
+}
+
 /* EXERCISE 2:
  * Helper function:
  *   copy the information in an inode to struct stat
@@ -323,7 +1935,7 @@ int path2inum(const char *path) {
  *      -- st_atime - set to same value as st_mtime
  *  ]
  */
-void inode2stat(struct stat *sb, struct fs_inode *in, uint32_t inode_num)
+void inode2stat(struct stat *sb, struct fs_inode_mem *in, uint32_t inode_num)
 {
     memset(sb, 0, sizeof(*sb));
     sb->st_ino = inode_num;
@@ -360,38 +1972,70 @@ void* fs_init(struct fuse_conn_info *conn)
     // Check if the magic number matches fs5600
     if (sb.magic != FS_MAGIC) { exit(1); }
 
+    // Refuse images with format features we don't understand.
+    if (sb.flags & ~FS_FEAT_KNOWN) { exit(1); }
+
     //  Get number of blocks and save it in global variable "numb_blocks"
-    num_blocks = sb.disk_size; // from superbloc in header file.
+    //  (64-bit images keep it in disk_size64, original ones in disk_size)
+    fs_lba64 = (sb.flags & FS_FEAT_LBA64) != 0;
+    num_blocks = fs_lba64 ? (lba_t)sb.disk_size64 : sb.disk_size; // from superbloc in header file.
     
-    //  Read block bitmap to global variable "block_bitmap"
-    //  (this is a cache in memory; we will need to
-    //  write it back to disk later. When? whenever bitmap gets updated.)
-    if (block_read(block_bitmap, 1, 1) < 0) {exit(1);}
+    //  Read the block bitmap into "block_bitmap": block 1, and on big
+    //  images more blocks from bitmap_ext on, and count the blocks in
+    //  use. (This is a cache in memory; a bitmap block is written back
+    //  to disk whenever it gets updated.)
+    bitmap_nblocks = 1;
+    bitmap_ext = 0;
+    if (sb.flags & FS_FEAT_BITMAP) {
+        bitmap_nblocks = sb.bitmap_blocks;
+        bitmap_ext = (lba_t)sb.bitmap_ext;
+        if (bitmap_nblocks < 1 || (bitmap_nblocks > 1 &&
+            (bitmap_ext < 3 || bitmap_ext + bitmap_nblocks - 1 > num_blocks))) { exit(1); }
+    }
+    bitmap_bits = bitmap_nblocks * BITMAP_BITS;
+    if (bitmap_bits > num_blocks) {
+        bitmap_bits = num_blocks;
+    }
+    if (bitmap_init() < 0) {exit(1);}
+
+    //  Start with empty inode, dentry and path caches, and no
+    //  readahead state.
+    icache_init();
+    dcache_init();
+    pcache_init();
+    readahead_init();
+
+    //  Every path lookup starts at the root directory: keep its inode
+    //  and first directory block cached (no-op without a block cache).
+    struct fs_inode_mem root;
+    if (inode_read(2, &root) == 0) {
+        block_pin(2);
+        block_pin(root.ptrs[0]);
+    }
+
+    //  Reload what was hot in the cache at the last unmount.
+    block_warm_load();
+
+    //  Bring stale mirror copies up to date, copying only used blocks.
+    block_resync(block_bitmap, bitmap_bits);
+
+    //  The used-block count statfs reports must be the bitmap's, before
+    //  anything is allocated (checked again at unmount).
+    bitmap_verify();
 
     return NULL;
 }
 
 
 /* EXERCISE 1:
- * This function computes the number of used blocks.
- * The block_bitmap array contains information about which blocks are in use. 
- * For each entry in the block_bitmap, it checks each of the 8 bits (since each byte has 8 bits 
- * and each bit represents a block's status). If a bit is set to 1, 
- * it means the corresponding block is in use, so used_blocks is incremented.
- */
-int calc_used_blocks() {
-    int used_blocks_count = 0;
-
-    // For each block
-    for (int i = 0; i < num_blocks; i++) {
-        // Iterate through each bit
-        for (int j = 0; j < 8; j++) {
-            if (block_bitmap[i] & (1 << j)) {
-                // used_blocks_indexes[used_blocks_count] = i * 8 + j;
-                used_blocks_count++;
-            }
-        }
-    }
+ * This function returns the number of used blocks: those the bitmap
+ * has marked in use, kept count of as bits are set and cleared (see
+ * bitmap_verify), and any the bitmap can't describe.
+ */
+lba_t calc_used_blocks() {
+    pthread_mutex_lock(&bitmap_lock);
+    lba_t used_blocks_count = bitmap_used + (num_blocks - bitmap_bits);
+    pthread_mutex_unlock(&bitmap_lock);
 
     return used_blocks_count;
 }
@@ -465,8 +2109,8 @@ int fs_getattr(const char *path, struct stat *sb)
     }
 
     // 3. Get the inode.
-    struct fs_inode curr_inode; 
-    if (block_read(&curr_inode, inodenum, 1) < 0) {
+    struct fs_inode_mem curr_inode; 
+    if (inode_read(inodenum, &curr_inode) < 0) {
         free(_path);
         printf("getattr-> cannot blockread for %s\n", path);
         return -EIO;
@@ -493,8 +2137,8 @@ int get_dir_entries(const char *path, struct fs_dirent *dir_entries) {
     }
 
     // 3. Get the inode using the inum.
-    struct fs_inode dir_inode; 
-    if (block_read(&dir_inode, dir_inodenum, 1) < 0) {
+    struct fs_inode_mem dir_inode; 
+    if (inode_read(dir_inodenum, &dir_inode) < 0) {
         free(_path);
         return -EIO;
     }
@@ -547,30 +2191,41 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
         return isValidDir;
     }
 
-    // 2. iterate trhough each entry
+    // 2. collect the inode number of every valid entry
+    lba_t lbas[DIR_ENTRY_NUM];
+    int nvalid = 0;
     for (int dir_entry_i = 0; dir_entry_i < DIR_ENTRY_NUM; dir_entry_i++) {
+        if (dir_entries[dir_entry_i].valid == 1) {
+            lbas[nvalid++] = dir_entries[dir_entry_i].inode;
+        }
+    }
+
+    // 3. read all of their inodes in one batch
+    struct fs_inode_mem *entry_inodes = malloc(nvalid * sizeof(*entry_inodes));
+    if (nvalid > 0 && (!entry_inodes || inode_readv(lbas, entry_inodes, nvalid) < 0)) {
+        free(entry_inodes);
+        free(_path);
+        return -EIO;
+    }
+
+    // 4. iterate trhough each valid entry
+    for (int dir_entry_i = 0, i = 0; dir_entry_i < DIR_ENTRY_NUM; dir_entry_i++) {
         if (dir_entries[dir_entry_i].valid == 1) {
             // 1. get the name of this entry
             char* entry_name = dir_entries[dir_entry_i].name;
-            uint32_t entry_inodenum = dir_entries[dir_entry_i].inode;
 
-            // 2. get the statbuf of this entry
-            // - get inode
-            struct fs_inode entry_inode;
-            if (block_read(&entry_inode, entry_inodenum, 1) < 0) {
-                free(_path);
-                return -EIO;
-            }
-
-            // - use the inode to get statbuf
+            // 2. use the inode to get statbuf
             struct stat entry_statbuf;
-            inode2stat(&entry_statbuf, &entry_inode , entry_inodenum);
+            inode2stat(&entry_statbuf, &entry_inodes[i], lbas[i]);
+            i++;
 
             // 3. fill
             filler(ptr, entry_name , &entry_statbuf, 0);
 
         }
     }
+    free(entry_inodes);
+    free(_path);
     // printf("finish iterating entries>>>>>>>>>>>\n");
     // return success
     return 0;
@@ -604,8 +2259,8 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
     }
 
     // Read the file inode from disk
-    struct fs_inode file_inode;
-    if (block_read(&file_inode, file_inum, 1) < 0) {
+    struct fs_inode_mem file_inode;
+    if (inode_read(file_inum, &file_inode) < 0) {
         return -EIO;
     }
 
@@ -615,7 +2270,7 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
     }
     
     // If the start_ith_byte is greater than or equal to the file size, return 0
-    if (start_ith_byte >= file_inode.size) {
+    if (start_ith_byte >= file_inode.size || bytes_num_to_read == 0) {
         return 0;
     }
 
@@ -637,39 +2292,74 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
     // printf("start_ptr_i=%d, end_ptr_i=%d num_blocks_r=%d,bytes_num_to_read=%ld\n", 
     // start_ptr_i, end_ptr_i, num_blocks_r, bytes_num_to_read);
 
-    // Part 5. iterate through each datablock and read
-    for (int i = start_ptr_i; i < end_ptr_i + 1; i++) {
-        
-        // 1. Get the whole block from disk to memory.
-        char mem_block[FS_BLOCK_SIZE];
-        if (block_read(mem_block, file_inode.ptrs[i], 1) < 0) {
-            return -EIO;
+    int nblks = end_ptr_i - start_ptr_i + 1;
+    off_t head_i = start_ith_byte % FS_BLOCK_SIZE;
+    off_t tail_i = end_ith_byte % FS_BLOCK_SIZE; // exclusive, 0 = whole block
+
+    // Part 4B. Prefetch what follows if the file is read sequentially.
+    file_readahead(file_inum, &file_inode, start_ptr_i, end_ptr_i);
+
+    // Part 5A. If the image is mapped, copy straight out of the mapping.
+    // (file_readahead has told the host whether the file is streamed.)
+    if (block_map(file_inode.ptrs[start_ptr_i]) != NULL) {
+        size_t done = 0;
+        for (int i = start_ptr_i; i <= end_ptr_i; i++) {
+            const char *src = block_map(file_inode.ptrs[i]);
+            if (src == NULL) {
+                return -EIO;
+            }
+            off_t block_start_i = (i == start_ptr_i) ? head_i : 0;
+            size_t sz = FS_BLOCK_SIZE - block_start_i;
+            if (sz > bytes_num_to_read - done) {
+                sz = bytes_num_to_read - done;
+            }
+            memcpy(buf + done, src + block_start_i, sz);
+            done += sz;
         }
-        
-        // 2. Calculate the start and end index to read within the current block
-        // if this is the first block, get the start index of the bloxk is the starting ith byte mod blocksize
-        // otherwise if its the 2nd, 3rd,.. block we have to read from 0
-        off_t block_start_i = (i == start_ptr_i) ? start_ith_byte % FS_BLOCK_SIZE : 0;
-        off_t block_end_i;
-        
-        // If it's the last block and
-        // the last byte is not the last of the block, get the end index of the block
-        if (i == end_ptr_i &&  (end_ith_byte % FS_BLOCK_SIZE != 0)) {
-            block_end_i = end_ith_byte % FS_BLOCK_SIZE; // exclusive
+        return bytes_num_to_read;
+    }
+
+    // Part 5B. Gather all the data blocks of the request and read them in
+    // one call. Blocks that are fully covered are read straight into the
+    // caller's buffer; only the partial first/last block needs a bounce
+    // buffer.
+    void *bufs[nblks];
+    lba_t lbas[nblks];
+    char *head_block = block_buf_get();
+    char *tail_block = block_buf_get();
+    if (head_block == NULL || tail_block == NULL) {
+        block_buf_put(head_block);
+        block_buf_put(tail_block);
+        return -ENOMEM;
+    }
+
+    for (int i = start_ptr_i; i <= end_ptr_i; i++) {
+        int k = i - start_ptr_i;
+        lbas[k] = file_inode.ptrs[i];
+        if (i == start_ptr_i && head_i != 0) {
+            bufs[k] = head_block;
+        } else if (i == end_ptr_i && tail_i != 0) {
+            bufs[k] = tail_block;
         } else {
-            // if ithe end happens to be the last index, just get the last index
-            block_end_i = FS_BLOCK_SIZE;
+            bufs[k] = buf + (size_t)k * FS_BLOCK_SIZE - head_i;
         }
+    }
+    if (block_data_readv(bufs, lbas, nblks) < 0) {
+        block_buf_put(head_block);
+        block_buf_put(tail_block);
+        return -EIO;
+    }
 
-        // 3. Copy the data from the current block in memory to the buffer ptr
-        const void *src = mem_block + block_start_i;
-
-        size_t sz = block_end_i - block_start_i;
-        memcpy(buf, src, sz);
-
-        // 4. increment buffer address for next data block
-        buf += (sz);
+    // Part 6. Copy the partial blocks into place.
+    if (head_i != 0) {
+        size_t sz = (nblks == 1 && tail_i != 0) ? tail_i - head_i : FS_BLOCK_SIZE - head_i;
+        memcpy(buf, head_block + head_i, sz);
     }
+    if (tail_i != 0 && !(nblks == 1 && head_i != 0)) {
+        memcpy(buf + bytes_num_to_read - tail_i, tail_block, tail_i);
+    }
+    block_buf_put(head_block);
+    block_buf_put(tail_block);
 
     // Return the number of bytes read
     return bytes_num_to_read;
@@ -813,11 +2503,11 @@ int fs_rename(const char *src_path, const char *dst_path)
             
                 // - get the inode of the parent directory so we can rewrite their 
                 // entries
-                struct fs_inode src_parent_inode; 
+                struct fs_inode_mem src_parent_inode; 
                 int src_parent_inum = path2inum(src_parent);
 
                 // - get the inode of the parrent dir
-                if (block_read(&src_parent_inode, src_parent_inum, 1) < 0) {
+                if (inode_read(src_parent_inum, &src_parent_inode) < 0) {
                     printf("EIO\n");
                     return -EIO;
 
@@ -833,6 +2523,22 @@ int fs_rename(const char *src_path, const char *dst_path)
                     return -EIO;
                 }
 
+                // - the directory changed
+                src_parent_inode.mtime = src_parent_inode.ctime = time(NULL);
+                if (inode_write(src_parent_inum, &src_parent_inode) < 0) {
+                    free(new_name);
+                    free(old_name);
+                    free(dst_parent);
+                    free(src_parent);
+                    return -EIO;
+                }
+
+                // - the old name is gone; look the new one up again
+                dcache_add(src_parent_inum, old_name, -ENOENT);
+                dcache_forget(src_parent_inum, new_name);
+                pcache_forget(src_path, 1);
+                pcache_forget(dst_path, 1);
+
                 printf("new entry name=%s\n", dir_entries[dir_entry_i].name);
                 printf("success=%d\n", 0);
                 free(new_name);
@@ -877,18 +2583,19 @@ int fs_chmod(const char *path, mode_t mode)
     }
 
     // 2. get the inode
-    struct fs_inode inode; 
-    if (block_read(&inode, inum, 1) < 0) {
+    struct fs_inode_mem inode; 
+    if (inode_read(inum, &inode) < 0) {
         return -EIO;
     }
 
     // 3. chnge the inoode mode
     // Preserve the file type bits and apply the new permissions
     inode.mode = (inode.mode & S_IFMT) | (mode & ~S_IFMT);
+    inode.ctime = time(NULL);
 
 
     // 4. write this bloc back to the inum
-    if (block_write(&inode, inum, 1) < 0) {
+    if (inode_write(inum, &inode) < 0) {
         
         return -EIO;
     }
@@ -922,8 +2629,8 @@ int fs_chmod(const char *path, mode_t mode)
 /**
  * Helper 4.1 to get parent's data block to memory and insert a fs_dirent entry to this mem
 */
-int insert_entry(struct fs_dirent *parent_data, struct fs_inode parent_inode, struct fs_dirent newdir_entry) {
-    if (block_read(parent_data, parent_inode.ptrs[0],1) <0) {
+int insert_entry(struct fs_dirent *parent_data, struct fs_inode_mem *parent_inode, struct fs_dirent newdir_entry) {
+    if (block_read(parent_data, parent_inode->ptrs[0],1) <0) {
         printf("cannot read parent data\n");
         return -EIO;
     }
@@ -947,7 +2654,7 @@ int insert_entry(struct fs_dirent *parent_data, struct fs_inode parent_inode, st
 /**
  * Helper 4.2 to validate create and mkdirs inode, inum, newdirfile_inum, new_df_name_len
 */
-int isvalid_create_mkdr(int parent_inum, struct fs_inode *parent_inode, int newdifi_inum, int new_difiname_len) {
+int isvalid_create_mkdr(int parent_inum, struct fs_inode_mem *parent_inode, int newdifi_inum, int new_difiname_len) {
 
     // 1. parent path error
     // 1A. Parent doesnt exist
@@ -958,7 +2665,7 @@ int isvalid_create_mkdr(int parent_inum, struct fs_inode *parent_inode, int newd
 
     // 1B parent isnt directory
     // get inode from inum
-    if (block_read(parent_inode, parent_inum, 1) < 0) {
+    if (inode_read(parent_inum, parent_inode) < 0) {
         printf("cannot read parent inode\n");
         return -EIO;
     }
@@ -983,22 +2690,6 @@ int isvalid_create_mkdr(int parent_inum, struct fs_inode *parent_inode, int newd
     return 0;
 }
 
-/**
- * Helper 4.3 finds free block number from blockbitmap
-*/
-int find_free_block_number(int exclude_block_num) {
-    for (int i = 0; i < num_blocks; ++i) {
-        if (i == exclude_block_num) {
-            continue;
-        }
-        if (!bit_test(block_bitmap, i)) {
-            return i; // Found a free block
-        }
-    }
-
-    return -1; // No free blocks found
-}
-
 /**
  * Helper 4.4 that implements both fs_create and fs_mkdir
  * which will create either a file or a directory.
@@ -1014,7 +2705,7 @@ int create_mkdir_helper(const char *path, mode_t mode, int isDir) {
     // - get parent's path, inum, inode
     char * parent_path = get_parent_directory(path);
     int parent_inum = path2inum(parent_path);
-    struct fs_inode parent_inode; 
+    struct fs_inode_mem parent_inode; 
 
     // - get dir/file 's inum
     int newdifi_inum = path2inum(path);
@@ -1030,13 +2721,27 @@ int create_mkdir_helper(const char *path, mode_t mode, int isDir) {
         return isValid;
     }
 
-    // PART 1: Find two empty block number from bitmap 1 for newdifi inode 1 for newdifi data
-    // read bitmap block assume theres always free node
-    int newdifi_inode_num = find_free_block_number(-1);
-    int newdifi_datablock_num = find_free_block_number(newdifi_inode_num);
+    // PART 1: Allocate two blocks, 1 for newdifi inode 1 for newdifi data,
+    // side by side if there is room
+    lba_t newdifi_inode_num, newdifi_datablock_num;
+    lba_t got = alloc_run(2, &newdifi_inode_num);
+    if (got == 2) {
+        newdifi_datablock_num = newdifi_inode_num + 1;
+    } else if (got == 1) {
+        newdifi_datablock_num = alloc_blk();
+        if (newdifi_datablock_num < 0) {
+            free_blk(newdifi_inode_num);
+            got = newdifi_datablock_num;
+        }
+    }
+    if (got < 0) {
+        free(parent_path);
+        return got;
+    }
 
     // PART 2B: Create the inode of this new dir and fill in.
-    struct fs_inode newdifi_inode;
+    struct fs_inode_mem newdifi_inode;
+    memset(&newdifi_inode, 0, sizeof(newdifi_inode));
     newdifi_inode.gid = gid;
     newdifi_inode.uid = uid;
     newdifi_inode.ctime = cur_time;
@@ -1063,8 +2768,10 @@ int create_mkdir_helper(const char *path, mode_t mode, int isDir) {
     
     // PART 4: get the data of parent_dir and insert new entry to it
     struct fs_dirent parent_data[DIR_ENTRY_NUM];
-    int entry_i = insert_entry(parent_data, parent_inode, newdifi_entry);
+    int entry_i = insert_entry(parent_data, &parent_inode, newdifi_entry);
     if (entry_i <0) {
+        free_blk(newdifi_inode_num);
+        free_blk(newdifi_datablock_num);
         free(parent_path);
         return entry_i;
     }
@@ -1074,22 +2781,13 @@ int create_mkdir_helper(const char *path, mode_t mode, int isDir) {
     parent_inode.mtime = cur_time;
     parent_inode.size += sizeof(struct fs_dirent);
 
-    // PART 6: update bitmap set to 1s on the number we used for inode and data
-    bit_set(block_bitmap, newdifi_inode_num);
-    bit_set(block_bitmap, newdifi_datablock_num);
-
-    // PART 7: write everything back to disk
-    // printf("parent_inum=%d\n", newdifi_inode_num);
-    // parent's inode and data
-    int rv;
-    block_write(&parent_inode, parent_inum, 1); // mem address, block number in disk , length
-    block_write(parent_data, parent_inode.ptrs[0], 1);
-
-    // new inode and data
-    block_write(&newdifi_inode, newdifi_inode_num, 1);
-
+    // PART 6: write everything back to disk, the new dir/file before
+    // the parent's entry that names it
     // PART 2A: create the data of this new dir
-    if (isDir > 0) {
+    // (nothing to write if the block is a hole that already reads as zeros)
+    if (block_zeroed(newdifi_inode.ptrs[0])) {
+        ;
+    } else if (isDir > 0) {
         struct fs_dirent empty_entries[DIR_ENTRY_NUM];
         memset(empty_entries, 0, sizeof(empty_entries));  
         block_write(empty_entries, newdifi_inode.ptrs[0], 1);
@@ -1099,7 +2797,15 @@ int create_mkdir_helper(const char *path, mode_t mode, int isDir) {
         block_write(empty_text, newdifi_inode.ptrs[0], 1);
     }
 
-    block_write(block_bitmap, 1, 1);
+    // new inode, past the inode cache
+    inode_write_through(newdifi_inode_num, &newdifi_inode);
+
+    // parent's data and inode
+    block_write(parent_data, parent_inode.ptrs[0], 1);
+    inode_write(parent_inum, &parent_inode); // block number in disk, inode
+
+    // the name exists now (it may be cached as not existing)
+    dcache_add(parent_inum, path_last_slash + 1, newdifi_inode_num);
 
     // check path:
     // int testnewinum = path2inum(path);
@@ -1136,7 +2842,7 @@ int fs_mkdir(const char *path, mode_t mode)
 /**
  * Helper 5.1 to validate create and mkdirs inode, inum, newdirfile_inum, new_df_name_len
 */
-int isvalid_unlink_rmdir(int parent_inum, struct fs_inode *parent_inode, int difi_inum, struct fs_inode *difi_inode, int isDir) {
+int isvalid_unlink_rmdir(int parent_inum, struct fs_inode_mem *parent_inode, int difi_inum, struct fs_inode_mem *difi_inode, int isDir) {
 
     // 1. parent path error
     // 1A. Parent doesnt exist
@@ -1145,7 +2851,7 @@ int isvalid_unlink_rmdir(int parent_inum, struct fs_inode *parent_inode, int dif
         return -ENOENT; 
     }
 
-    if (block_read(parent_inode, parent_inum, 1) < 0) {
+    if (inode_read(parent_inum, parent_inode) < 0) {
         printf("cannot read parent inode\n");
         return -EIO;
     }
@@ -1165,7 +2871,7 @@ int isvalid_unlink_rmdir(int parent_inum, struct fs_inode *parent_inode, int dif
         return -ENOENT;
     }
 
-    if (block_read(difi_inode, difi_inum, 1) < 0) {
+    if (inode_read(difi_inum, difi_inode) < 0) {
         printf("cannot read dir or file inode\n");
         return -EIO;
     }
@@ -1196,8 +2902,8 @@ int helper_unlink_rmdir(const char *path, int isDir){
     int parent_inum = path2inum(parent_path);
     int difi_inum = path2inum(path);
 
-    struct fs_inode parent_inode;
-    struct fs_inode difi_inode;
+    struct fs_inode_mem parent_inode;
+    struct fs_inode_mem difi_inode;
 
     // Part 0A : validate
     int isValid = isvalid_unlink_rmdir(parent_inum, &parent_inode, difi_inum, &difi_inode, isDir);
@@ -1247,14 +2953,21 @@ int helper_unlink_rmdir(const char *path, int isDir){
     }
 
     // Part 3: Update parents inode
-    parent_inode.mtime = time(NULL);
+    parent_inode.mtime = parent_inode.ctime = time(NULL);
     parent_inode.size -= sizeof(struct fs_dirent); // there's 1 less entry in its data
 
 
     // Part 4: block write
     // block_write(block_bitmap, 1, 1);
-    block_write(&parent_inode, parent_inum, 1);
+    inode_write(parent_inum, &parent_inode);
     block_write(parent_data, parent_inode.ptrs[0], 1);
+
+    // Part 5: the name is gone, and so is a removed dir's own (negative) entries
+    dcache_add(parent_inum, difi_name, -ENOENT);
+    if (isDir > 0) {
+        dcache_forget_dir(difi_inum);
+    }
+    pcache_forget(path, isDir > 0);
     free(parent_path);
     return 0;
 }
@@ -1294,7 +3007,7 @@ int fs_rmdir(const char *path)
 /**
  * 6.1 Helper function to validate if path to write is correct.
 */
-int helper_validate_write(const char* path, struct fs_inode* file_inode, int *file_inum, size_t bytes_num_to_write, off_t start_ith_byte) {
+int helper_validate_write(const char* path, struct fs_inode_mem* file_inode, int *file_inum, size_t bytes_num_to_write, off_t start_ith_byte) {
     // Part 1: Path validation.
     // inum not found
     *file_inum = path2inum(path);
@@ -1302,7 +3015,7 @@ int helper_validate_write(const char* path, struct fs_inode* file_inode, int *fi
         printf("hvw: cannot find path\n");
         return -ENOENT;
     }
-    if (block_read(file_inode, *file_inum, 1) < 0) {
+    if (inode_read(*file_inum, file_inode) < 0) {
         printf("hvw: cannot block read\n");
         return -EIO;
     }
@@ -1320,7 +3033,7 @@ int helper_validate_write(const char* path, struct fs_inode* file_inode, int *fi
     }
     // Total data exceed max size of file.
     // - Calculate the maximum file size.
-    size_t max_file_size = FS_BLOCK_SIZE * (sizeof(file_inode->ptrs) / sizeof(file_inode->ptrs[0]));
+    size_t max_file_size = (size_t)FS_BLOCK_SIZE * inode_nptrs();
     if (start_ith_byte + bytes_num_to_write > max_file_size) {
         printf("hvw: total data exceeds\n");
         return -ENOSPC;
@@ -1350,7 +3063,7 @@ int fs_write(const char *path, const char *buf, size_t len,
     off_t start_ith_byte = offset;
     off_t end_ith_byte = start_ith_byte + bytes_num_to_write;
 
-    struct fs_inode file_inode;
+    struct fs_inode_mem file_inode;
     int file_inum;
     
     int isValid = helper_validate_write(path, &file_inode, &file_inum, bytes_num_to_write, start_ith_byte);
@@ -1358,100 +3071,151 @@ int fs_write(const char *path, const char *buf, size_t len,
         printf("is not valid\n");
         return isValid;
     }
+    if (bytes_num_to_write == 0) {
+        return 0;
+    }
 
     // Part 1. Get start_ptr_i and end_ptr_i so we can read all the required data block number from the file_inode.
     int start_ptr_i = start_ith_byte / FS_BLOCK_SIZE;
     int end_ptr_i = (end_ith_byte - 1) / FS_BLOCK_SIZE;
-    
-    // PART 2 & 3. Go to each data block on the disk.
-    for (int curr_ptr_i = start_ptr_i; curr_ptr_i <= end_ptr_i; curr_ptr_i++) {
-
-        // Part 2: Get the inum of the block we want to write to.
-        // - 2.1 Get the data inum.
-        int data_inum = file_inode.ptrs[curr_ptr_i];
-
-        // - 2.2 Init the mem_fullblock.
-        char mem_fullblock[FS_BLOCK_SIZE];  
-        memset(mem_fullblock, 0, FS_BLOCK_SIZE);
-
-        // - 2.2 Case A: Data block already exist, read the block to mem.
+    int nblks = end_ptr_i - start_ptr_i + 1;
+
+    // - The first and last block may only be partially covered by this write
+    //   (head_i/tail_i == 0 means the block is fully covered).
+    off_t head_i = start_ith_byte % FS_BLOCK_SIZE;
+    off_t tail_i = end_ith_byte % FS_BLOCK_SIZE; // exclusive
+    int head_partial = (head_i != 0) || (nblks == 1 && tail_i != 0);
+    int tail_partial = (nblks > 1 && tail_i != 0);
+
+    // PART 2. Get the block number of each data block we want to write to.
+    lba_t lbas[nblks];
+    char allocated[nblks];
+    int nnew = 0;
+    for (int k = 0; k < nblks; k++) {
+        int curr_ptr_i = start_ptr_i + k;
+        lba_t data_inum = file_inode.ptrs[curr_ptr_i];
+
+        // - 2.1 Case A: Data block already exist.
         // Data block already exist and valid if:
         // a) It's neither a superblock, block bitmap, or root inode.
-        // b) Inode number does not exceed the total number of blocks.
+        // b) It is within the blocks the bitmap covers (a damaged pointer
+        //    past them gets a new block, it is not written through).
         // c) Bit test != 0, means it's in use.
-        int allocateNewBlk = 0;
-        if (data_inum >= 3 && data_inum < num_blocks && (bit_test(block_bitmap, data_inum) != 0)){
-            
-            // printf("    data already exist=%d\n", bit_test(block_bitmap, data_inum)); // gives me 16
-            if (block_read(mem_fullblock, data_inum, 1) < 0) {
-                return -EIO;
-            }
-        // - 2.3 Case B: Data block doesn't exist, allocate a block for this.
-        } else {
-            allocateNewBlk = 1;
-            // printf("    data not yet exist=%d\n", bit_test(block_bitmap, data_inum)); // gives me 32
-            // - alloc to file inode ptrs i
-            file_inode.ptrs[curr_ptr_i] = alloc_blk();
-        }
+        allocated[k] = 0;
+        if (data_inum >= 3 && data_inum < bitmap_bits && bitmap_test(data_inum)) {
+            lbas[k] = data_inum;
 
-        // Part 3: Write block to disk: REMEMBER to do free alloc again if anything fails here.
-        // - 3.1 Get the block start_i.
-        off_t block_start_i;
-        // If this is the first block, find the block_start_i manually.
-        if (curr_ptr_i == start_ptr_i) {
-            block_start_i = start_ith_byte % FS_BLOCK_SIZE;
+        // - 2.2 Case B: Data block doesn't exist, allocate a block for this
+        //   (below).
         } else {
-            block_start_i = 0;
+            allocated[k] = 1;
+            nnew++;
         }
+    }
 
-        // - 3.2 Get the block end_i.
-        off_t block_end_i;
-        if (curr_ptr_i == end_ptr_i && (end_ith_byte % FS_BLOCK_SIZE != 0)) {
-            block_end_i = end_ith_byte % FS_BLOCK_SIZE; // All the end_i are exclusive.
-        } else {
-            block_end_i = FS_BLOCK_SIZE;
+    // - 2.3 The new blocks are allocated together, in as few runs of
+    //   contiguous blocks as free space allows, so the file is laid out
+    //   sequentially and written with few requests.
+    lba_t run_start = 0, run_left = 0;
+    for (int k = 0; k < nblks; k++) {
+        if (!allocated[k]) {
+            continue;
         }
-
-        // - 3.3 Get the length of the data to write.
-        size_t len_write_perblock = block_end_i - block_start_i;
-
-        // - 3.4 memcpy from buffer (the data we want to write) to dst (mem_full_bloc + block_start_i).
-        void *dst = mem_fullblock + block_start_i;
-        memcpy(dst, buf, len_write_perblock);
-        
-        // - 3.5 Block_write this data to the inum we get from part 2.
-        if (block_write(mem_fullblock, file_inode.ptrs[curr_ptr_i], 1) < 0) {
-            if (allocateNewBlk == 1) {
-                free_blk(file_inode.ptrs[curr_ptr_i]);
+        if (run_left == 0) {
+            run_left = alloc_run(nnew, &run_start);
+            if (run_left < 0) {
+                for (int j = 0; j < k; j++) {
+                    if (allocated[j]) {
+                        free_blk(lbas[j]);
+                    }
+                }
+                return run_left;
             }
-            return -EIO;
         }
+        lbas[k] = run_start++;
+        run_left--;
+        nnew--;
+        file_inode.ptrs[start_ptr_i + k] = lbas[k];
+    }
+
+    // PART 3. Partial blocks must keep the bytes we are not overwriting:
+    // read the ones that already exist (in one call) and zero-fill new ones.
+    char *head_block = block_buf_get();
+    char *tail_block = block_buf_get();
+    void *rbufs[2];
+    lba_t rlbas[2];
+    int nr = 0;
+    int rv = 0;
+    if (head_block == NULL || tail_block == NULL) {
+        rv = -ENOMEM;
+    } else if (head_partial) {
+        memset(head_block, 0, FS_BLOCK_SIZE);
+        if (!allocated[0]) {
+            rbufs[nr] = head_block;
+            rlbas[nr++] = lbas[0];
+        }
+    }
+    if (rv == 0 && tail_partial) {
+        memset(tail_block, 0, FS_BLOCK_SIZE);
+        if (!allocated[nblks - 1]) {
+            rbufs[nr] = tail_block;
+            rlbas[nr++] = lbas[nblks - 1];
+        }
+    }
+    if (rv == 0 && nr > 0) {
+        rv = block_data_readv(rbufs, rlbas, nr);
+    }
+
+    // PART 4. Write every block of the request in one call. Fully covered
+    // blocks go straight from the caller's buffer.
+    if (rv == 0) {
+        void *wbufs[nblks];
+        for (int k = 0; k < nblks; k++) {
+            if (k == 0 && head_partial) {
+                size_t sz = (nblks == 1 && tail_i != 0) ? tail_i - head_i : FS_BLOCK_SIZE - head_i;
+                memcpy(head_block + head_i, buf, sz);
+                wbufs[k] = head_block;
+            } else if (k == nblks - 1 && tail_partial) {
+                memcpy(tail_block, buf + len - tail_i, tail_i);
+                wbufs[k] = tail_block;
+            } else {
+                wbufs[k] = (void *)(buf + (size_t)k * FS_BLOCK_SIZE - head_i);
+            }
+        }
+        rv = block_data_writev(wbufs, lbas, nblks);
+    }
+    block_buf_put(head_block);
+    block_buf_put(tail_block);
 
-        // ----> Print what's been written on the mem_fullblock.
-        // printf("    buf contents (hex): ");
-        // for (size_t i = 0; i < len; i++) {
-        //     printf("%02x ", (unsigned char)buf[i]);
-        // }
-        // printf("\n");
-        // printf("    mem_fullblock written portion: ");
-        // for (off_t i = block_start_i; i < block_end_i; i++) {
-        //     printf("%02x ", (unsigned char)mem_fullblock[i]);
-        // }
-        // printf("\n");
-
-        // - 3.6 Increment buffer pointer for next write.
-        buf += len_write_perblock;
+    // - REMEMBER to free the blocks we allocated if anything fails here.
+    if (rv < 0) {
+        for (int k = 0; k < nblks; k++) {
+            if (allocated[k]) {
+                free_blk(lbas[k]);
+            }
+        }
+        return rv == -ENOMEM ? rv : -EIO;
     }
-        
-    // Part 4. Update file_inode'size.
+
+    // Part 5. Update file_inode'size.
+    struct fs_inode_mem old = file_inode;   // (but for the new pointers)
     if (end_ith_byte > file_inode.size) {
         file_inode.size = end_ith_byte;
     }
-    file_inode.mtime = time(NULL);
-
-    // Part 5. Update the file_inode.
-    if (block_write(&file_inode, file_inum, 1) < 0) {
-        // handle free block again
+    file_inode.mtime = file_inode.ctime = time(NULL);
+
+    // Part 6. Update the file_inode. If it can't be, the new blocks are
+    // not the file's after all: free them, and leave the inode cache
+    // with the inode as it was (it keeps a copy it failed to write, to
+    // retry).
+    if (inode_write(file_inum, &file_inode) < 0) {
+        for (int k = 0; k < nblks; k++) {
+            if (allocated[k]) {
+                old.ptrs[start_ptr_i + k] = 0;
+                free_blk(lbas[k]);
+            }
+        }
+        inode_write(file_inum, &old);
         return -EIO;
     }
 
@@ -1476,8 +3240,8 @@ int fs_truncate(const char *path, off_t len)
     if (file_inum < 0) {
         return -ENOENT;
     }
-    struct fs_inode file_inode;
-    if (block_read(&file_inode, file_inum, 1) < 0) {
+    struct fs_inode_mem file_inode;
+    if (inode_read(file_inum, &file_inode) < 0) {
         return -EIO;
     }
 
@@ -1489,14 +3253,15 @@ int fs_truncate(const char *path, off_t len)
     int num_ptrs = (file_inode.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
 
     for (int i = 1; i < num_ptrs; i++) {
-        int data_inum = file_inode.ptrs[i];
-        if (data_inum >= 3 && data_inum < num_blocks && (bit_test(block_bitmap, data_inum) != 0)) {
+        lba_t data_inum = file_inode.ptrs[i];
+        if (data_inum >= 3 && data_inum < bitmap_bits && bitmap_test(data_inum)) {
             free_blk(data_inum); // will set that bit to 0
         }
     }
     // Update file size and write the updated inode to the disk
     file_inode.size = 0;
-    if (block_write(&file_inode, file_inum, 1) < 0) {
+    file_inode.mtime = file_inode.ctime = time(NULL);
+    if (inode_write(file_inum, &file_inode) < 0) {
         return -EIO;
     }
 
@@ -1524,32 +3289,66 @@ int fs_utime(const char *path, struct utimbuf *ut)
     }
 
     // 2. get inode
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
+    struct fs_inode_mem inode;
+    if (inode_read(inum, &inode) < 0) {
         return -EIO;
     }
 
-    time_t curr = time(NULL);
     // 3. if ut is null update time to now
-    if (ut == NULL) {
-        ut = malloc(sizeof(struct utimbuf));
-        
-        ut->modtime = curr;
-        inode.mtime = curr;
-    } else {
-        ut->modtime = inode.mtime;
-    }
+    time_t curr = time(NULL);
+    inode.mtime = (ut == NULL) ? curr : ut->modtime;
+    inode.ctime = curr;
 
+    // 4. write it back
+    if (inode_write(inum, &inode) < 0) {
+        return -EIO;
+    }
     return 0;
+}
+
+
+/* fsync - make the file system durable on the image. All files live on
+ * the same image, so this flushes everything (dirty cached inodes and
+ * the dirty blocks of the buffer cache included); in RAM-disk mode it
+ * takes a checkpoint.
+ */
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int rv = inode_sync();
+    int rv2 = block_flush();
+    return rv < 0 ? rv : rv2;
+}
 
+/* flush - called on every close(). Writes are write-back, so only
+ * hand dirty inodes to the block layer and start writing back what is
+ * dirty there, and report an earlier write-back failure to the first
+ * application to close a file after it (fsync reports it as well).
+ */
+int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int rv = inode_sync();
+    int rv2 = block_writeback();
+    return rv < 0 ? rv : rv2;
 }
 
+/* destroy - called at unmount: everything goes to the image, and the
+ * list of hot blocks to the warm-cache file for the next mount. The
+ * used-block count is checked against the bitmap on the way out.
+ */
+void fs_destroy(void *private_data)
+{
+    bitmap_verify();
+    inode_sync();
+    block_flush();
+    block_warm_save();
+}
 
 /* 
  * Operations vector. Please don't rename it, or else you'll break things
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,            /* read-mostly operations */
+    .destroy = fs_destroy,
     .statfs = fs_statfs,
     .getattr = fs_getattr,
     .readdir = fs_readdir,
@@ -1564,5 +3363,7 @@ struct fuse_operations fs_ops = {
     .write = fs_write,
     .truncate = fs_truncate,
     .utime = fs_utime,
+    .fsync = fs_fsync,
+    .flush = fs_flush,
 };
 
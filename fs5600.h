@@ -10,6 +10,8 @@
 #ifndef __CSX600_H__
 #define __CSX600_H__
 
+#include <stdint.h>
+
 #define FS_BLOCK_SIZE 4096
 #define FS_MAGIC 0x30303635
 
@@ -21,6 +23,19 @@
  * number of pointers in one inode
  */
 #define NUM_PTRS_INODE (FS_BLOCK_SIZE/4 - 5)
+#define NUM_PTRS_INODE64 ((FS_BLOCK_SIZE - 24) / 8)
+
+/* block numbers and block counts. 64 bits wide so that images are
+ * not limited by 32-bit block pointers (16 TiB); see FS_FEAT_LBA64.
+ */
+typedef int64_t lba_t;
+
+/* superblock format flags (fs_super.flags); an image with any flag we
+ * don't know about must not be mounted.
+ */
+#define FS_FEAT_LBA64  0x1   /* 64-bit disk size and inode block pointers */
+#define FS_FEAT_BITMAP 0x2   /* block bitmap of more than one block */
+#define FS_FEAT_KNOWN  (FS_FEAT_LBA64 | FS_FEAT_BITMAP)
 
 /*
  * number of directory entries (dirent_t) in one block
@@ -32,9 +47,19 @@
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* (total number of block per disk) */
+    uint32_t flags;             /* FS_FEAT_*, 0 on original images */
+    uint32_t pad0;
+    uint64_t disk_size64;       /* disk size if FS_FEAT_LBA64 is set */
+
+    /* if FS_FEAT_BITMAP is set: the bitmap's size in blocks, and where
+     * all but the first (block 1) are, one after the other
+     */
+    uint32_t bitmap_blocks;
+    uint32_t pad1;
+    uint64_t bitmap_ext;
 
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)];
+    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t) - 2 * sizeof(uint64_t)];
 };
 
 struct fs_inode {
@@ -47,7 +72,33 @@ struct fs_inode {
     uint32_t ptrs[NUM_PTRS_INODE]; /* inode = 4096 bytes, total ptrs 1019 */ 
 };
 
-/* Entry in a directory
+/* on-disk inode of an FS_FEAT_LBA64 image
+ */
+struct fs_inode64 {
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t mode;
+    uint32_t ctime;
+    uint32_t mtime;
+    int64_t  size;
+    uint64_t ptrs[NUM_PTRS_INODE64]; /* inode = 4096 bytes, total ptrs 509 */
+};
+
+/* in-memory inode: the fields of either on-disk format, with room for
+ * the larger number of pointers. Converted by inode_read/inode_write.
+ */
+struct fs_inode_mem {
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t mode;
+    uint32_t ctime;
+    uint32_t mtime;
+    int64_t  size;
+    lba_t    ptrs[NUM_PTRS_INODE];
+};
+
+/* Entry in a directory. Inode numbers are block numbers, so inodes
+ * must live in the first 2^31 blocks (8 TiB) even on LBA64 images.
  */
 struct fs_dirent {
     uint32_t valid : 1; // 
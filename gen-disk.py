@@ -1,6 +1,12 @@
 #!/usr/bin/python
 #
-# usage: gen-disk2.py input output.img
+# usage: gen-disk2.py [-q] [-64] input output.img
+#
+#   -64   write a 64-bit LBA image (FEAT_LBA64: 64-bit disk size and
+#         inode block pointers)
+#
+# images of more than 32768 blocks get a bitmap of several blocks
+# (FEAT_BITMAP); all but the first are put at the end of the image
 #
 # see comments in disk1.in for file format
 
@@ -12,6 +18,13 @@ quiet = False
 if sys.argv[1] == '-q':
     quiet = True
     sys.argv.pop(1)
+lba64 = False
+if sys.argv[1] == '-64':
+    lba64 = True
+    sys.argv.pop(1)
+
+def new_inode():
+    return fs.inode64() if lba64 else fs.inode()
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
 
@@ -23,7 +36,7 @@ class file(object):
         self.blocks = map(int, blocks.split(','))
 
     def inode(self):
-        i = fs.inode()
+        i = new_inode()
         i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
         for j in range(len(self.blocks)):
@@ -57,7 +70,7 @@ class dir(object):
                 self.entries.append([True, name, int(inum)])
 
     def inode(self):
-        i = fs.inode()
+        i = new_inode()
         i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
         for j in range(len(self.blocks)):
@@ -105,11 +118,15 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'dir':
         dirs.append(dir(fields[1:]))
 
-blockmap = fs.bitmap()
+nmaps = (nblocks + fs.BITMAP_BITS - 1) // fs.BITMAP_BITS
+bitmap_ext = nblocks - (nmaps - 1)
+blockmap = fs.bitmaps([fs.bitmap() for i in range(nmaps)])
 blockmap.set(0,True)                      # superblock
 blockmap.set(1,True)                      # bitmap
+for i in range(bitmap_ext, nblocks):
+    blockmap.set(i,True)                  # rest of the bitmap
 
-blocks = [None] * 400
+blocks = [None] * max(nblocks, 400)
 
 for f in files + dirs:
     blocks[f.inum] = [f]
@@ -124,13 +141,20 @@ for f in files + dirs:
 
 sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
+if lba64:
+    sb.flags, sb.disk_sz64 = fs.FEAT_LBA64, nblocks
+if nmaps > 1:
+    sb.flags |= fs.FEAT_BITMAP
+    sb.bitmap_blocks, sb.bitmap_ext = nmaps, bitmap_ext
 zeros = bytearray(4096)
 
 fp = open(sys.argv[2], 'wb')
 fp.write(bytearray(sb))
-fp.write(bytearray(blockmap))
+fp.write(bytearray(blockmap.maps[0]))
 for i in range(2,nblocks):
-    if not blocks[i]:
+    if i >= bitmap_ext:
+        fp.write(bytearray(blockmap.maps[i - bitmap_ext + 1]))
+    elif not blocks[i]:
         fp.write(zeros)
     elif len(blocks[i]) == 1:
         inode = blocks[i][0]
@@ -8,11 +8,53 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #include <fuse.h>
 
 #include "fs5600.h"
+#include "bcache.h"         /* for the BCACHE_ policies and bcache_blocks_for */
+#include "budget.h"
 
 extern void block_init(char *file);
+extern int block_uring_init(int depth);
+extern int block_mmap_init(void);
+extern int block_direct_init(void);
+extern void block_close(void);
+extern int block_stripe_init(int unit);
+extern int block_stripe_check(void);
+extern int block_mirror_init(void);
+extern int block_raid5_init(void);
+extern int block_remote_init(const char *addr);
+extern int block_discard_init(void);
+extern int block_ram_init(void);
+extern int block_cache_init(int nblocks, int dirty_pct, int policy, int huge);
+
+/* share a memory budget between fs5600's caches and the block cache
+ * (see fs5600.c), setting '*left' to the bytes the block cache may
+ * grow to; -EINVAL if the budget is below their minimum sizes
+ */
+extern int fs_cache_budget(size_t bytes, size_t *left);
+
+/* memory the block layer holds besides the block cache (see misc.c)
+ */
+extern size_t block_mem(void);
+
+/* number of inodes fs5600's inode cache holds; 0 turns it off
+ */
+extern void fs_icache_size(int n);
+
+/* submission queue depth when running with -uring
+ */
+#define URING_DEPTH 128
+
+/* default buffer cache size in blocks (16 MB); -cache 0 turns it off
+ */
+#define CACHE_BLOCKS 4096
+
+/* default percentage of the cache that may be dirty; -dirty 0 makes
+ * the cache write-through
+ */
+#define CACHE_DIRTY_PCT 40
 
 /* All fs5600 functions are accessed through the operations
  * structure.
@@ -23,6 +65,27 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   uring;
+    int   mmap;
+    int   direct;
+    int   stripe;
+    int   mirror;
+    int   raid5;
+    char *remote;
+    int   discard;
+    int   ram;
+    int   cache;
+    int   dirty;
+    char *policy;
+    int   mem;
+    int   noicache;
+    int   hugepages;
+    double attr_timeout;
+    double entry_timeout;
+    int   kernel_cache;
+    int   auto_cache;
+    int   big_writes;
+    int   max_write;
 } _data;
 
 /**************/
@@ -31,37 +94,277 @@ struct data {
  * See comments in /usr/include/fuse/fuse_opts.h for details of
  * FUSE argument processing.
  *
- *  usage: ./lab5fuse -image disk.img directory
- *              disk.img  - name of the image file to mount
+ *  usage: ./lab5fuse -image disk.img[,disk2.img...] [-stripe N] [-mirror | -raid5] [-uring]
+ *                    [-mmap | -ram | -direct] [-discard] [-cache N] [-dirty P]
+ *                    [-policy lru|2q] [-mem MB] [-noicache] [-hugepages] [-attr_timeout S]
+ *                    [-entry_timeout S] [-kernel_cache | -auto_cache]
+ *                    [-big_writes] [-max_write N] directory
+ *         ./lab5fuse -remote unix:/path | tcp:host:port directory
+ *              disk.img  - name of the image file to mount; with several
+ *                          files the image is striped across them
+ *              -stripe N - stripe unit of an image set, in blocks
+ *              -mirror   - the image files are copies of each other
+ *              -raid5    - the image files are a RAID-5 set
+ *              -remote   - use the image served by blkserver at that address
+ *              -discard  - punch holes in the image for freed blocks
+ *              -uring    - do block I/O through io_uring
+ *              -mmap     - map the image and serve blocks from memory
+ *              -ram      - load the image into memory, write it back on
+ *                          fsync and unmount
+ *              -direct   - open the image O_DIRECT (bypass host cache)
+ *              -cache N  - size of the block cache, in blocks (0: none)
+ *              -dirty P  - percent of the cache that may be dirty (0: write-through)
+ *              -policy   - cache replacement: plain LRU, or scan-resistant 2Q
+ *              -mem MB   - memory for all the caches together, shared as
+ *                          they need it; overrides -cache
+ *              -noicache - don't cache inodes (every inode update goes
+ *                          to the block layer)
+ *              -hugepages - put the block cache in huge pages
+ *              -attr_timeout S  - seconds the kernel may cache attributes
+ *              -entry_timeout S - seconds the kernel may cache name lookups
+ *              -kernel_cache - keep file contents in the kernel's page
+ *                          cache across opens
+ *              -auto_cache - same, but dropped on open if the file's
+ *                          mtime or size changed
+ *              -big_writes - let the kernel send writes larger than 4 KB
+ *              -max_write N - largest write the kernel sends, in bytes
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-uring", offsetof(struct data, uring), 1},
+    {"-mmap", offsetof(struct data, mmap), 1},
+    {"-direct", offsetof(struct data, direct), 1},
+    {"-stripe %d", offsetof(struct data, stripe), 0},
+    {"-mirror", offsetof(struct data, mirror), 1},
+    {"-raid5", offsetof(struct data, raid5), 1},
+    {"-remote %s", offsetof(struct data, remote), 0},
+    {"-discard", offsetof(struct data, discard), 1},
+    {"-ram", offsetof(struct data, ram), 1},
+    {"-cache %d", offsetof(struct data, cache), 0},
+    {"-dirty %d", offsetof(struct data, dirty), 0},
+    {"-policy %s", offsetof(struct data, policy), 0},
+    {"-mem %d", offsetof(struct data, mem), 0},
+    {"-noicache", offsetof(struct data, noicache), 1},
+    {"-hugepages", offsetof(struct data, hugepages), 1},
+    {"-attr_timeout %lf", offsetof(struct data, attr_timeout), 0},
+    {"-entry_timeout %lf", offsetof(struct data, entry_timeout), 0},
+    {"-kernel_cache", offsetof(struct data, kernel_cache), 1},
+    {"-auto_cache", offsetof(struct data, auto_cache), 1},
+    {"-big_writes", offsetof(struct data, big_writes), 1},
+    {"-max_write %d", offsetof(struct data, max_write), 0},
     FUSE_OPT_END
 };
 
 void usage(){
-    printf("usage: ./lab5fuse -image disk.img directory \n");
-    printf("             disk.img  - name of the image file to mount\n");
+    printf("usage: ./lab5fuse -image disk.img[,disk2.img...] [-stripe N] [-mirror | -raid5] [-uring]\n");
+    printf("                   [-mmap | -ram | -direct] [-discard] [-cache N] [-dirty P]\n");
+    printf("                   [-policy lru|2q] [-mem MB] [-noicache] [-hugepages] [-attr_timeout S]\n");
+    printf("                   [-entry_timeout S] [-kernel_cache | -auto_cache]\n");
+    printf("                   [-big_writes] [-max_write N] directory \n");
+    printf("       ./lab5fuse -remote unix:/path | tcp:host:port directory\n");
+    printf("             disk.img  - name of the image file to mount; with several\n");
+    printf("                         files the image is striped across them\n");
+    printf("             -stripe N - stripe unit of an image set, in blocks\n");
+    printf("             -mirror   - the image files are copies of each other\n");
+    printf("             -raid5    - the image files are a RAID-5 set\n");
+    printf("             -remote   - use the image served by blkserver at that address\n");
+    printf("             -discard  - punch holes in the image for freed blocks\n");
+    printf("             -uring    - do block I/O through io_uring\n");
+    printf("             -mmap     - map the image and serve blocks from memory\n");
+    printf("             -ram      - load the image into memory, write it back on\n");
+    printf("                         fsync and unmount\n");
+    printf("             -direct   - open the image O_DIRECT (bypass host cache)\n");
+    printf("             -cache N  - size of the block cache, in blocks (0: none)\n");
+    printf("             -dirty P  - percent of the cache that may be dirty (0: write-through)\n");
+    printf("             -policy   - cache replacement: plain LRU, or scan-resistant 2Q\n");
+    printf("             -mem MB   - memory for all the caches together, shared as\n");
+    printf("                         they need it; overrides -cache\n");
+    printf("             -noicache - don't cache inodes (every inode update goes\n");
+    printf("                         to the block layer)\n");
+    printf("             -hugepages - put the block cache in huge pages\n");
+    printf("             -attr_timeout S  - seconds the kernel may cache attributes\n");
+    printf("             -entry_timeout S - seconds the kernel may cache name lookups\n");
+    printf("             -kernel_cache - keep file contents in the kernel's page\n");
+    printf("                         cache across opens\n");
+    printf("             -auto_cache - same, but dropped on open if the file's\n");
+    printf("                         mtime or size changed\n");
+    printf("             -big_writes - let the kernel send writes larger than 4 KB\n");
+    printf("             -max_write N - largest write the kernel sends, in bytes\n");
     printf("             directory - directory to mount it on\n");
 }
 
+/* pass the kernel caching options on to FUSE as "-o ..." mount
+ * options. All changes to the image come through the kernel, and the
+ * file system keeps mtime and size up to date, so what the kernel
+ * caches stays coherent.
+ */
+static void kernel_cache_opts(struct fuse_args *args)
+{
+    char opt[64];
+    if (_data.attr_timeout >= 0) {
+        snprintf(opt, sizeof(opt), "-oattr_timeout=%g", _data.attr_timeout);
+        fuse_opt_add_arg(args, opt);
+    }
+    if (_data.entry_timeout >= 0) {
+        snprintf(opt, sizeof(opt), "-oentry_timeout=%g", _data.entry_timeout);
+        fuse_opt_add_arg(args, opt);
+    }
+    if (_data.kernel_cache) {
+        fuse_opt_add_arg(args, "-okernel_cache");
+    }
+    if (_data.auto_cache) {
+        fuse_opt_add_arg(args, "-oauto_cache");
+    }
+    if (_data.big_writes) {
+        fuse_opt_add_arg(args, "-obig_writes");
+    }
+    if (_data.max_write > 0) {
+        snprintf(opt, sizeof(opt), "-omax_write=%d", _data.max_write);
+        fuse_opt_add_arg(args, opt);
+    }
+}
+
+/* set up the -mem budget, once the block layer is set up: what it
+ * holds besides the block cache (a RAM image, RAID-5 rows, ...) comes
+ * off the top, and the rest is shared by fs5600's caches and the block
+ * cache, which is made big enough to take all of it if the others let
+ * it. Exits if that doesn't fit.
+ */
+static void mem_budget(void)
+{
+    if (_data.mem == 0) {
+        return;
+    }
+    size_t mem = (size_t)_data.mem << 20, fixed = block_mem(), left;
+    if (fixed >= mem || fs_cache_budget(mem - fixed, &left) < 0) {
+        printf("-mem %d is too small: the block layer alone takes %zu KB of it, "
+               "and the inode, dentry and path caches need room too\n",
+               _data.mem, fixed >> 10);
+        exit(1);
+    }
+    _data.cache = bcache_blocks_for(left);
+    if (_data.cache == 0) {
+        printf("-mem %d leaves no room for a block cache\n", _data.mem);
+    }
+}
+
+/* at unmount: how the -mem budget was spent */
+static void mem_report(void)
+{
+    struct budget_stats st;
+    budget_get_stats(&st);
+    if (st.limit == 0) {
+        return;
+    }
+    fprintf(stderr, "memory budget: %zu of %zu KB in use (%zu KB tables, "
+            "%zu KB blocks, %zu KB inodes, %zu KB dentries, %zu KB paths); "
+            "given back %llu blocks, %llu inodes, %llu dentries, %llu paths\n",
+            st.used >> 10, st.limit >> 10, st.fixed >> 10,
+            st.bytes[BUDGET_BCACHE] >> 10, st.bytes[BUDGET_ICACHE] >> 10,
+            st.bytes[BUDGET_DCACHE] >> 10, st.bytes[BUDGET_PCACHE] >> 10,
+            (unsigned long long)st.shrunk[BUDGET_BCACHE],
+            (unsigned long long)st.shrunk[BUDGET_ICACHE],
+            (unsigned long long)st.shrunk[BUDGET_DCACHE],
+            (unsigned long long)st.shrunk[BUDGET_PCACHE]);
+}
+
 int main(int argc, char **argv)
 {
     /* Argument processing and checking
      */
-    if (argc != 4) {
+    if (argc < 4) {
         usage();
         exit(1);
     }
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    _data.cache = CACHE_BLOCKS;
+    _data.dirty = CACHE_DIRTY_PCT;
+    _data.attr_timeout = _data.entry_timeout = -1;
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1) {
         usage();
         exit(1);
     }
 
+    if ((_data.image_name == NULL) == (_data.remote == NULL)) {
+        usage();
+        exit(1);
+    }
+    int policy = BCACHE_2Q;
+    if (_data.policy != NULL && strcmp(_data.policy, "lru") == 0) {
+        policy = BCACHE_LRU;
+    } else if (_data.policy != NULL && strcmp(_data.policy, "2q") != 0) {
+        usage();
+        exit(1);
+    }
+    if ((_data.mmap && _data.direct) || (_data.mirror && _data.raid5) ||
+        (_data.ram && _data.mmap) || _data.mem < 0 ||
+        (_data.kernel_cache && _data.auto_cache) || _data.max_write < 0) {
+        usage();
+        exit(1);
+    }
+    kernel_cache_opts(&args);
+    if (_data.noicache) {
+        fs_icache_size(0);
+    }
+    if (_data.remote != NULL) {
+        if (block_remote_init(_data.remote) < 0) {
+            printf("cannot connect to block server at %s\n", _data.remote);
+            exit(1);
+        }
+        mem_budget();
+        if (_data.cache > 0 &&
+            block_cache_init(_data.cache, _data.dirty, policy, _data.hugepages) < 0) {
+            printf("cannot set up the block cache, running without it\n");
+        }
+        int rv = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+        mem_report();
+        block_close();
+        return rv;
+    }
     block_init(_data.image_name);
+    if (_data.stripe != 0 && block_stripe_init(_data.stripe) < 0) {
+        usage();
+        exit(1);
+    }
+    if (_data.mirror && block_mirror_init() < 0) {
+        printf("%s is not a mirrored image set\n", _data.image_name);
+        exit(1);
+    }
+    if (_data.raid5 && block_raid5_init() < 0) {
+        printf("%s is not a usable RAID-5 image set\n", _data.image_name);
+        exit(1);
+    }
+    if (!_data.mirror && !_data.raid5 && block_stripe_check() < 0) {
+        printf("%s is not a striped image set with this stripe unit, in this order\n",
+               _data.image_name);
+        exit(1);
+    }
+    if (_data.direct && block_direct_init() < 0) {
+        printf("O_DIRECT not supported for this image, using buffered I/O\n");
+    }
+    if (_data.uring && block_uring_init(URING_DEPTH) < 0) {
+        printf("io_uring not available, using synchronous I/O\n");
+    }
+    if (_data.mmap && block_mmap_init() < 0) {
+        printf("cannot map image, using read/write I/O\n");
+    }
+    if (_data.ram && block_ram_init() < 0) {
+        printf("cannot load image into memory, using read/write I/O\n");
+    }
+    if (_data.discard && block_discard_init() < 0) {
+        printf("cannot punch holes in this image, -discard ignored\n");
+    }
+    mem_budget();
+    /* (refused, and not needed, if blocks are already in memory) */
+    if (_data.cache > 0 && block_cache_init(_data.cache, _data.dirty, policy, _data.hugepages) < 0 &&
+        !_data.mmap && !_data.ram) {
+        printf("cannot set up the block cache, running without it\n");
+    }
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    int rv = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    mem_report();
+    block_close();
+    return rv;
 }
@@ -8,6 +8,7 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
@@ -18,56 +19,2429 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
-#include "fs5600.h"        /* only for FS_BLOCK_SIZE */
+#include "fs5600.h"        /* only for FS_BLOCK_SIZE, lba_t */
+#include "uring.h"
+#include "remote.h"
+#include "bcache.h"
 
-/*********** DO NOT MODIFY THIS FILE *************/
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-/* All disk I/O is accessed through these functions
+/* All disk I/O is accessed through these functions.
+ *
+ * The public block_* functions dispatch to one of the backends below
+ * through 'blk':
+ *   pio  - positional I/O (pread/pwrite and friends), optionally with
+ *          vectored requests batched through io_uring. Never touches
+ *          the file offsets of the image files, so any number of
+ *          threads may be inside the block layer at the same time.
+ *          With O_DIRECT (block_direct_init) the host page cache is
+ *          bypassed and buffers must be aligned; unaligned ones are
+ *          bounced through the aligned buffer pool.
+ *          The image may be striped over several image files, see
+ *          "image sets" below.
+ *   mmap - the whole image is mapped and blocks are memory copies.
+ *   ram  - the whole image is read into memory at mount and written
+ *          back at checkpoints, through the pio backend.
+ *   remote - blocks live on a block server (remote.c), reached over
+ *          a unix or TCP socket.
+ *
+ * With block_cache_init a buffer cache (bcache.c) sits between the
+ * public functions and the backend.
+ */
+struct blk_ops {
+    int (*rw)(int write, void *buf, lba_t lba, int nblks);
+    int (*rwv)(int write, void **bufs, const lba_t *lbas, int n);
+    int (*flush)(void);
+};
+
+static const struct blk_ops pio_ops;
+static const struct blk_ops *blk = &pio_ops;
+
+/* Image sets: block_init takes a comma-separated list of image files
+ * ("members"). With more than one member the file system image is
+ * striped across them RAID-0 style: logical blocks are dealt out in
+ * stripe units of 'stripe_unit' blocks, unit k going to member
+ * k % ndisks. After block_mirror_init the members are instead full
+ * copies of the image (see "mirrored sets" below), and after
+ * block_raid5_init the stripes carry parity (see "RAID-5 sets").
+ * split-img.py builds any kind of set from a single image.
+ */
+#define BLOCK_MAX_DISKS   16
+#define BLOCK_STRIPE_UNIT 16    /* default stripe unit, in blocks (64 KiB) */
+#define BLOCK_BATCH       128   /* most blocks per request to a backend */
+
+enum { LAYOUT_STRIPE, LAYOUT_MIRROR, LAYOUT_RAID5 };
+
+/* member states; only mirrored and RAID-5 sets ever leave DISK_OK */
+enum {
+    DISK_OK,        /* up to date, used for reads and writes */
+    DISK_STALE,     /* being resynced: gets writes, but no reads */
+    DISK_FAILED,    /* dropped out, no I/O at all */
+};
+
+static int   disk_fds[BLOCK_MAX_DISKS];
+static char *disk_names[BLOCK_MAX_DISKS];
+static int   disk_state[BLOCK_MAX_DISKS];
+static int   ndisks;
+static int   layout = LAYOUT_STRIPE;
+static int   stripe_unit = BLOCK_STRIPE_UNIT;
+static int   disk_direct;
+
+/* member holding logical block 'lba', and the block's number within
+ * that member. '*run' is set to the number of blocks from 'lba' on that
+ * stay contiguous on the member.
+ */
+static int map_lba(lba_t lba, lba_t *plba, lba_t *run)
+{
+    if (ndisks == 1 || layout == LAYOUT_MIRROR) {
+        *plba = lba;
+        *run = INT_MAX;
+        return 0;
+    }
+    lba_t unit = lba / stripe_unit;
+    int off = lba % stripe_unit;
+
+    *run = stripe_unit - off;
+    if (layout == LAYOUT_RAID5) {
+        /* ndisks-1 data units per row, plus one parity unit whose
+         * member rotates from the last one down */
+        lba_t row = unit / (ndisks - 1);
+        int idx = unit % (ndisks - 1);
+        int pdisk = ndisks - 1 - row % ndisks;
+        *plba = row * stripe_unit + off;
+        return idx < pdisk ? idx : idx + 1;
+    }
+    *plba = (unit / ndisks) * stripe_unit + off;
+    return unit % ndisks;
+}
+
+/* set by block_uring_init(); vectored requests then go to the kernel
+ * as one io_uring batch instead of one system call per run.
+ */
+static int use_uring;
+
+/* transfer exactly 'len' bytes at byte offset 'start', retrying short
+ * transfers and EINTR. Returns 0 or -EIO.
+ */
+static int do_pio(int fd, int write, void *buf, size_t len, off_t start)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, p, len, start) :
+            pread(fd, p, len, start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        p += n;
+        start += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* same as do_pio, but gathering from / scattering to 'cnt' buffers of
+ * FS_BLOCK_SIZE bytes each.
+ */
+static int do_piov(int fd, int write, struct iovec *iov, int cnt, off_t start)
+{
+    while (cnt > 0) {
+        ssize_t n = write ? pwritev(fd, iov, cnt, start) :
+            preadv(fd, iov, cnt, start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        start += n;
+
+        /* short transfer - skip the completed iovecs, finish the rest
+         */
+        while (cnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0 && n > 0) {
+            if (do_pio(fd, write, (char*)iov->iov_base + n,
+                       iov->iov_len - n, start) < 0)
+                return -EIO;
+            start += iov->iov_len - n;
+            iov++;
+            cnt--;
+        }
+    }
+    return 0;
+}
+
+/* Pool of FS_BLOCK_SIZE buffers aligned to BLOCK_ALIGN, as needed for
+ * O_DIRECT. Up to BLOCK_POOL_SIZE free buffers are kept for reuse, so
+ * the memory held by the pool is bounded.
+ */
+#define BLOCK_ALIGN     4096
+#define BLOCK_POOL_SIZE 64
+
+static void *pool[BLOCK_POOL_SIZE];
+static int   pool_n;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* get an aligned one-block buffer. Returns NULL if out of memory.
+ */
+void *block_buf_get(void)
+{
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_n > 0)
+        buf = pool[--pool_n];
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf == NULL && posix_memalign(&buf, BLOCK_ALIGN, FS_BLOCK_SIZE) != 0)
+        return NULL;
+    return buf;
+}
+
+void block_buf_put(void *buf)
+{
+    if (buf == NULL)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_n < BLOCK_POOL_SIZE) {
+        pool[pool_n++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+static int is_aligned(const void *p)
+{
+    return ((uintptr_t)p & (BLOCK_ALIGN - 1)) == 0;
+}
+
+static int pio_rwv(int write, void **bufs, const lba_t *lbas, int n);
+
+static int pio_rw(int write, void *buf, lba_t lba, int nblks)
+{
+    /* O_DIRECT can't use this buffer, or the request may cross stripe
+     * units: go block by block, via the pool if need be */
+    if (ndisks > 1 || (disk_direct && !is_aligned(buf))) {
+        void *bufs[nblks];
+        lba_t lbas[nblks];
+        for (int i = 0; i < nblks; i++) {
+            bufs[i] = (char *)buf + (size_t)i * FS_BLOCK_SIZE;
+            lbas[i] = lba + i;
+        }
+        return pio_rwv(write, bufs, lbas, nblks);
+    }
+
+    size_t len = (size_t)nblks * FS_BLOCK_SIZE;
+    off_t start = (off_t)lba * FS_BLOCK_SIZE;
+
+    return do_pio(disk_fds[0], write, buf, len, start);
+}
+
+/* one block of a request, resolved to a member of the image set
+ */
+struct blk_io {
+    void *buf;
+    int   disk;
+    lba_t plba;
+};
+
+/* blocks queued on each member but not yet done, for read balancing */
+static int disk_busy[BLOCK_MAX_DISKS];
+
+/* synchronous I/O for the requests of one member of an image set.
+ * Every member has a worker thread of its own, started on first use and
+ * fed through a queue, so that the members are busy at the same time
+ * without a thread being created for every request. worker_lock covers
+ * the queues and the count of jobs a caller is waiting for.
+ */
+struct disk_batch {
+    pthread_cond_t cond;
+    int            left;        /* jobs queued on workers, not yet done */
+};
+
+struct disk_job {
+    struct uring_req  *reqs;
+    int                n;
+    int                disk;
+    int                rv;
+    struct disk_batch *batch;   /* NULL if run by the caller */
+    struct disk_job   *next;
+};
+
+struct disk_worker {
+    pthread_t        thread;
+    pthread_cond_t   cond;
+    int              running, stop;
+    struct disk_job *head, **tail;
+};
+
+static struct disk_worker disk_workers[BLOCK_MAX_DISKS];
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *disk_job_run(void *arg)
+{
+    struct disk_job *job = arg;
+    job->rv = 0;
+    for (int i = 0; i < job->n && job->rv == 0; i++) {
+        struct uring_req *r = &job->reqs[i];
+        job->rv = do_piov(r->fd, r->write, r->iov, r->iovcnt, r->off);
+    }
+    return NULL;
+}
+
+static void *disk_worker_main(void *arg)
+{
+    struct disk_worker *w = arg;
+
+    pthread_mutex_lock(&worker_lock);
+    while (!w->stop) {
+        struct disk_job *job = w->head;
+        if (job == NULL) {
+            pthread_cond_wait(&w->cond, &worker_lock);
+            continue;
+        }
+        if ((w->head = job->next) == NULL)
+            w->tail = &w->head;
+        pthread_mutex_unlock(&worker_lock);
+
+        disk_job_run(job);
+
+        pthread_mutex_lock(&worker_lock);
+        if (--job->batch->left == 0)
+            pthread_cond_signal(&job->batch->cond);
+    }
+    pthread_mutex_unlock(&worker_lock);
+    return NULL;
+}
+
+/* queue 'job' on its member's worker, starting the worker if need be.
+ * Returns 0, or -1 if there is no worker (the caller runs the job
+ * itself). Called with worker_lock held.
+ */
+static int disk_worker_queue(struct disk_job *job)
+{
+    struct disk_worker *w = &disk_workers[job->disk];
+
+    if (!w->running) {
+        w->stop = 0;
+        w->head = NULL;
+        w->tail = &w->head;
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, disk_worker_main, w) != 0) {
+            pthread_cond_destroy(&w->cond);
+            return -1;
+        }
+        w->running = 1;
+    }
+    job->next = NULL;
+    *w->tail = job;
+    w->tail = &job->next;
+    pthread_cond_signal(&w->cond);
+    return 0;
+}
+
+/* stop the workers; no I/O may be in progress
+ */
+static void disk_workers_halt(void)
+{
+    for (int d = 0; d < BLOCK_MAX_DISKS; d++) {
+        struct disk_worker *w = &disk_workers[d];
+        if (!w->running)
+            continue;
+        pthread_mutex_lock(&worker_lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&worker_lock);
+        pthread_join(w->thread, NULL);
+        pthread_cond_destroy(&w->cond);
+        w->running = 0;
+    }
+}
+
+/* run 'nreq' requests synchronously, reqs[i] going to member rdisk[i].
+ * Requests for the same member must be adjacent; when more than one
+ * member is involved, each member's requests are handed to its worker.
+ * Members with a failed transfer are added to '*failed'.
+ */
+static void pio_run_sync(struct uring_req *reqs, const int *rdisk, int nreq,
+                         unsigned *failed)
+{
+    struct disk_job jobs[BLOCK_MAX_DISKS];
+    int njobs = 0;
+
+    for (int i = 0; i < nreq; i++) {
+        if (njobs == 0 || rdisk[i] != jobs[njobs-1].disk) {
+            jobs[njobs].reqs = &reqs[i];
+            jobs[njobs].n = 0;
+            jobs[njobs].disk = rdisk[i];
+            jobs[njobs].batch = NULL;
+            njobs++;
+        }
+        jobs[njobs-1].n++;
+    }
+
+    /* the last member's share is done on this thread */
+    struct disk_batch batch = {PTHREAD_COND_INITIALIZER, 0};
+    pthread_mutex_lock(&worker_lock);
+    for (int j = 0; j < njobs - 1; j++) {
+        jobs[j].batch = &batch;
+        if (disk_worker_queue(&jobs[j]) == 0)
+            batch.left++;
+        else
+            jobs[j].batch = NULL;
+    }
+    pthread_mutex_unlock(&worker_lock);
+
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].batch == NULL)
+            disk_job_run(&jobs[j]);
+    }
+
+    pthread_mutex_lock(&worker_lock);
+    while (batch.left > 0)
+        pthread_cond_wait(&batch.cond, &worker_lock);
+    pthread_mutex_unlock(&worker_lock);
+    pthread_cond_destroy(&batch.cond);
+
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].rv < 0)
+            *failed |= 1u << jobs[j].disk;
+    }
+}
+
+/* transfer the 'n' blocks of 'ios'. The blocks are grouped by member,
+ * keeping their order within each member, and runs of consecutive
+ * blocks on a member are merged into one vectored transfer, so a
+ * request laid out sequentially costs one system call per member.
+ * With io_uring enabled all transfers are submitted as a single batch,
+ * otherwise the members are worked on by parallel threads.
+ * Returns 0, or -EIO with the members that failed in '*failed'.
+ */
+static int pio_submit(int write, struct blk_io *ios, int n, unsigned *failed)
+{
+    struct iovec iov[n];
+    struct uring_req reqs[n];
+    int   rdisk[n];
+    int   order[n];
+    int   nblks[BLOCK_MAX_DISKS] = {0};
+    int   nreq = 0;
+
+    *failed = 0;
+
+    // 1. group by member
+    for (int d = 0, k = 0; d < ndisks; d++) {
+        for (int i = 0; i < n; i++) {
+            if (ios[i].disk == d) {
+                order[k++] = i;
+                nblks[d]++;
+            }
+        }
+    }
+
+    // 2. merge runs of consecutive blocks on a member
+    for (int k = 0; k < n; ) {
+        struct blk_io *first = &ios[order[k]];
+        int cnt = 0;
+        do {
+            iov[k + cnt].iov_base = ios[order[k + cnt]].buf;
+            iov[k + cnt].iov_len = FS_BLOCK_SIZE;
+            cnt++;
+        } while (k + cnt < n && cnt < IOV_MAX &&
+                 ios[order[k + cnt]].disk == first->disk &&
+                 ios[order[k + cnt]].plba == first->plba + cnt);
+
+        reqs[nreq].fd = disk_fds[first->disk];
+        reqs[nreq].write = write;
+        reqs[nreq].iov = &iov[k];
+        reqs[nreq].iovcnt = cnt;
+        reqs[nreq].off = (off_t)first->plba * FS_BLOCK_SIZE;
+        reqs[nreq].res = -EIO;
+        rdisk[nreq] = first->disk;
+        nreq++;
+        k += cnt;
+    }
+
+    // 3. do the I/O
+    for (int d = 0; d < ndisks; d++)
+        __atomic_add_fetch(&disk_busy[d], nblks[d], __ATOMIC_RELAXED);
+
+    int done = 0;
+    if (use_uring) {
+        if (uring_submit_wait(reqs, nreq) < 0) {
+            fprintf(stderr, "io_uring failed, falling back to synchronous I/O\n");
+            use_uring = 0;
+        } else {
+            /* short or failed transfers are retried synchronously */
+            for (int i = 0; i < nreq; i++) {
+                if (reqs[i].res == (ssize_t)reqs[i].iovcnt * FS_BLOCK_SIZE)
+                    continue;
+                if (do_piov(reqs[i].fd, write, reqs[i].iov, reqs[i].iovcnt,
+                            reqs[i].off) < 0)
+                    *failed |= 1u << rdisk[i];
+            }
+            done = 1;
+        }
+    }
+    if (!done)
+        pio_run_sync(reqs, rdisk, nreq, failed);
+
+    for (int d = 0; d < ndisks; d++)
+        __atomic_sub_fetch(&disk_busy[d], nblks[d], __ATOMIC_RELAXED);
+
+    return *failed ? -EIO : 0;
+}
+
+static int mirror_rwv(int write, void **bufs, const lba_t *lbas, int n);
+static int r5_rwv(int write, void **bufs, const lba_t *lbas, int n);
+static int r5_drain(void);
+
+/* vectored block I/O: transfer 'n' single blocks, block i going
+ * between bufs[i] and lbas[i]. The LBAs may be in any order.
+ * Returns -EIO if any transfer fails, 0 otherwise.
+ */
+static int pio_rwv_aligned(int write, void **bufs, const lba_t *lbas, int n)
+{
+    if (layout == LAYOUT_MIRROR)
+        return mirror_rwv(write, bufs, lbas, n);
+    if (layout == LAYOUT_RAID5)
+        return r5_rwv(write, bufs, lbas, n);
+
+    struct blk_io ios[n];
+    unsigned failed;
+
+    for (int i = 0; i < n; i++) {
+        lba_t run;
+        ios[i].buf = bufs[i];
+        ios[i].disk = map_lba(lbas[i], &ios[i].plba, &run);
+    }
+    return pio_submit(write, ios, n, &failed);
+}
+
+static int pio_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    if (!disk_direct)
+        return pio_rwv_aligned(write, bufs, lbas, n);
+
+    /* O_DIRECT: swap unaligned buffers for pool buffers
+     */
+    void *io_bufs[n];
+    int rv = 0;
+    for (int i = 0; i < n; i++) {
+        io_bufs[i] = bufs[i];
+        if (is_aligned(bufs[i]))
+            continue;
+        if ((io_bufs[i] = block_buf_get()) == NULL) {
+            rv = -EIO;
+            n = i;
+            break;
+        }
+        if (write)
+            memcpy(io_bufs[i], bufs[i], FS_BLOCK_SIZE);
+    }
+    if (rv == 0)
+        rv = pio_rwv_aligned(write, io_bufs, lbas, n);
+
+    for (int i = 0; i < n; i++) {
+        if (io_bufs[i] == bufs[i])
+            continue;
+        if (!write && rv == 0)
+            memcpy(bufs[i], io_bufs[i], FS_BLOCK_SIZE);
+        block_buf_put(io_bufs[i]);
+    }
+    return rv;
+}
+
+static int pio_flush(void)
+{
+    int rv = 0;
+    if (layout == LAYOUT_RAID5)
+        rv = r5_drain();
+    for (int d = 0; d < ndisks; d++) {
+        if (disk_state[d] != DISK_FAILED && fdatasync(disk_fds[d]) < 0)
+            rv = -EIO;
+    }
+    return rv;
+}
+
+static const struct blk_ops pio_ops = {
+    .rw = pio_rw,
+    .rwv = pio_rwv,
+    .flush = pio_flush,
+};
+
+/* Every member of an image set ends with a label block, giving the
+ * set's geometry: the member's place in the set, the number of members
+ * and the stripe unit, so that a set given in the wrong order or with
+ * the wrong -stripe is refused rather than read scrambled. The labels
+ * of redundant sets (mirror, RAID-5) also carry a generation number,
+ * bumped at every mount and whenever a member drops out, so a member
+ * that missed writes is recognised by its older generation at the next
+ * mount. Labels written before the geometry was recorded have it all
+ * zero, and fit any geometry.
+ */
+#define STRIPE_MAGIC  0x50525453    /* "STRP" */
+#define MIRROR_MAGIC  0x4d495252    /* "MIRR" */
+#define RAID5_MAGIC   0x35444152    /* "RAD5" */
+
+struct set_label {
+    uint32_t magic;
+    uint32_t clean;     /* set when unmounted cleanly */
+    uint64_t gen;
+    uint32_t unit;      /* stripe unit, in blocks */
+    uint32_t member;    /* this file's place in the set, from 0 */
+    uint32_t nmembers;
+    uint32_t pad;
+};
+
+static lba_t    label_lba;                  /* where the labels live */
+static uint32_t label_magic;
+static uint64_t set_gen;
+
+/* Mirrored sets: every member holds a full copy of the image. Writes
+ * go to every member that hasn't failed; reads are spread over the
+ * up-to-date ones. A member found out of date at mount is brought up
+ * to date in the background, copying only the blocks the file system
+ * bitmap says are in use (block_resync).
+ */
+#define RESYNC_CHUNK  64            /* blocks copied per step */
+
+static lba_t    disk_last[BLOCK_MAX_DISKS]; /* end of the last read */
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* writers hold this shared; a resync step holds it exclusive, so that
+ * it never copies a block over a newer write.
+ */
+static pthread_rwlock_t resync_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_t      resync_thread;
+static int            resync_running, resync_stop;
+static unsigned char *resync_map;
+static lba_t          resync_nblocks;
+
+/* read or write the label of member 'd'; a label written is stamped
+ * with the current geometry
+ */
+static int label_io(int write, int d, struct set_label *lab)
+{
+    char *buf = block_buf_get();
+    if (buf == NULL)
+        return -EIO;
+    if (write) {
+        struct set_label out = *lab;
+        out.unit = stripe_unit;
+        out.member = d;
+        out.nmembers = ndisks;
+        memset(buf, 0, FS_BLOCK_SIZE);
+        memcpy(buf, &out, sizeof(out));
+    }
+    int rv = do_pio(disk_fds[d], write, buf, FS_BLOCK_SIZE,
+                    (off_t)label_lba * FS_BLOCK_SIZE);
+    if (rv == 0 && write && fdatasync(disk_fds[d]) < 0)
+        rv = -EIO;
+    if (rv == 0 && !write)
+        memcpy(lab, buf, sizeof(*lab));
+    block_buf_put(buf);
+    return rv;
+}
+
+/* stamp the current generation on every up-to-date member
+ */
+static void set_write_labels(int clean)
+{
+    struct set_label lab = {label_magic, clean, set_gen, 0, 0, 0, 0};
+    for (int d = 0; d < ndisks; d++) {
+        if (disk_state[d] == DISK_OK && label_io(1, d, &lab) < 0)
+            fprintf(stderr, "cannot write label on %s\n", disk_names[d]);
+    }
+}
+
+/* drop the members in 'failed' from the set. Refused (-EIO) if that
+ * would leave no up-to-date member, otherwise the survivors move to a
+ * new generation so the dropped members are resynced when they return.
+ */
+static int mirror_degrade(unsigned failed)
+{
+    int rv = -EIO;
+
+    pthread_mutex_lock(&mirror_lock);
+    for (int d = 0; d < ndisks; d++) {
+        if (disk_state[d] == DISK_OK && !(failed & (1u << d)))
+            rv = 0;
+    }
+    if (rv == 0) {
+        for (int d = 0; d < ndisks; d++) {
+            if ((failed & (1u << d)) && disk_state[d] != DISK_FAILED) {
+                fprintf(stderr, "%s failed, dropped from the mirror\n",
+                        disk_names[d]);
+                disk_state[d] = DISK_FAILED;
+            }
+        }
+        set_gen++;
+        set_write_labels(0);
+    }
+    pthread_mutex_unlock(&mirror_lock);
+    return rv;
+}
+
+/* spread a read over the up-to-date copies: each piece of up to
+ * 'stripe_unit' consecutive blocks goes to the copy with the fewest
+ * blocks queued, ties going to the copy whose last read ended nearest
+ * (LBA locality).
+ */
+static void mirror_assign_reads(struct blk_io *ios, void **bufs,
+                                const lba_t *lbas, int n)
+{
+    int load[BLOCK_MAX_DISKS];
+    for (int d = 0; d < ndisks; d++)
+        load[d] = __atomic_load_n(&disk_busy[d], __ATOMIC_RELAXED);
+
+    for (int i = 0; i < n; ) {
+        int cnt = 1;
+        while (i + cnt < n && cnt < stripe_unit && lbas[i + cnt] == lbas[i] + cnt)
+            cnt++;
+
+        int best = -1;
+        lba_t best_dist = 0;
+        for (int d = 0; d < ndisks; d++) {
+            if (disk_state[d] != DISK_OK)
+                continue;
+            lba_t dist = disk_last[d] > lbas[i] ? disk_last[d] - lbas[i] :
+                lbas[i] - disk_last[d];
+            if (best < 0 || load[d] < load[best] ||
+                (load[d] == load[best] && dist < best_dist)) {
+                best = d;
+                best_dist = dist;
+            }
+        }
+        for (int j = 0; j < cnt; j++) {
+            ios[i + j].buf = bufs[i + j];
+            ios[i + j].disk = best;
+            ios[i + j].plba = lbas[i + j];
+        }
+        load[best] += cnt;
+        disk_last[best] = lbas[i] + cnt;
+        i += cnt;
+    }
+}
+
+static int mirror_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    struct blk_io ios[n * ndisks];
+    unsigned failed;
+
+    /* reads: on error, drop the copy that failed and try the others */
+    if (!write) {
+        for (;;) {
+            mirror_assign_reads(ios, bufs, lbas, n);
+            if (pio_submit(0, ios, n, &failed) == 0)
+                return 0;
+            if (mirror_degrade(failed) < 0)
+                return -EIO;
+        }
+    }
+
+    int m = 0;
+    pthread_rwlock_rdlock(&resync_lock);
+    for (int i = 0; i < n; i++) {
+        for (int d = 0; d < ndisks; d++) {
+            if (disk_state[d] == DISK_FAILED)
+                continue;
+            ios[m].buf = bufs[i];
+            ios[m].disk = d;
+            ios[m].plba = lbas[i];
+            m++;
+        }
+    }
+    int rv = pio_submit(1, ios, m, &failed);
+    pthread_rwlock_unlock(&resync_lock);
+
+    /* fine as long as one up-to-date copy took the write */
+    if (rv < 0)
+        rv = mirror_degrade(failed);
+    return rv;
+}
+
+/* background copy of all blocks in use from the up-to-date members to
+ * the stale ones.
+ */
+static void *resync_run(void *arg)
+{
+    void *buf;
+    int aborted = 0;
+    if (posix_memalign(&buf, BLOCK_ALIGN, RESYNC_CHUNK * FS_BLOCK_SIZE) != 0)
+        return NULL;
+
+    for (lba_t lba = 0; lba < resync_nblocks && !aborted &&
+             !__atomic_load_n(&resync_stop, __ATOMIC_RELAXED); ) {
+        void *bufs[RESYNC_CHUNK];
+        lba_t lbas[RESYNC_CHUNK];
+        struct blk_io ios[RESYNC_CHUNK * BLOCK_MAX_DISKS];
+        unsigned failed;
+        int n = 0, m = 0;
+
+        // 1. next chunk of blocks in use (the superblock and the bitmap
+        //    always are)
+        for (; lba < resync_nblocks && n < RESYNC_CHUNK; lba++) {
+            if (lba < 2 || (resync_map[lba / 8] & (1 << (lba % 8)))) {
+                bufs[n] = (char *)buf + (size_t)n * FS_BLOCK_SIZE;
+                lbas[n++] = lba;
+            }
+        }
+        if (n == 0)
+            continue;
+
+        // 2. copy it, with writers held off
+        pthread_rwlock_wrlock(&resync_lock);
+        if (mirror_rwv(0, bufs, lbas, n) < 0) {
+            fprintf(stderr, "mirror resync: cannot read, giving up\n");
+            aborted = 1;
+        } else {
+            for (int i = 0; i < n; i++) {
+                for (int d = 0; d < ndisks; d++) {
+                    if (disk_state[d] != DISK_STALE)
+                        continue;
+                    ios[m].buf = bufs[i];
+                    ios[m].disk = d;
+                    ios[m].plba = lbas[i];
+                    m++;
+                }
+            }
+            if (m > 0 && pio_submit(1, ios, m, &failed) < 0) {
+                pthread_mutex_lock(&mirror_lock);
+                for (int d = 0; d < ndisks; d++) {
+                    if (failed & (1u << d))
+                        disk_state[d] = DISK_FAILED;
+                }
+                pthread_mutex_unlock(&mirror_lock);
+            }
+        }
+        pthread_rwlock_unlock(&resync_lock);
+        if (!aborted && m == 0)
+            break;      /* no stale member left */
+    }
+
+    // 3. the stale members are now up to date
+    pthread_mutex_lock(&mirror_lock);
+    if (!aborted && !__atomic_load_n(&resync_stop, __ATOMIC_RELAXED)) {
+        struct set_label lab = {label_magic, 0, set_gen, 0, 0, 0, 0};
+        for (int d = 0; d < ndisks; d++) {
+            if (disk_state[d] != DISK_STALE)
+                continue;
+            if (fdatasync(disk_fds[d]) == 0 && label_io(1, d, &lab) == 0)
+                disk_state[d] = DISK_OK;
+            else
+                disk_state[d] = DISK_FAILED;
+        }
+    }
+    pthread_mutex_unlock(&mirror_lock);
+    free(buf);
+    return NULL;
+}
+
+static void resync_halt(void)
+{
+    if (!resync_running)
+        return;
+    __atomic_store_n(&resync_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(resync_thread, NULL);
+    resync_running = 0;
+    free(resync_map);
+    resync_map = NULL;
+}
+
+/* RAID-5 sets: each row of the set holds ndisks-1 stripe units of
+ * data and one unit of parity, the XOR of the data units. The parity
+ * unit moves one member down every row (see map_lba). Each member ends
+ * with a label block, as for mirrors.
+ *
+ * Writes are collected in a small cache of partial rows and only go
+ * to disk once a row is complete, so that parity is computed from the
+ * new data alone, with no read-modify-write. Sequential writes fill
+ * rows quickly. A partial row is written when its slot is needed or
+ * at block_flush; only then are the missing blocks of the row read
+ * back. Reads are served from the cache where it holds the block.
+ * Holding rows back is only done under a write-back buffer cache,
+ * whose writes are not durable before block_flush either. Otherwise a
+ * row still partial at the end of a write is written there and then:
+ * by read-modify-write of its parity if few of its blocks were
+ * written, or else by reading in the rest of the row.
+ *
+ * One member may fail. Its blocks are then rebuilt on every read as
+ * the XOR of the blocks at the same offset on all the other members.
+ */
+#define R5_PENDING 8        /* partial rows held back waiting to fill */
+
+struct r5_row {
+    lba_t          row;     /* -1 if the slot is free */
+    char          *data;    /* the row's data blocks, in logical order */
+    unsigned char *have;    /* have[j]: data block j is in 'data' */
+    int            nhave;
+    unsigned long  used;    /* for LRU replacement */
+};
+
+static struct r5_row   r5_cache[R5_PENDING];
+static unsigned long   r5_clock;
+static pthread_mutex_t r5_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int r5_row_blocks(void)
+{
+    return (ndisks - 1) * stripe_unit;
+}
+
+static void xor_block(void *dst, const void *src)
+{
+    uint64_t *d = dst;
+    const uint64_t *s = src;
+    for (int i = 0; i < FS_BLOCK_SIZE / 8; i++)
+        d[i] ^= s[i];
+}
+
+static int r5_failed_disk(void)
+{
+    for (int d = 0; d < ndisks; d++) {
+        if (disk_state[d] == DISK_FAILED)
+            return d;
+    }
+    return -1;
+}
+
+/* drop the member in 'failed'. Only one member may be missing; returns
+ * -EIO if that limit would be passed.
+ */
+static int r5_degrade(unsigned failed)
+{
+    if (failed == 0 || (failed & (failed - 1)) != 0 || r5_failed_disk() >= 0)
+        return -EIO;
+
+    int d = __builtin_ctz(failed);
+    fprintf(stderr, "%s failed, running degraded\n", disk_names[d]);
+    disk_state[d] = DISK_FAILED;
+    set_gen++;
+    set_write_labels(0);
+    return 0;
+}
+
+/* read data blocks from the members. A block on the failed member is
+ * rebuilt from the blocks at the same offset of its row on the others
+ * (the other data units and the parity unit).
+ */
+static int r5_read_disk(void **bufs, const lba_t *lbas, int n)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct blk_io ios[n * ndisks];
+        int rebuild[n];
+        int failed_d = r5_failed_disk();
+        int nrebuild = 0, m = 0;
+        char *scratch = NULL;
+        unsigned failed;
+
+        // 1. direct reads, and which blocks need rebuilding
+        for (int i = 0; i < n; i++) {
+            lba_t run;
+            ios[m].buf = bufs[i];
+            ios[m].disk = map_lba(lbas[i], &ios[m].plba, &run);
+            if (ios[m].disk == failed_d)
+                rebuild[nrebuild++] = i;
+            else
+                m++;
+        }
+
+        // 2. for each rebuilt block, the other members' blocks at its
+        //    offset
+        size_t per = (size_t)(ndisks - 1) * FS_BLOCK_SIZE;
+        if (nrebuild > 0 &&
+            posix_memalign((void **)&scratch, BLOCK_ALIGN, nrebuild * per) != 0)
+            return -EIO;
+        for (int k = 0; k < nrebuild; k++) {
+            lba_t plba, run;
+            map_lba(lbas[rebuild[k]], &plba, &run);
+            for (int d = 0, c = 0; d < ndisks; d++) {
+                if (d == failed_d)
+                    continue;
+                ios[m].buf = scratch + k * per + (size_t)c++ * FS_BLOCK_SIZE;
+                ios[m].disk = d;
+                ios[m].plba = plba;
+                m++;
+            }
+        }
+
+        // 3. read, and XOR the rebuilt blocks together
+        int rv = pio_submit(0, ios, m, &failed);
+        if (rv == 0) {
+            for (int k = 0; k < nrebuild; k++) {
+                char *dst = bufs[rebuild[k]];
+                memcpy(dst, scratch + k * per, FS_BLOCK_SIZE);
+                for (int c = 1; c < ndisks - 1; c++)
+                    xor_block(dst, scratch + k * per + (size_t)c * FS_BLOCK_SIZE);
+            }
+        }
+        free(scratch);
+        if (rv == 0)
+            return 0;
+        if (r5_degrade(failed) < 0)
+            return -EIO;
+    }
+    return -EIO;
+}
+
+/* write out a complete row: its data units and freshly computed parity
+ */
+static int r5_write_row(struct r5_row *r)
+{
+    int rb = r5_row_blocks();
+    struct blk_io ios[rb + stripe_unit];
+    char *parity;
+    unsigned failed;
+    int m = 0;
+
+    if (posix_memalign((void **)&parity, BLOCK_ALIGN,
+                       (size_t)stripe_unit * FS_BLOCK_SIZE) != 0)
+        return -EIO;
+    memset(parity, 0, (size_t)stripe_unit * FS_BLOCK_SIZE);
+
+    lba_t first = r->row * rb;
+    for (int j = 0; j < rb; j++) {
+        char *data = r->data + (size_t)j * FS_BLOCK_SIZE;
+        lba_t run;
+        xor_block(parity + (size_t)(j % stripe_unit) * FS_BLOCK_SIZE, data);
+        ios[m].buf = data;
+        ios[m].disk = map_lba(first + j, &ios[m].plba, &run);
+        if (disk_state[ios[m].disk] != DISK_FAILED)
+            m++;
+    }
+    int pdisk = ndisks - 1 - r->row % ndisks;
+    if (disk_state[pdisk] != DISK_FAILED) {
+        for (int o = 0; o < stripe_unit; o++) {
+            ios[m].buf = parity + (size_t)o * FS_BLOCK_SIZE;
+            ios[m].disk = pdisk;
+            ios[m].plba = r->row * stripe_unit + o;
+            m++;
+        }
+    }
+
+    /* with one member gone the row is still complete on the others */
+    int rv = pio_submit(1, ios, m, &failed);
+    if (rv < 0)
+        rv = r5_degrade(failed);
+    free(parity);
+    return rv;
+}
+
+/* write the blocks held for row 'r' in place, and free the slot. The
+ * parity of each offset they are at becomes the old parity XOR the old
+ * and the new contents of the blocks (read-modify-write); blocks on a
+ * failed member are only reflected in the parity.
+ */
+static int r5_write_partial(struct r5_row *r)
+{
+    int rb = r5_row_blocks();
+    lba_t row = r->row, first = row * rb;
+    int pdisk = ndisks - 1 - row % ndisks;
+    int pok = disk_state[pdisk] != DISK_FAILED;
+    struct blk_io ios[rb + stripe_unit];
+    unsigned char pneed[stripe_unit];
+    void *obufs[rb];
+    lba_t olbas[rb];
+    int idx[rb];
+    char *old, *parity;
+    unsigned failed;
+    int n = 0, m = 0, rv;
+
+    r->row = -1;
+    if (posix_memalign((void **)&old, BLOCK_ALIGN, (size_t)r->nhave * FS_BLOCK_SIZE) != 0)
+        return -EIO;
+    if (posix_memalign((void **)&parity, BLOCK_ALIGN, (size_t)stripe_unit * FS_BLOCK_SIZE) != 0) {
+        free(old);
+        return -EIO;
+    }
+
+    // 1. the old contents of the blocks (rebuilt if need be), and the
+    //    old parity at their offsets
+    memset(pneed, 0, sizeof(pneed));
+    for (int j = 0; j < rb; j++) {
+        if (!r->have[j])
+            continue;
+        idx[n] = j;
+        obufs[n] = old + (size_t)n * FS_BLOCK_SIZE;
+        olbas[n++] = first + j;
+        pneed[j % stripe_unit] = 1;
+    }
+    for (int o = 0; pok && o < stripe_unit; o++) {
+        if (!pneed[o])
+            continue;
+        ios[m].buf = parity + (size_t)o * FS_BLOCK_SIZE;
+        ios[m].disk = pdisk;
+        ios[m].plba = row * stripe_unit + o;
+        m++;
+    }
+    rv = r5_read_disk(obufs, olbas, n);
+    if (rv == 0 && m > 0 && pio_submit(0, ios, m, &failed) < 0) {
+        /* the parity member is gone: the data alone will do */
+        rv = r5_degrade(failed);
+        pok = 0;
+    }
+
+    // 2. the new parity, and write data and parity
+    m = 0;
+    for (int k = 0; rv == 0 && k < n; k++) {
+        char *data = r->data + (size_t)idx[k] * FS_BLOCK_SIZE;
+        char *p = parity + (size_t)(idx[k] % stripe_unit) * FS_BLOCK_SIZE;
+        lba_t run;
+        if (pok) {
+            xor_block(p, obufs[k]);
+            xor_block(p, data);
+        }
+        ios[m].buf = data;
+        ios[m].disk = map_lba(first + idx[k], &ios[m].plba, &run);
+        if (disk_state[ios[m].disk] != DISK_FAILED)
+            m++;
+    }
+    for (int o = 0; rv == 0 && pok && o < stripe_unit; o++) {
+        if (!pneed[o])
+            continue;
+        ios[m].buf = parity + (size_t)o * FS_BLOCK_SIZE;
+        ios[m].disk = pdisk;
+        ios[m].plba = row * stripe_unit + o;
+        m++;
+    }
+    if (rv == 0 && pio_submit(1, ios, m, &failed) < 0)
+        rv = r5_degrade(failed);
+    free(old);
+    free(parity);
+    return rv;
+}
+
+/* read in what is missing of a cached row, write it out and free the
+ * slot
+ */
+static int r5_evict(struct r5_row *r)
+{
+    int rb = r5_row_blocks();
+    void *bufs[rb];
+    lba_t lbas[rb];
+    int n = 0;
+
+    for (int j = 0; j < rb; j++) {
+        if (r->have[j])
+            continue;
+        bufs[n] = r->data + (size_t)j * FS_BLOCK_SIZE;
+        lbas[n++] = r->row * rb + j;
+    }
+    int rv = (n > 0) ? r5_read_disk(bufs, lbas, n) : 0;
+    if (rv == 0)
+        rv = r5_write_row(r);
+    r->row = -1;
+    return rv;
+}
+
+static struct r5_row *r5_lookup(lba_t row)
+{
+    for (int i = 0; i < R5_PENDING; i++) {
+        if (r5_cache[i].row == row)
+            return &r5_cache[i];
+    }
+    return NULL;
+}
+
+/* the cache slot for 'row', taking over the least recently used slot
+ * if need be. NULL if writing out the previous row failed.
+ */
+static struct r5_row *r5_get(lba_t row)
+{
+    struct r5_row *r = r5_lookup(row);
+    if (r != NULL)
+        return r;
+
+    for (int i = 0; i < R5_PENDING; i++) {
+        if (r5_cache[i].row < 0) {
+            r = &r5_cache[i];
+            break;
+        }
+        if (r == NULL || r5_cache[i].used < r->used)
+            r = &r5_cache[i];
+    }
+    if (r->row >= 0 && r5_evict(r) < 0)
+        return NULL;
+    r->row = row;
+    r->nhave = 0;
+    memset(r->have, 0, r5_row_blocks());
+    return r;
+}
+
+static int r5_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    int rb = r5_row_blocks();
+    int rv = 0;
+
+    pthread_mutex_lock(&r5_lock);
+    if (!write) {
+        /* blocks still waiting in the cache come from there */
+        void *dbufs[n];
+        lba_t dlbas[n];
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            struct r5_row *r = r5_lookup(lbas[i] / rb);
+            int j = lbas[i] % rb;
+            if (r != NULL && r->have[j]) {
+                memcpy(bufs[i], r->data + (size_t)j * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+            } else {
+                dbufs[m] = bufs[i];
+                dlbas[m++] = lbas[i];
+            }
+        }
+        rv = (m > 0) ? r5_read_disk(dbufs, dlbas, m) : 0;
+    } else {
+        for (int i = 0; i < n && rv == 0; i++) {
+            struct r5_row *r = r5_get(lbas[i] / rb);
+            int j = lbas[i] % rb;
+            if (r == NULL) {
+                rv = -EIO;
+                break;
+            }
+            memcpy(r->data + (size_t)j * FS_BLOCK_SIZE, bufs[i], FS_BLOCK_SIZE);
+            if (!r->have[j]) {
+                r->have[j] = 1;
+                r->nhave++;
+            }
+            r->used = ++r5_clock;
+
+            /* complete: write it with no reads at all */
+            if (r->nhave == rb) {
+                rv = r5_write_row(r);
+                r->row = -1;
+            }
+        }
+
+        /* with nothing above to make writes durable at block_flush, the
+         * rows left partial go out now, whichever way reads less */
+        for (int i = 0; i < R5_PENDING && !bcache_write_back(); i++) {
+            struct r5_row *r = &r5_cache[i];
+            if (r->row < 0)
+                continue;
+            int err = (r->nhave * 2 > rb) ? r5_evict(r) : r5_write_partial(r);
+            if (err < 0)
+                rv = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&r5_lock);
+    return rv;
+}
+
+/* write out every partial row
+ */
+static int r5_drain(void)
+{
+    int rv = 0;
+    pthread_mutex_lock(&r5_lock);
+    for (int i = 0; i < R5_PENDING; i++) {
+        if (r5_cache[i].row >= 0 && r5_evict(&r5_cache[i]) < 0)
+            rv = -EIO;
+    }
+    pthread_mutex_unlock(&r5_lock);
+    return rv;
+}
+
+static void r5_free(void)
+{
+    for (int i = 0; i < R5_PENDING; i++) {
+        free(r5_cache[i].data);
+        free(r5_cache[i].have);
+        r5_cache[i].data = NULL;
+        r5_cache[i].have = NULL;
+        r5_cache[i].row = -1;
+    }
+}
+
+/* Discard: blocks the file system frees are given back to the host by
+ * punching holes in the image files (block_discard). Freed ranges are
+ * queued, coalesced, and punched by a background thread every
+ * DISCARD_DELAY_MS or once DISCARD_BATCH ranges are waiting.
+ *
+ * A queued block that is written again before its turn is taken off
+ * the queue, and punching holds discard_lock, which writers take to
+ * do that, so a hole is never punched over newer data. Ranges punched
+ * and not written since are remembered as 'holes': they read back as
+ * zeros, so the file system needn't zero-fill them (block_zeroed).
+ */
+#define DISCARD_MAX      1024   /* queued ranges */
+#define HOLES_MAX        4096   /* remembered holes */
+#define DISCARD_BATCH    64
+#define DISCARD_DELAY_MS 500
+
+/* set of block ranges [start, end), sorted and never touching. When
+ * full, new ranges are dropped: that is always safe for both uses.
+ */
+struct range_set {
+    struct range { lba_t start, end; } *r;
+    int n, max;
+};
+
+static void rs_add(struct range_set *rs, lba_t start, lba_t end)
+{
+    int i = 0;
+    while (i < rs->n && rs->r[i].end < start)
+        i++;
+
+    // merge with every range it touches
+    int j = i;
+    while (j < rs->n && rs->r[j].start <= end) {
+        if (rs->r[j].start < start)
+            start = rs->r[j].start;
+        if (rs->r[j].end > end)
+            end = rs->r[j].end;
+        j++;
+    }
+    if (j == i && rs->n == rs->max)
+        return;
+    memmove(&rs->r[i + 1], &rs->r[j], (rs->n - j) * sizeof(struct range));
+    rs->n -= j - i - 1;
+    rs->r[i].start = start;
+    rs->r[i].end = end;
+}
+
+static void rs_remove(struct range_set *rs, lba_t start, lba_t end)
+{
+    for (int i = 0; i < rs->n; i++) {
+        struct range *r = &rs->r[i];
+        if (r->end <= start || r->start >= end)
+            continue;
+        if (r->start < start && r->end > end) {
+            /* split in two; without room for that, forget it all */
+            if (rs->n == rs->max) {
+                memmove(r, r + 1, (rs->n - i - 1) * sizeof(*r));
+                rs->n--;
+                return;
+            }
+            memmove(r + 1, r, (rs->n - i) * sizeof(*r));
+            rs->n++;
+            r[0].end = start;
+            r[1].start = end;
+            return;
+        }
+        if (r->start < start) {
+            r->end = start;
+        } else if (r->end > end) {
+            r->start = end;
+        } else {
+            memmove(r, r + 1, (rs->n - i - 1) * sizeof(*r));
+            rs->n--;
+            i--;
+        }
+    }
+}
+
+static int rs_contains(struct range_set *rs, lba_t lba)
+{
+    for (int i = 0; i < rs->n && rs->r[i].start <= lba; i++) {
+        if (lba < rs->r[i].end)
+            return 1;
+    }
+    return 0;
+}
+
+static struct range     discard_q[DISCARD_MAX], hole_r[HOLES_MAX];
+static struct range_set discard_set = {discard_q, 0, DISCARD_MAX};
+static struct range_set holes = {hole_r, 0, HOLES_MAX};
+static int              use_discard, discard_running, discard_stop;
+static pthread_t        discard_thread;
+static pthread_mutex_t  discard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   discard_cond = PTHREAD_COND_INITIALIZER;
+
+/* punch blocks [lba, lba+nblks) out of every member holding them
+ */
+static int punch(lba_t lba, lba_t nblks)
+{
+    int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+    if (layout == LAYOUT_MIRROR) {
+        for (int d = 0; d < ndisks; d++) {
+            if (disk_state[d] != DISK_FAILED &&
+                fallocate(disk_fds[d], mode, (off_t)lba * FS_BLOCK_SIZE,
+                          (off_t)nblks * FS_BLOCK_SIZE) < 0)
+                return -errno;
+        }
+        return 0;
+    }
+    for (lba_t end = lba + nblks; lba < end; ) {
+        lba_t plba, run;
+        int d = map_lba(lba, &plba, &run);
+        if (run > end - lba)
+            run = end - lba;
+        if (fallocate(disk_fds[d], mode, (off_t)plba * FS_BLOCK_SIZE,
+                      (off_t)run * FS_BLOCK_SIZE) < 0)
+            return -errno;
+        lba += run;
+    }
+    return 0;
+}
+
+/* punch everything queued. Called with discard_lock held.
+ */
+static void discard_run_locked(void)
+{
+    for (int i = 0; i < discard_set.n && use_discard; i++) {
+        struct range *r = &discard_set.r[i];
+        /* cached copies go before the punch, so that a late write-back
+         * can't fill the hole in again, and after it, in case a read
+         * brought them back meanwhile */
+        bcache_invalidate(r->start, r->end);
+        if (punch(r->start, r->end - r->start) < 0) {
+            fprintf(stderr, "hole punching not supported, discard turned off\n");
+            use_discard = 0;
+            break;
+        }
+        bcache_invalidate(r->start, r->end);
+        rs_add(&holes, r->start, r->end);
+    }
+    discard_set.n = 0;
+}
+
+static void *discard_main(void *arg)
+{
+    pthread_mutex_lock(&discard_lock);
+    while (!discard_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += DISCARD_DELAY_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&discard_cond, &discard_lock, &ts);
+        discard_run_locked();
+    }
+    pthread_mutex_unlock(&discard_lock);
+    return NULL;
+}
+
+/* blocks being written are no longer to be punched, nor zero
+ */
+static void discard_forget(const lba_t *lbas, lba_t lba, int n)
+{
+    if (!use_discard)
+        return;
+    pthread_mutex_lock(&discard_lock);
+    for (int i = 0; i < n && (discard_set.n > 0 || holes.n > 0); i++) {
+        lba_t l = lbas ? lbas[i] : lba + i;
+        rs_remove(&discard_set, l, l + 1);
+        rs_remove(&holes, l, l + 1);
+    }
+    pthread_mutex_unlock(&discard_lock);
+}
+
+static void discard_halt(void)
+{
+    if (discard_running) {
+        pthread_mutex_lock(&discard_lock);
+        discard_stop = 1;
+        pthread_cond_signal(&discard_cond);
+        pthread_mutex_unlock(&discard_lock);
+        pthread_join(discard_thread, NULL);
+        discard_running = 0;
+    }
+
+    /* whatever is still queued is punched now */
+    discard_run_locked();
+    use_discard = 0;
+    holes.n = 0;
+}
+
+/* mmap backend: the image is mapped MAP_SHARED once, so reads and
+ * writes are plain memory copies through the host page cache and cost
+ * no system call. msync() is only issued by block_flush().
+ */
+static char  *disk_map;
+static size_t disk_map_blocks;
+
+static int mmap_rw(int write, void *buf, lba_t lba, int nblks)
+{
+    if (lba < 0 || nblks < 0 || (size_t)lba + nblks > disk_map_blocks)
+        return -EIO;
+
+    char *p = disk_map + (size_t)lba * FS_BLOCK_SIZE;
+    size_t len = (size_t)nblks * FS_BLOCK_SIZE;
+    if (write)
+        memcpy(p, buf, len);
+    else
+        memcpy(buf, p, len);
+    return 0;
+}
+
+static int mmap_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (mmap_rw(write, bufs[i], lbas[i], 1) < 0)
+            return -EIO;
+    }
+    return 0;
+}
+
+static int mmap_flush(void)
+{
+    return msync(disk_map, disk_map_blocks * FS_BLOCK_SIZE, MS_SYNC) < 0 ?
+        -EIO : 0;
+}
+
+static const struct blk_ops mmap_ops = {
+    .rw = mmap_rw,
+    .rwv = mmap_rwv,
+    .flush = mmap_flush,
+};
+
+/* RAM backend (block_ram_init): the whole image is read into anonymous
+ * memory and all block I/O is served from there. Written blocks are
+ * marked in a dirty bitmap, and only those are written back - in LBA
+ * order, so that consecutive dirty blocks go out as one sequential
+ * transfer - at a checkpoint (block_flush) and at block_close.
+ * Anything written since the last checkpoint is lost if the process
+ * dies.
+ */
+#define RAM_WB_CHUNK BLOCK_BATCH   /* blocks per write-back request */
+
+static char     *ram_data;
+static uint64_t *ram_dirty;
+static lba_t     ram_blocks;
+static pthread_mutex_t ram_ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ram_mark(lba_t lba)
+{
+    __atomic_fetch_or(&ram_dirty[lba / 64], 1ULL << (lba % 64), __ATOMIC_RELEASE);
+}
+
+static int ram_rw(int write, void *buf, lba_t lba, int nblks)
+{
+    if (lba < 0 || nblks < 0 || lba + nblks > ram_blocks)
+        return -EIO;
+
+    char *p = ram_data + (size_t)lba * FS_BLOCK_SIZE;
+    size_t len = (size_t)nblks * FS_BLOCK_SIZE;
+    if (!write) {
+        memcpy(buf, p, len);
+        return 0;
+    }
+
+    /* marked after the copy: a checkpoint clears the bit before writing
+     * the block out, so if it catches the block half-copied the bit is
+     * set again and the block goes out at the next checkpoint */
+    memcpy(p, buf, len);
+    for (int i = 0; i < nblks; i++)
+        ram_mark(lba + i);
+    return 0;
+}
+
+static int ram_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (ram_rw(write, bufs[i], lbas[i], 1) < 0)
+            return -EIO;
+    }
+    return 0;
+}
+
+/* write out one batch of dirty blocks; on failure they stay dirty
  */
-static int disk_fd;
+static int ram_writeback(void **bufs, lba_t *lbas, int n)
+{
+    if (n == 0 || pio_rwv(1, bufs, lbas, n) == 0)
+        return 0;
+    for (int i = 0; i < n; i++)
+        ram_mark(lbas[i]);
+    return -EIO;
+}
 
-/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+/* checkpoint: write back every dirty block and flush the image
  */
-int block_read(char *buf, int lba, int nblks)
+static int ram_flush(void)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    void *bufs[RAM_WB_CHUNK];
+    lba_t lbas[RAM_WB_CHUNK];
+    int n = 0, rv = 0;
 
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
-        return -EIO;
-    if (read(disk_fd, buf, len) != len)
-        return -EIO;
+    pthread_mutex_lock(&ram_ckpt_lock);
+    for (lba_t w = 0; w < (ram_blocks + 63) / 64; w++) {
+        uint64_t bits = __atomic_exchange_n(&ram_dirty[w], 0, __ATOMIC_ACQUIRE);
+        while (bits != 0) {
+            lba_t lba = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            bufs[n] = ram_data + (size_t)lba * FS_BLOCK_SIZE;
+            lbas[n++] = lba;
+            if (n == RAM_WB_CHUNK) {
+                rv |= ram_writeback(bufs, lbas, n);
+                n = 0;
+            }
+        }
+    }
+    rv |= ram_writeback(bufs, lbas, n);
+    rv |= pio_flush();
+    pthread_mutex_unlock(&ram_ckpt_lock);
+    return rv < 0 ? -EIO : 0;
+}
+
+static void ram_free(void)
+{
+    if (ram_data != NULL)
+        munmap(ram_data, (size_t)ram_blocks * FS_BLOCK_SIZE);
+    free(ram_dirty);
+    ram_data = NULL;
+    ram_dirty = NULL;
+    ram_blocks = 0;
+}
+
+static const struct blk_ops ram_ops = {
+    .rw = ram_rw,
+    .rwv = ram_rwv,
+    .flush = ram_flush,
+};
+
+/* remote backend: everything is done by the client in remote.c
+ */
+static int remote_rw(int write, void *buf, lba_t lba, int nblks)
+{
+    void *bufs[nblks];
+    lba_t lbas[nblks];
+    for (int i = 0; i < nblks; i++) {
+        bufs[i] = (char *)buf + (size_t)i * FS_BLOCK_SIZE;
+        lbas[i] = lba + i;
+    }
+    return remote_rwv(write, bufs, lbas, nblks);
+}
+
+static const struct blk_ops remote_ops = {
+    .rw = remote_rw,
+    .rwv = remote_rwv,
+    .flush = remote_flush,
+};
+
+/* Requests are passed down at most BLOCK_BATCH blocks at a time: the
+ * layers below keep per-block state on the stack (times the number
+ * of members, for a mirror), and a request may be as big as the whole
+ * bitmap of a large image.
+ */
+static int batched_rwv(int write, void **bufs, const lba_t *lbas, int n,
+                       int (*rwv)(int, void **, const lba_t *, int))
+{
+    for (int k = 0; k < n; k += BLOCK_BATCH) {
+        int cnt = (n - k < BLOCK_BATCH) ? n - k : BLOCK_BATCH;
+        int rv = rwv(write, bufs + k, lbas + k, cnt);
+        if (rv < 0)
+            return rv;
+    }
     return 0;
 }
 
-/* write blocks from disk image. Returns -EIO if error, 0 otherwise
+/* what the buffer cache sits on: whichever backend is in use
+ */
+static int backend_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    return batched_rwv(write, bufs, lbas, n, blk->rwv);
+}
+
+/* a contiguous request, through the buffer cache
  */
-int block_write(char *buf, int lba, int nblks)
+static int cached_rw(int write, void *buf, lba_t lba, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    void *bufs[nblks];
+    lba_t lbas[nblks];
+    for (int i = 0; i < nblks; i++) {
+        bufs[i] = (char *)buf + (size_t)i * FS_BLOCK_SIZE;
+        lbas[i] = lba + i;
+    }
+    return bcache_rwv(write, bufs, lbas, nblks, BCACHE_META);
+}
+
+/* a contiguous request, a batch at a time
+ */
+static int batched_rw(int write, void *buf, lba_t lba, int nblks)
+{
+    for (int k = 0; k < nblks; k += BLOCK_BATCH) {
+        int cnt = (nblks - k < BLOCK_BATCH) ? nblks - k : BLOCK_BATCH;
+        char *p = (char *)buf + (size_t)k * FS_BLOCK_SIZE;
+        int rv = bcache_active() ? cached_rw(write, p, lba + k, cnt) :
+            blk->rw(write, p, lba + k, cnt);
+        if (rv < 0)
+            return rv;
+    }
+    return 0;
+}
 
+/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_read(void *buf, lba_t lba, int nblks)
+{
+    return batched_rw(0, buf, lba, nblks);
+}
+
+/* write blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_write(void *buf, lba_t lba, int nblks)
+{
     assert(lba > 0);        /* write to 0 is *always* an error */
 
-    /* Seek to the *end* of the region being written, to make sure it
-     * all fits on the disk image. Then seek to write location.
-     */
-    if (lseek(disk_fd, start + len, SEEK_SET) < 0)
-        return -EIO;
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+    discard_forget(NULL, lba, nblks);
+    return batched_rw(1, buf, lba, nblks);
+}
+
+/* vectored I/O for blocks of class 'cls' (BCACHE_META or _DATA),
+ * which only matters to the buffer cache
+ */
+static int class_rwv(int write, void **bufs, const lba_t *lbas, int n, int cls)
+{
+    if (n <= 0)
+        return 0;
+    if (write) {
+        for (int i = 0; i < n; i++)
+            assert(lbas[i] > 0);
+        discard_forget(lbas, 0, n);
+    }
+    if (!bcache_active())
+        return batched_rwv(write, bufs, lbas, n, blk->rwv);
+    for (int k = 0; k < n; k += BLOCK_BATCH) {
+        int cnt = (n - k < BLOCK_BATCH) ? n - k : BLOCK_BATCH;
+        int rv = bcache_rwv(write, bufs + k, lbas + k, cnt, cls);
+        if (rv < 0)
+            return rv;
+    }
+    return 0;
+}
+
+int block_readv(void **bufs, const lba_t *lbas, int n)
+{
+    return class_rwv(0, bufs, lbas, n, BCACHE_META);
+}
+
+int block_writev(void **bufs, const lba_t *lbas, int n)
+{
+    return class_rwv(1, bufs, lbas, n, BCACHE_META);
+}
+
+/* same as block_readv/block_writev, for file data: the buffer cache
+ * gives it way to metadata (see bcache.c)
+ */
+int block_data_readv(void **bufs, const lba_t *lbas, int n)
+{
+    return class_rwv(0, bufs, lbas, n, BCACHE_DATA);
+}
+
+int block_data_writev(void **bufs, const lba_t *lbas, int n)
+{
+    return class_rwv(1, bufs, lbas, n, BCACHE_DATA);
+}
+
+/* make everything written so far durable on the image, writing back
+ * the buffer cache first. Returns -EIO if error (now or in an earlier
+ * write-back), 0 otherwise
+ */
+int block_flush(void)
+{
+    int rv = bcache_active() ? bcache_sync() : 0;
+    if (blk->flush() < 0)
+        rv = -EIO;
+    return rv;
+}
+
+/* start writing back the buffer cache, without waiting. Returns -EIO
+ * if a write-back failed since the last call (each failure is reported
+ * once; block_flush reports it again), 0 otherwise
+ */
+int block_writeback(void)
+{
+    return bcache_active() ? bcache_writeback() : 0;
+}
+
+/* 1 if block_write may leave blocks in memory (a write-back buffer
+ * cache) until block_writeback or block_flush, 0 if every write goes
+ * to the backend before returning
+ */
+int block_write_back(void)
+{
+    return bcache_write_back();
+}
+
+/* pointer to block 'lba' inside the image mapping (or the in-memory
+ * image of the RAM backend), or NULL if neither is in use (or lba is
+ * out of range). Callers may read through the pointer instead of
+ * copying the block out with block_read.
+ */
+void *block_map(lba_t lba)
+{
+    if (blk == &ram_ops && lba >= 0 && lba < ram_blocks)
+        return ram_data + (size_t)lba * FS_BLOCK_SIZE;
+    if (blk != &mmap_ops || lba < 0 || (size_t)lba >= disk_map_blocks)
+        return NULL;
+    return disk_map + (size_t)lba * FS_BLOCK_SIZE;
+}
+
+/* access-pattern hint for blocks [lba, lba+nblks), 'advice' being one
+ * of POSIX_FADV_NORMAL, _SEQUENTIAL, _RANDOM or _WILLNEED. Turned into
+ * madvise() for the mapping or posix_fadvise() for the image file.
+ */
+void block_advise(lba_t lba, int nblks, int advice)
+{
+    off_t start = (off_t)lba * FS_BLOCK_SIZE;
+    size_t len = (size_t)nblks * FS_BLOCK_SIZE;
+
+    if (blk == &ram_ops)
+        return;
+    if (layout == LAYOUT_MIRROR) {
+        for (int d = 0; d < ndisks; d++)
+            posix_fadvise(disk_fds[d], start, len, advice);
+        return;
+    }
+
+    if (blk == &mmap_ops) {
+        int madv = (advice == POSIX_FADV_SEQUENTIAL) ? MADV_SEQUENTIAL :
+            (advice == POSIX_FADV_RANDOM) ? MADV_RANDOM :
+            (advice == POSIX_FADV_WILLNEED) ? MADV_WILLNEED : MADV_NORMAL;
+        if (lba < 0 || (size_t)lba + nblks > disk_map_blocks)
+            return;
+        madvise(disk_map + start, len, madv);
+    } else {
+        /* one call per piece that is contiguous on a member */
+        for (lba_t end = lba + nblks; lba < end; ) {
+            lba_t plba, run;
+            int d = map_lba(lba, &plba, &run);
+            if (run > end - lba)
+                run = end - lba;
+            posix_fadvise(disk_fds[d], (off_t)plba * FS_BLOCK_SIZE,
+                          (off_t)run * FS_BLOCK_SIZE, advice);
+            lba += run;
+        }
+    }
+}
+
+/* file data blocks 'lbas' will be read soon: read them into the
+ * buffer cache in the background, or without one let the host start
+ * reading them (POSIX_FADV_WILLNEED on each run of consecutive blocks;
+ * nothing for a remote image). Returns how many of the blocks, from
+ * the first, were taken; the cache may have no room for the rest yet.
+ */
+int block_prefetch(const lba_t *lbas, int n)
+{
+    if (bcache_active())
+        return bcache_prefetch(lbas, n);
+    if (ndisks == 0)
+        return n;
+    for (int i = 0, run = 1; i < n; i++, run++) {
+        if (i == n - 1 || lbas[i + 1] != lbas[i] + 1) {
+            block_advise(lbas[i] - run + 1, run, POSIX_FADV_WILLNEED);
+            run = 0;
+        }
+    }
+    return n;
+}
+
+/* blocks [lba, lba+nblks) are no longer in use: queue them to be
+ * punched out of the image (if block_discard_init was called).
+ */
+void block_discard(lba_t lba, int nblks)
+{
+    if (!use_discard || nblks <= 0)
+        return;
+    pthread_mutex_lock(&discard_lock);
+    /* the thread is started on first use rather than in
+     * block_discard_init, which runs before fuse_main forks */
+    if (!discard_running) {
+        discard_stop = 0;
+        discard_running = pthread_create(&discard_thread, NULL,
+                                         discard_main, NULL) == 0;
+    }
+    rs_add(&discard_set, lba, lba + nblks);
+    if (discard_set.n >= DISCARD_BATCH)
+        pthread_cond_signal(&discard_cond);
+    pthread_mutex_unlock(&discard_lock);
+}
+
+/* 1 if block 'lba' is known to read back as zeros (it was punched and
+ * not written since), 0 if not known
+ */
+int block_zeroed(lba_t lba)
+{
+    if (!use_discard)
+        return 0;
+    pthread_mutex_lock(&discard_lock);
+    int rv = rs_contains(&holes, lba);
+    pthread_mutex_unlock(&discard_lock);
+    return rv;
+}
+
+/* punch holes for discarded blocks from now on. Returns 0, or -EINVAL
+ * for the kinds of image it can't be done on (RAID-5, whose parity
+ * would no longer match, remote images, and the RAM backend, whose
+ * copy of a block would no longer match a hole).
+ */
+int block_discard_init(void)
+{
+    if (ndisks == 0 || layout == LAYOUT_RAID5 || blk == &ram_ops)
+        return -EINVAL;
+    discard_set.n = holes.n = 0;
+    use_discard = 1;
+    return 0;
+}
+
+/* serve all block I/O from a shared mapping of the image opened by
+ * block_init. Returns 0, or <0 if the image cannot be mapped (the pio
+ * backend stays in use). Image sets are never mapped.
+ */
+int block_mmap_init(void)
+{
+    struct stat st;
+
+    if (ndisks != 1 || blk != &pio_ops || bcache_active())
+        return -EINVAL;
+    if (fstat(disk_fds[0], &st) < 0 || st.st_size < FS_BLOCK_SIZE)
         return -EIO;
-    if (write(disk_fd, buf, len) != len)
+    disk_map_blocks = st.st_size / FS_BLOCK_SIZE;
+    disk_map = mmap(NULL, disk_map_blocks * FS_BLOCK_SIZE,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, disk_fds[0], 0);
+    if (disk_map == MAP_FAILED) {
+        disk_map = NULL;
+        return -errno;
+    }
+
+    /* file system metadata is scattered over the image, so default to
+     * no readahead; fs_read asks for sequential ranges explicitly.
+     */
+    madvise(disk_map, disk_map_blocks * FS_BLOCK_SIZE, MADV_RANDOM);
+    blk = &mmap_ops;
+    return 0;
+}
+
+/* size of the image (set) in blocks, as seen by the file system
+ */
+static lba_t image_blocks(void)
+{
+    struct stat st;
+    lba_t min = -1;
+
+    for (int d = 0; d < ndisks; d++) {
+        if (fstat(disk_fds[d], &st) < 0)
+            return -1;
+        if (min < 0 || st.st_size / FS_BLOCK_SIZE < min)
+            min = st.st_size / FS_BLOCK_SIZE;
+    }
+    if (layout == LAYOUT_MIRROR)
+        return label_lba;
+    if (layout == LAYOUT_RAID5)
+        return (label_lba / stripe_unit) * stripe_unit * (ndisks - 1);
+    if (ndisks == 1)
+        return min;
+    return ((min - 1) / stripe_unit) * stripe_unit * ndisks;     /* less the label */
+}
+
+/* memory the block layer holds outside the buffer cache, for a memory
+ * budget (lab5fuse -mem): the RAM backend's copy of the image and its
+ * dirty bitmap, the RAID-5 partial row cache, the remote client's
+ * cache and the io_uring rings; and, as it is sized by a local image,
+ * the file system's block bitmap (one bit per block). Call after the other
+ * block_*_init functions.
+ */
+size_t block_mem(void)
+{
+    size_t n = uring_mem() + remote_mem();
+    lba_t nblocks = (blk == &remote_ops) ? 0 : image_blocks();
+
+    if (nblocks > 0)
+        n += (size_t)nblocks / 8;
+    if (ram_data != NULL)
+        n += (size_t)ram_blocks * FS_BLOCK_SIZE + (ram_blocks + 63) / 64 * sizeof(uint64_t);
+    if (layout == LAYOUT_RAID5)
+        n += (size_t)R5_PENDING * r5_row_blocks() * (FS_BLOCK_SIZE + 1);
+    return n;
+}
+
+/* read the whole image (set) into memory and serve all block I/O from
+ * there (see "RAM backend" above). Must be called after the other
+ * block_*_init functions except block_mmap_init and block_discard_init,
+ * which it excludes. Returns 0, or <0 if the image can't be loaded, in
+ * which case the pio backend stays in use.
+ */
+int block_ram_init(void)
+{
+    if (ndisks == 0 || blk != &pio_ops || use_discard || bcache_active())
+        return -EINVAL;
+    lba_t n = image_blocks();
+    if (n <= 0)
         return -EIO;
+
+    // 1. anonymous memory for the image, and its dirty bitmap
+    ram_data = mmap(NULL, (size_t)n * FS_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram_data == MAP_FAILED) {
+        ram_data = NULL;
+        return -ENOMEM;
+    }
+    if ((ram_dirty = calloc((n + 63) / 64, sizeof(uint64_t))) == NULL) {
+        munmap(ram_data, (size_t)n * FS_BLOCK_SIZE);
+        ram_data = NULL;
+        return -ENOMEM;
+    }
+    ram_blocks = n;
+
+    // 2. load it, in large sequential reads
+    for (lba_t lba = 0; lba < n; lba += RAM_WB_CHUNK) {
+        int cnt = (n - lba < RAM_WB_CHUNK) ? n - lba : RAM_WB_CHUNK;
+        if (pio_rw(0, ram_data + (size_t)lba * FS_BLOCK_SIZE, lba, cnt) < 0) {
+            ram_free();
+            return -EIO;
+        }
+    }
+    blk = &ram_ops;
+    return 0;
+}
+
+/* put a buffer cache of 'nblocks' blocks in front of the backend (see
+ * bcache.c), write-back with up to 'dirty_pct' percent of it dirty, or
+ * write-through if 0. 'policy' is BCACHE_LRU or BCACHE_2Q; 'huge' asks
+ * for huge pages. Pointless for the backends that already serve blocks
+ * from memory (mmap, RAM), so refused for those. Returns 0, or -errno.
+ */
+int block_cache_init(int nblocks, int dirty_pct, int policy, int huge)
+{
+    if (blk == &mmap_ops || blk == &ram_ops)
+        return -EINVAL;
+    return bcache_init(nblocks, dirty_pct, policy, huge, backend_rwv);
+}
+
+/* keep block 'lba' in the buffer cache until block_unpin; for metadata
+ * used on every operation. Returns 0, or <0 if there is no cache or no
+ * room in it.
+ */
+int block_pin(lba_t lba)
+{
+    return bcache_active() ? bcache_pin(lba) : -EINVAL;
+}
+
+void block_unpin(lba_t lba)
+{
+    if (bcache_active())
+        bcache_unpin(lba);
+}
+
+/* Warm-cache sidecar: "<first image>.warm" holds the buffer cache's
+ * hot blocks (bcache_hot) as of the last unmount, so that the next
+ * mount can load them before they are asked for. Only block numbers
+ * are kept; the blocks are read from the image again, so an out of
+ * date sidecar costs some reads but can't do harm.
+ */
+#define WARM_MAGIC 0x4d52415736355346ULL    /* "FS56WARM" */
+
+struct warm_hdr {
+    uint64_t magic;
+    uint64_t n;
+};
+
+/* write the hot set to the sidecar (replacing it as a whole).
+ * Returns 0, or -errno; no-op without a cache or image file.
+ */
+int block_warm_save(void)
+{
+    if (!bcache_active() || ndisks == 0)
+        return 0;
+    struct bcache_stats st;
+    bcache_get_stats(&st);
+    lba_t *lbas = malloc((size_t)st.size * sizeof(*lbas));
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.warm", disk_names[0]);
+    if (lbas == NULL) {
+        fprintf(stderr, "cannot save warm-cache list %s: out of memory\n", path);
+        return -ENOMEM;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.warm.tmp", disk_names[0]);
+
+    struct warm_hdr hdr = {WARM_MAGIC, bcache_hot(lbas, st.size)};
+    size_t len = hdr.n * sizeof(*lbas);
+    int rv = 0, fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 ||
+        write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write(fd, lbas, len) != (ssize_t)len ||
+        rename(tmp, path) < 0) {
+        rv = -errno;
+        fprintf(stderr, "cannot save warm-cache list %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(lbas);
+    return rv;
+}
+
+/* start loading the blocks listed in the sidecar into the buffer
+ * cache, in the background. Returns the number of blocks listed, 0 if
+ * there is no usable sidecar (or no cache).
+ */
+int block_warm_load(void)
+{
+    if (!bcache_active() || ndisks == 0)
+        return 0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.warm", disk_names[0]);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "cannot read warm-cache list %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    struct warm_hdr hdr;
+    struct bcache_stats st;
+    bcache_get_stats(&st);
+    lba_t *lbas = NULL;
+    int n = 0;
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == WARM_MAGIC) {
+        n = (hdr.n < (uint64_t)st.size) ? (int)hdr.n : st.size;
+        size_t len = (size_t)n * sizeof(*lbas);
+        if (n > 0 && ((lbas = malloc(len)) == NULL || read(fd, lbas, len) != (ssize_t)len))
+            n = -1;
+    } else {
+        n = -1;
+    }
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "warm-cache list %s is not usable, ignored\n", path);
+        n = 0;
+    }
+    lba_t max = image_blocks();
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        if (lbas[i] > 0 && lbas[i] < max)
+            lbas[k++] = lbas[i];
+    }
+    bcache_warm(lbas, k);
+    free(lbas);
+    return k;
+}
+
+/* switch vectored I/O to an io_uring with room for 'depth' requests.
+ * Returns 0, or <0 if io_uring is unavailable, in which case the
+ * synchronous path stays in use.
+ */
+int block_uring_init(int depth)
+{
+    int rv = uring_setup(depth);
+    if (rv == 0)
+        use_uring = 1;
+    return rv;
+}
+
+/* reopen the image with O_DIRECT so block I/O bypasses the host page
+ * cache. Returns 0, or -errno if the host file system refuses, in which
+ * case buffered I/O stays in use.
+ */
+int block_direct_init(void)
+{
+    int fds[BLOCK_MAX_DISKS];
+
+    if (ndisks == 0)
+        return -EINVAL;
+
+    for (int d = 0; d < ndisks; d++) {
+        if ((fds[d] = open(disk_names[d], O_RDWR | O_DIRECT)) < 0) {
+            int err = errno;
+            while (d-- > 0)
+                close(fds[d]);
+            return -err;
+        }
+    }
+    for (int d = 0; d < ndisks; d++) {
+        close(disk_fds[d]);
+        disk_fds[d] = fds[d];
+    }
+    disk_direct = 1;
+    return 0;
+}
+
+/* set the stripe unit (in blocks) of an image set. It must match the
+ * one the set was built with (see block_stripe_check). Returns 0, or
+ * -EINVAL.
+ */
+int block_stripe_init(int unit)
+{
+    if (unit <= 0)
+        return -EINVAL;
+    stripe_unit = unit;
+    return 0;
+}
+
+/* read the labels of a redundant set with label 'magic' into 'lab'
+ * (magic 0 if a member has none). The members must all be the same
+ * size. Returns the member with the newest generation, or -EINVAL.
+ */
+static int set_read_labels(uint32_t magic, struct set_label *lab)
+{
+    struct stat st;
+    off_t size = 0;
+    int primary = -1;
+
+    for (int d = 0; d < ndisks; d++) {
+        if (fstat(disk_fds[d], &st) < 0 || (d > 0 && st.st_size != size))
+            return -EINVAL;
+        size = st.st_size;
+    }
+    if (size < 2 * FS_BLOCK_SIZE)
+        return -EINVAL;
+    label_lba = size / FS_BLOCK_SIZE - 1;
+    label_magic = magic;
+
+    for (int d = 0; d < ndisks; d++) {
+        if (label_io(0, d, &lab[d]) < 0 || lab[d].magic != magic) {
+            lab[d].magic = 0;
+            continue;
+        }
+        if (primary < 0 || lab[d].gen > lab[primary].gen)
+            primary = d;
+    }
+    return primary < 0 ? -EINVAL : primary;
+}
+
+/* 1 if label 'lab', read from member 'd', was written for this place
+ * in a set of this many members (and, if 'striped', this stripe unit)
+ */
+static int label_fits(const struct set_label *lab, int d, int striped)
+{
+    if (lab->nmembers == 0)
+        return 1;
+    if (lab->member == (uint32_t)d && lab->nmembers == (uint32_t)ndisks &&
+        (!striped || lab->unit == (uint32_t)stripe_unit))
+        return 1;
+    fprintf(stderr, "%s is member %u of %u with stripe unit %u, not member %d of %d "
+            "with stripe unit %d\n", disk_names[d], lab->member, lab->nmembers,
+            lab->unit, d, ndisks, stripe_unit);
+    return 0;
+}
+
+/* check a striped image set (several files, neither mirrored nor
+ * RAID-5) against its labels: the files must be given in the order
+ * split-img.py built the set in, and the stripe unit must be the one
+ * it was built with. Must be called after block_stripe_init. Returns 0
+ * (also for a single image file), or -EINVAL.
+ */
+int block_stripe_check(void)
+{
+    struct set_label lab[BLOCK_MAX_DISKS];
+
+    if (ndisks < 2)
+        return 0;
+    if (set_read_labels(STRIPE_MAGIC, lab) < 0)
+        return -EINVAL;
+    for (int d = 0; d < ndisks; d++) {
+        if (lab[d].magic != STRIPE_MAGIC || !label_fits(&lab[d], d, 1))
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/* treat the image set as a mirror (see "mirrored sets" above). Must
+ * be called right after block_init. Returns 0, or -EINVAL if the files
+ * are not a mirrored set built by split-img.py.
+ */
+int block_mirror_init(void)
+{
+    struct set_label lab[BLOCK_MAX_DISKS];
+
+    if (ndisks < 2)
+        return -EINVAL;
+
+    // 1. the member with the newest generation is the reference copy
+    int primary = set_read_labels(MIRROR_MAGIC, lab);
+    if (primary < 0)
+        return -EINVAL;
+
+    // 2. the others are up to date if they have the same generation and
+    //    the set was unmounted cleanly; otherwise resync them
+    for (int d = 0; d < ndisks; d++) {
+        int same = lab[d].magic == MIRROR_MAGIC &&
+            lab[d].gen == lab[primary].gen && lab[primary].clean;
+        disk_state[d] = (d == primary || same) ? DISK_OK : DISK_STALE;
+        disk_last[d] = 0;
+    }
+
+    // 3. a new generation for this mount
+    layout = LAYOUT_MIRROR;
+    set_gen = lab[primary].gen + 1;
+    set_write_labels(0);
+    return 0;
+}
+
+/* treat the image set as RAID-5 with the current stripe unit (see
+ * "RAID-5 sets" above). Must be called right after block_init and
+ * block_stripe_init. Returns 0, or -EINVAL if the files are not a
+ * RAID-5 set built by split-img.py, or more than one member is out
+ * of date.
+ */
+int block_raid5_init(void)
+{
+    struct set_label lab[BLOCK_MAX_DISKS];
+    int nfailed = 0;
+
+    if (ndisks < 3)
+        return -EINVAL;
+    int primary = set_read_labels(RAID5_MAGIC, lab);
+    if (primary < 0 || label_lba < stripe_unit)
+        return -EINVAL;
+
+    // 1. the members must be in their places, with the same stripe unit
+    for (int d = 0; d < ndisks; d++) {
+        if (lab[d].magic == RAID5_MAGIC && !label_fits(&lab[d], d, 1))
+            return -EINVAL;
+    }
+
+    // 2. a member that missed writes can't be used; run without it
+    for (int d = 0; d < ndisks; d++) {
+        int same = lab[d].magic == RAID5_MAGIC && lab[d].gen == lab[primary].gen;
+        disk_state[d] = same ? DISK_OK : DISK_FAILED;
+        nfailed += !same;
+    }
+    if (nfailed > 1)
+        return -EINVAL;
+    if (nfailed == 1)
+        fprintf(stderr, "%s is out of date, running degraded\n",
+                disk_names[r5_failed_disk()]);
+    if (!lab[primary].clean)
+        fprintf(stderr, "RAID-5 set not shut down cleanly, parity may be stale\n");
+
+    // 3. the partial row cache
+    for (int i = 0; i < R5_PENDING; i++) {
+        r5_cache[i].row = -1;
+        r5_cache[i].have = malloc(r5_row_blocks());
+        if (r5_cache[i].have == NULL ||
+            posix_memalign((void **)&r5_cache[i].data, BLOCK_ALIGN,
+                           (size_t)r5_row_blocks() * FS_BLOCK_SIZE) != 0) {
+            r5_cache[i].data = NULL;
+            r5_free();
+            return -ENOMEM;
+        }
+    }
+
+    // 4. a new generation for this mount
+    layout = LAYOUT_RAID5;
+    set_gen = lab[primary].gen + 1;
+    set_write_labels(0);
     return 0;
 }
 
+/* start bringing stale mirror members up to date in the background.
+ * 'map' is the file system's block bitmap covering 'nblocks' blocks;
+ * only blocks marked in use are copied. Does nothing if there is
+ * nothing to resync.
+ */
+void block_resync(const unsigned char *map, lba_t nblocks)
+{
+    int stale = 0;
+    for (int d = 0; d < ndisks; d++)
+        stale |= (layout == LAYOUT_MIRROR && disk_state[d] == DISK_STALE);
+    if (!stale || resync_running)
+        return;
+
+    if ((resync_map = malloc((nblocks + 7) / 8)) == NULL)
+        return;
+    memcpy(resync_map, map, (nblocks + 7) / 8);
+    resync_nblocks = nblocks;
+    resync_stop = 0;
+    if (pthread_create(&resync_thread, NULL, resync_run, NULL) != 0) {
+        free(resync_map);
+        resync_map = NULL;
+        return;
+    }
+    resync_running = 1;
+}
+
+/* flush and close the image (set). Members of a redundant set are
+ * marked clean.
+ */
+void block_close(void)
+{
+    resync_halt();
+    discard_halt();
+    if (ndisks > 0 || blk == &remote_ops) {
+        block_flush();
+        if (layout != LAYOUT_STRIPE)
+            set_write_labels(1);
+    }
+    disk_workers_halt();
+    if (bcache_active()) {
+        struct bcache_stats st;
+        bcache_get_stats(&st);
+        fprintf(stderr, "block cache: %llu hits, %llu misses, %llu evictions, "
+                "%llu written back, %llu throttled writes, %llu read ahead, "
+                "%llu warmed\n",
+                (unsigned long long)st.hits, (unsigned long long)st.misses,
+                (unsigned long long)st.evictions,
+                (unsigned long long)st.writebacks,
+                (unsigned long long)st.throttled,
+                (unsigned long long)st.prefetched,
+                (unsigned long long)st.warmed);
+        bcache_free();
+    }
+    if (blk == &remote_ops)
+        remote_disconnect();
+    r5_free();
+    ram_free();
+    if (disk_map != NULL) {
+        munmap(disk_map, disk_map_blocks * FS_BLOCK_SIZE);
+        disk_map = NULL;
+    }
+    blk = &pio_ops;
+    layout = LAYOUT_STRIPE;
+    disk_direct = 0;
+    for (int d = 0; d < ndisks; d++) {
+        close(disk_fds[d]);
+        free(disk_names[d]);
+        disk_state[d] = DISK_OK;
+    }
+    ndisks = 0;
+}
+
+/* use the image served by the block server at 'addr' ("unix:/path" or
+ * "tcp:host:port", see blkserver.c) instead of a local image. Returns
+ * 0, or -errno if the server can't be reached.
+ */
+int block_remote_init(const char *addr)
+{
+    block_close();
+    int rv = remote_connect(addr);
+    if (rv == 0)
+        blk = &remote_ops;
+    return rv;
+}
+
+/* open the image 'file', or the image set "a.img,b.img,..."
+ */
 void block_init(char *file)
 {
-    if (strlen(file) < 4 || strcmp(file+strlen(file)-4, ".img") != 0) {
-        printf("bad image file (must end in .img): %s\n", file);
-        exit(1);
+    block_close();
+
+    char *list = strdup(file), *save = NULL;
+    for (char *name = strtok_r(list, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        if (strlen(name) < 4 || strcmp(name+strlen(name)-4, ".img") != 0) {
+            printf("bad image file (must end in .img): %s\n", name);
+            exit(1);
+        }
+        if (ndisks == BLOCK_MAX_DISKS) {
+            printf("too many image files (max %d)\n", BLOCK_MAX_DISKS);
+            exit(1);
+        }
+        if ((disk_fds[ndisks] = open(name, O_RDWR)) < 0) {
+            printf("cannot open image file '%s': %s\n", name, strerror(errno));
+            exit(1);
+        }
+        /* by absolute path: fuse_main changes to / before the
+         * warm-cache sidecar next to the image is written */
+        char *full = realpath(name, NULL);
+        disk_names[ndisks++] = (full != NULL) ? full : strdup(name);
     }
-    if ((disk_fd = open(file, O_RDWR)) < 0) {
-        printf("cannot open image file '%s': %s\n", file, strerror(errno));
+    free(list);
+    if (ndisks == 0) {
+        printf("bad image file (must end in .img): %s\n", file);
         exit(1);
     }
 }
@@ -14,11 +14,18 @@ blks = [bytes(os.read(fd, 4096)) for _ in range(nblks)]
 sb = fs.super.from_buffer_copy(blks[0])
 print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
-print ('            blocks: %d%s' %
-           (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+lba64 = (sb.flags & fs.FEAT_LBA64) != 0
+disk_sz = sb.disk_sz64 if lba64 else sb.disk_sz
+print ('            blocks: %d%s%s' %
+           (disk_sz, (' *BAD* %d' % nblks) if disk_sz != nblks else '',
+            ' (64-bit)' if lba64 else ''))
 print
 
-blkmap = fs.bitmap.from_buffer_copy(blks[1])
+maps = [fs.bitmap.from_buffer_copy(blks[1])]
+if sb.flags & fs.FEAT_BITMAP:
+    maps += [fs.bitmap.from_buffer_copy(blks[sb.bitmap_ext + k])
+                 for k in range(sb.bitmap_blocks - 1)]
+blkmap = fs.bitmaps(maps)
 inodes = dict()
 
 print("blocks used:"),
@@ -31,6 +38,8 @@ for i in range(nblks):
         print ' %d%s' % (i, e),
         e = ''
 print '\n'
+nused = len([i for i in range(disk_sz) if blkmap.get(i)])
+print 'blocks in use: %d, free: %d\n' % (nused, disk_sz - nused)
 
 names = dict()
 names[2] = ''
@@ -39,7 +48,7 @@ def iter(name, inum, v):
     assert inum < nblks
     children = []
     inodes[inum] = 1
-    _in = fs.inode.from_buffer_copy(blks[inum])
+    _in = (fs.inode64 if lba64 else fs.inode).from_buffer_copy(blks[inum])
     alloc = '' if blkmap.get(inum) else 'NOT MARKED IN BITMAP '
     s = '/' if name is '' else name
 
@@ -0,0 +1,327 @@
+/*
+ * file:        remote.c
+ * description: client for a remote block store (see remote.h for the
+ *              protocol), used by the block layer in misc.c when an
+ *              image is mounted with -remote.
+ *
+ * Blocks read from the server are kept in a direct-mapped client cache,
+ * and writes go through it to the server. The runs of a vectored
+ * request are pipelined: up to REMOTE_WINDOW requests are on the wire
+ * before the first response is waited for, so a multi-block request
+ * costs about one round trip instead of one per run.
+ *
+ * There is a single connection; requests from different threads take
+ * turns on it (sock_lock). The cache is only updated with sock_lock
+ * held, in the order the server saw the requests, so a read can never
+ * put a block older than a concurrent write into the cache.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "remote.h"
+
+#define REMOTE_WINDOW       32      /* requests in flight per batch */
+#define REMOTE_CACHE_BLOCKS 1024    /* client cache size (4 MB) */
+
+static int sock = -1;
+static pthread_mutex_t sock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static lba_t *cache_lba;            /* block in each slot, -1 if none */
+static char  *cache_data;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int blkp_addr(const char *addr, struct sockaddr_storage *sa, socklen_t *len)
+{
+    memset(sa, 0, sizeof(*sa));
+
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)sa;
+        if (strlen(addr + 5) >= sizeof(un->sun_path))
+            return -EINVAL;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr + 5);
+        *len = sizeof(*un);
+        return AF_UNIX;
+    }
+
+    if (strncmp(addr, "tcp:", 4) == 0) {
+        char host[256];
+        const char *port = strrchr(addr + 4, ':');
+        struct addrinfo hints, *ai;
+
+        if (port == NULL || port - (addr + 4) >= sizeof(host))
+            return -EINVAL;
+        memcpy(host, addr + 4, port - (addr + 4));
+        host[port - (addr + 4)] = 0;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &ai) != 0)
+            return -EINVAL;
+        memcpy(sa, ai->ai_addr, ai->ai_addrlen);
+        *len = ai->ai_addrlen;
+        freeaddrinfo(ai);
+        return sa->ss_family;
+    }
+    return -EINVAL;
+}
+
+/* send or receive all of 'iov', retrying short transfers and EINTR
+ * (the iovecs are used up in the process). Returns 0 or -EIO.
+ */
+static int xfer(int send, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+        ssize_t n = send ? sendmsg(sock, &msg, MSG_NOSIGNAL) :
+            recvmsg(sock, &msg, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        while (cnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int remote_connect(const char *addr)
+{
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int one = 1;
+
+    int family = blkp_addr(addr, &sa, &len);
+    if (family < 0)
+        return family;
+    if ((sock = socket(family, SOCK_STREAM, 0)) < 0)
+        return -errno;
+    if (connect(sock, (struct sockaddr *)&sa, len) < 0) {
+        int err = errno;
+        close(sock);
+        sock = -1;
+        return -err;
+    }
+    if (family != AF_UNIX)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    cache_lba = malloc(REMOTE_CACHE_BLOCKS * sizeof(lba_t));
+    cache_data = malloc((size_t)REMOTE_CACHE_BLOCKS * FS_BLOCK_SIZE);
+    if (cache_lba == NULL || cache_data == NULL) {
+        remote_disconnect();
+        return -ENOMEM;
+    }
+    for (int i = 0; i < REMOTE_CACHE_BLOCKS; i++)
+        cache_lba[i] = -1;
+    return 0;
+}
+
+size_t remote_mem(void)
+{
+    if (cache_data == NULL)
+        return 0;
+    return (size_t)REMOTE_CACHE_BLOCKS * (FS_BLOCK_SIZE + sizeof(lba_t));
+}
+
+void remote_disconnect(void)
+{
+    if (sock >= 0)
+        close(sock);
+    sock = -1;
+    free(cache_lba);
+    free(cache_data);
+    cache_lba = NULL;
+    cache_data = NULL;
+}
+
+/* look up (put == 0) or store (put == 1) block 'lba' in the cache
+ */
+static int cache_io(int put, void *buf, lba_t lba)
+{
+    int slot = lba % REMOTE_CACHE_BLOCKS;
+    char *data = cache_data + (size_t)slot * FS_BLOCK_SIZE;
+    int hit = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (put) {
+        memcpy(data, buf, FS_BLOCK_SIZE);
+        cache_lba[slot] = lba;
+    } else if (cache_lba[slot] == lba) {
+        memcpy(buf, data, FS_BLOCK_SIZE);
+        hit = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return hit;
+}
+
+static void cache_drop(lba_t lba)
+{
+    int slot = lba % REMOTE_CACHE_BLOCKS;
+    pthread_mutex_lock(&cache_lock);
+    if (cache_lba[slot] == lba)
+        cache_lba[slot] = -1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* one request of a batch: blocks miss[first .. first+cnt-1]
+ */
+struct run {
+    int first;
+    int cnt;
+};
+
+static int send_run(int write, struct run *r, void **bufs, const lba_t *lbas,
+                    const int *miss)
+{
+    struct blkp_req req = {BLKP_MAGIC, write ? BLKP_WRITE : BLKP_READ,
+                           lbas[miss[r->first]], r->cnt, 0};
+    struct iovec iov[1 + BLKP_MAX_BLKS];
+    int cnt = 1;
+
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    for (int k = 0; write && k < r->cnt; k++, cnt++) {
+        iov[cnt].iov_base = bufs[miss[r->first + k]];
+        iov[cnt].iov_len = FS_BLOCK_SIZE;
+    }
+    return xfer(1, iov, cnt);
+}
+
+/* receive the response to a request. Returns 0, 1 if the server
+ * reported an error, or -EIO if the connection failed.
+ */
+static int recv_run(int write, struct run *r, void **bufs, const lba_t *lbas,
+                    const int *miss)
+{
+    struct blkp_rsp rsp;
+    struct iovec iov[BLKP_MAX_BLKS];
+
+    iov[0].iov_base = &rsp;
+    iov[0].iov_len = sizeof(rsp);
+    if (xfer(0, iov, 1) < 0 || rsp.magic != BLKP_MAGIC)
+        return -EIO;
+    if (rsp.status != 0)
+        return 1;
+    if (write)
+        return 0;
+
+    for (int k = 0; k < r->cnt; k++) {
+        iov[k].iov_base = bufs[miss[r->first + k]];
+        iov[k].iov_len = FS_BLOCK_SIZE;
+    }
+    return xfer(0, iov, r->cnt);
+}
+
+int remote_rwv(int write, void **bufs, const lba_t *lbas, int n)
+{
+    int miss[n];
+    struct run runs[n];
+    int nmiss = 0, nruns = 0, rv = 0;
+
+    // 1. reads are served from the cache where possible
+    for (int i = 0; i < n; i++) {
+        if (write || !cache_io(0, bufs[i], lbas[i]))
+            miss[nmiss++] = i;
+    }
+    if (nmiss == 0)
+        return 0;
+
+    // 2. one request per run of consecutive blocks
+    for (int k = 0; k < nmiss; ) {
+        int cnt = 1;
+        while (k + cnt < nmiss && cnt < BLKP_MAX_BLKS &&
+               lbas[miss[k + cnt]] == lbas[miss[k]] + cnt)
+            cnt++;
+        runs[nruns].first = k;
+        runs[nruns].cnt = cnt;
+        nruns++;
+        k += cnt;
+    }
+
+    // 3. pipeline them, with up to REMOTE_WINDOW outstanding
+    pthread_mutex_lock(&sock_lock);
+    if (sock < 0) {
+        pthread_mutex_unlock(&sock_lock);
+        return -EIO;
+    }
+    for (int sent = 0, done = 0; done < nruns; ) {
+        if (sent < nruns && sent - done < REMOTE_WINDOW) {
+            if (send_run(write, &runs[sent], bufs, lbas, miss) < 0)
+                goto broken;
+            sent++;
+            continue;
+        }
+
+        struct run *r = &runs[done++];
+        int status = recv_run(write, r, bufs, lbas, miss);
+        if (status < 0)
+            goto broken;
+        for (int k = 0; k < r->cnt; k++) {
+            int i = miss[r->first + k];
+            if (status == 0)
+                cache_io(1, bufs[i], lbas[i]);
+            else
+                cache_drop(lbas[i]);
+        }
+        if (status > 0)
+            rv = -EIO;
+    }
+    pthread_mutex_unlock(&sock_lock);
+    return rv;
+
+broken:
+    /* the stream is out of step with the server; give up on it */
+    fprintf(stderr, "lost connection to the block server\n");
+    close(sock);
+    sock = -1;
+    for (int k = 0; k < nmiss; k++)
+        cache_drop(lbas[miss[k]]);
+    pthread_mutex_unlock(&sock_lock);
+    return -EIO;
+}
+
+int remote_flush(void)
+{
+    struct blkp_req req = {BLKP_MAGIC, BLKP_FLUSH, 0, 0, 0};
+    struct blkp_rsp rsp;
+    struct iovec iov;
+    int rv = -EIO;
+
+    pthread_mutex_lock(&sock_lock);
+    if (sock >= 0) {
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        int ok = xfer(1, &iov, 1) == 0;
+        iov.iov_base = &rsp;
+        iov.iov_len = sizeof(rsp);
+        if (ok && xfer(0, &iov, 1) == 0 && rsp.magic == BLKP_MAGIC) {
+            rv = rsp.status == 0 ? 0 : -EIO;
+        } else {
+            fprintf(stderr, "lost connection to the block server\n");
+            close(sock);
+            sock = -1;
+        }
+    }
+    pthread_mutex_unlock(&sock_lock);
+    return rv;
+}
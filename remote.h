@@ -0,0 +1,54 @@
+/*
+ * file:        remote.h
+ * description: remote block store - wire protocol shared by the client
+ *              (remote.c, used by the block layer in misc.c) and the
+ *              stand-in server (blkserver.c)
+ */
+#ifndef __REMOTE_H__
+#define __REMOTE_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "fs5600.h"
+
+/* Every request gets exactly one response, in order. A write request
+ * is followed by its nblks blocks of data, a successful read response
+ * by the blocks read. Fields are in host byte order: client and server
+ * are expected to run on the same kind of machine.
+ */
+#define BLKP_MAGIC    0x504b4c42    /* "BLKP" */
+#define BLKP_MAX_BLKS 256           /* most blocks in one request */
+
+enum { BLKP_READ = 1, BLKP_WRITE = 2, BLKP_FLUSH = 3 };
+
+struct blkp_req {
+    uint32_t magic;
+    uint32_t op;
+    uint64_t lba;
+    uint32_t nblks;
+    uint32_t pad;
+};
+
+struct blkp_rsp {
+    uint32_t magic;
+    int32_t  status;        /* 0 or -errno */
+};
+
+/* parse "unix:/path/to/socket" or "tcp:host:port" into a socket
+ * address. Returns the address family, or -EINVAL.
+ */
+int blkp_addr(const char *addr, struct sockaddr_storage *sa, socklen_t *len);
+
+/* client side. remote_connect returns 0 or -errno; the others return
+ * 0 or -EIO.
+ */
+int  remote_connect(const char *addr);
+void remote_disconnect(void);
+int  remote_rwv(int write, void **bufs, const lba_t *lbas, int n);
+int  remote_flush(void);
+
+/* memory the client's block cache takes while connected */
+size_t remote_mem(void);
+
+#endif
@@ -0,0 +1,105 @@
+#!/usr/bin/python
+#
+# usage: split-img.py [-unit N] [-mirror | -raid5] input.img out1.img out2.img ...
+#
+# stripe a file system image across several image files (RAID-0), to
+# be mounted with "-image out1.img,out2.img,...". Blocks are dealt out
+# in stripe units of N blocks (default 16), unit k going to file
+# k % (number of files); the files are padded to whole stripes, and
+# each ends with a label block giving the stripe unit and its place in
+# the set (mount with -stripe N, listing the files in the same order).
+#
+# with -mirror, each output file is a full copy of the image followed
+# by a mirror label block (mount with -mirror).
+#
+# with -raid5, every row of the stripe holds len(outs)-1 data units and
+# one parity unit (the XOR of the data units); the parity unit is on
+# file (n-1) - row % n. Each file ends with a label block (mount with
+# -raid5 -stripe N).
+
+import sys
+import struct
+
+BLOCK = 4096
+STRIPE_MAGIC = 0x50525453
+MIRROR_MAGIC = 0x4d495252
+RAID5_MAGIC = 0x35444152
+
+unit = 16
+mode = None
+while sys.argv[1] in ('-unit', '-mirror', '-raid5'):
+    if sys.argv[1] == '-unit':
+        unit = int(sys.argv[2])
+        sys.argv.pop(1)
+    else:
+        mode = sys.argv[1]
+    sys.argv.pop(1)
+
+def label(magic, member):
+    # magic, clean, generation, stripe unit, member, number of members
+    lab = bytearray(struct.pack('<IIQIII', magic, 1, 1, unit, member, len(outs)))
+    return lab + bytearray(BLOCK - len(lab))
+
+src = sys.argv[1]
+outs = sys.argv[2:]
+if unit <= 0 or len(outs) < 1 or (mode == '-raid5' and len(outs) < 3):
+    print('usage: split-img.py [-unit N] [-mirror | -raid5] input.img out1.img out2.img ...')
+    sys.exit(1)
+
+data = open(src, 'rb').read()
+nblocks = (len(data) + BLOCK - 1) // BLOCK
+
+def block(b):
+    blk = bytearray(data[b * BLOCK:(b + 1) * BLOCK])
+    return blk + bytearray(BLOCK - len(blk))
+
+if mode == '-mirror':
+    pad = bytearray(nblocks * BLOCK - len(data))
+    for d, name in enumerate(outs):
+        fp = open(name, 'wb')
+        fp.write(data + pad)
+        fp.write(label(MIRROR_MAGIC, d))
+        fp.close()
+    sys.exit(0)
+
+if mode == '-raid5':
+    n = len(outs)
+    rows = (nblocks + unit * (n - 1) - 1) // (unit * (n - 1))
+    fps = [open(name, 'wb') for name in outs]
+    for row in range(rows):
+        pdisk = n - 1 - row % n
+        units = []
+        for idx in range(n - 1):
+            u = row * (n - 1) + idx
+            units.append([block(b) for b in range(u * unit, (u + 1) * unit)])
+        parity = []
+        for o in range(unit):
+            p = bytearray(BLOCK)
+            for u in units:
+                for i in range(BLOCK):
+                    p[i] ^= u[o][i]
+            parity.append(p)
+        for d in range(n):
+            if d == pdisk:
+                blks = parity
+            else:
+                blks = units[d if d < pdisk else d - 1]
+            for blk in blks:
+                fps[d].write(blk)
+    for d, fp in enumerate(fps):
+        fp.write(label(RAID5_MAGIC, d))
+        fp.close()
+    sys.exit(0)
+
+ndisks = len(outs)
+rows = (nblocks + unit * ndisks - 1) // (unit * ndisks)
+
+fps = [open(name, 'wb') for name in outs]
+for u in range(rows * ndisks):
+    fp = fps[u % ndisks]
+    for b in range(u * unit, (u + 1) * unit):
+        fp.write(block(b))
+for d, fp in enumerate(fps):
+    if ndisks > 1:
+        fp.write(label(STRIPE_MAGIC, d))
+    fp.close()
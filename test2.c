@@ -14,9 +14,97 @@
 #include <fuse.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "fs5600.h"
+#include "bcache.h"
+#include "budget.h"
 
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
+extern void block_close(void);
+
+/* do block I/O through io_uring, 'depth' requests in flight; <0 if
+ * the kernel has no io_uring (synchronous I/O stays in use)
+ */
+extern int block_uring_init(int depth);
+
+/* serve blocks from a shared mapping of the (single) image file */
+extern int block_mmap_init(void);
+
+/* reopen the image O_DIRECT; <0 if the host file system refuses */
+extern int block_direct_init(void);
+
+/* a one-block buffer from the aligned pool, and back to it */
+extern void *block_buf_get(void);
+extern void block_buf_put(void *buf);
+
+/* read 'nblks' blocks from 'lba' through the block layer */
+extern int block_read(void *buf, lba_t lba, int nblks);
+
+/* an image set striped in units of 'unit' blocks; block_stripe_check
+ * is <0 unless its labels say it was built that way, in that order
+ */
+extern int block_stripe_init(int unit);
+extern int block_stripe_check(void);
+
+/* the image set is a mirror; <0 if it isn't one split-img.py built */
+extern int block_mirror_init(void);
+
+/* the image set is RAID-5 with the stripe unit set; <0 if it isn't,
+ * or can't run with more than one member missing
+ */
+extern int block_raid5_init(void);
+
+/* use the image a block server serves at 'addr' (unix:/path,
+ * tcp:host:port); <0 if it can't be reached
+ */
+extern int block_remote_init(const char *addr);
+
+/* punch blocks the file system frees out of the image; <0 if the kind
+ * of image can't have holes. block_zeroed: 1 if a block is known to
+ * read back as zeros.
+ */
+extern int block_discard_init(void);
+extern int block_zeroed(lba_t lba);
+
+/* load the whole image into memory and serve blocks from there,
+ * writing changed ones back on flush
+ */
+extern int block_ram_init(void);
+
+/* put a buffer cache of 'nblocks' blocks under the file system, write-
+ * back with up to 'dirty_pct' percent of it dirty (0: write-through)
+ */
+extern int block_cache_init(int nblocks, int dirty_pct, int policy, int huge);
+
+/* share a memory budget of 'bytes' between the caches (lab5fuse -mem),
+ * setting *left to what the buffer cache may grow to; fs_icache_size
+ * sets the inode cache back to a size of its own
+ */
+extern int fs_cache_budget(size_t bytes, size_t *left);
+extern void fs_icache_size(int n);
+
+/* nonzero if block 'i' is marked in use in the (in-memory) bitmap
+ */
+extern int bitmap_test(lba_t i);
+
+/* allocate a free block (next fit), or -ENOSPC; free_blk gives it back
+ */
+extern lba_t alloc_blk(void);
+extern void free_blk(lba_t i);
+
+/* allocate up to 'n' contiguous blocks (the longest free run if there
+ * is none of 'n'); returns how many, the first in *start
+ */
+extern lba_t alloc_run(lba_t n, lba_t *start);
+
+/* count the blocks the bitmap has in use, and make that the count
+ * statfs reports (saying so on stderr if it wasn't)
+ */
+extern lba_t bitmap_verify(void);
 
 /* mockup for fuse_get_context. you can change ctx.uid, ctx.gid in
  * tests if you want to test setting UIDs in mknod/mkdir
@@ -1086,6 +1174,1459 @@ START_TEST(utime_0)
 END_TEST
 
 
+/* an image of 'nblocks' blocks with the files of disk2.in; more than
+ * 32768 blocks gives it a bitmap of several blocks
+ */
+void new_image_sized(int nblocks)
+{
+    char cmd[256];
+    sprintf(cmd, "sed 's/^size .*/size %d/' disk2.in > test3.in && "
+            "python2 gen-disk.py -q test3.in test3.img", nblocks);
+    system(cmd);
+    block_init("test3.img");
+    fs_ops.init(NULL);
+}
+
+#define BIG_BLOCKS 34000        /* bitmap blocks: 1, and 33999 */
+#define BIG_FILE   (1000 * 4096)
+
+/* fill the first bitmap block's worth of blocks and go past it, then
+ * check that it all survives a remount and is freed again
+ */
+START_TEST(multi_bitmap)
+{
+    printf("multi_bitmap------->\n");
+    new_image_sized(BIG_BLOCKS);
+    int blks = start_blocks();
+    struct statvfs sv;
+    int rv = fs_ops.statfs("/", &sv);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sv.f_blocks, BIG_BLOCKS);
+
+    char *data = rnd_data(BIG_FILE);
+    char path[32];
+    int nfiles = 0;
+    while (!bitmap_test(32768)) {
+        sprintf(path, "/big%d", nfiles);
+        rv = fs_ops.create(path, S_IFREG|0777, NULL);
+        ck_assert_int_eq(rv, 0);
+        data[0] = nfiles;
+        rv = fs_ops.write(path, data, BIG_FILE, 0, NULL);
+        ck_assert_int_eq(rv, BIG_FILE);
+        nfiles++;
+    }
+    ck_assert(!bitmap_test(BIG_BLOCKS - 2));
+    rv = fs_ops.statfs("/", &sv);
+    ck_assert_int_eq(rv, 0);
+    int used = blks - sv.f_bfree;
+    ck_assert_int_ge(used, nfiles * 1000);
+
+    // both bitmap blocks made it to the image
+    block_init("test3.img");
+    fs_ops.init(NULL);
+    ck_assert(bitmap_test(32768));
+    rv = fs_ops.statfs("/", &sv);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(blks - sv.f_bfree, used);
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/big%d", i);
+        data[0] = i;
+        void *out = read_back(path, BIG_FILE);
+        ck_assert(memcmp(data, out, BIG_FILE) == 0);
+        free(out);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/big%d", i);
+        rv = fs_ops.unlink(path);
+        ck_assert_int_eq(rv, 0);
+    }
+    check_blocks(blks);
+    block_init("test3.img");
+    fs_ops.init(NULL);
+    ck_assert(!bitmap_test(32768));
+    check_blocks(blks);
+    free(data);
+}
+END_TEST
+
+/* alloc_blk searches on from the last allocation, a word of the
+ * bitmap at a time, and wraps around at the end
+ */
+START_TEST(alloc_next_fit)
+{
+    printf("alloc_next_fit------->\n");
+    new_image();
+    int blks = start_blocks();
+    struct statvfs sv;
+    fs_ops.statfs("/", &sv);
+    lba_t size = sv.f_blocks;
+
+    // consecutive blocks; a freed one is passed over until the wrap
+    lba_t a = alloc_blk(), b = alloc_blk();
+    ck_assert_int_gt(a, 0);
+    ck_assert_int_eq(b, a + 1);
+    free_blk(a);
+    ck_assert(!bitmap_test(a));
+    lba_t c = alloc_blk();
+    ck_assert_int_eq(c, b + 1);
+
+    // take everything else
+    lba_t got[400];
+    int n = 0;
+    got[n++] = b;
+    got[n++] = c;
+    lba_t i;
+    while ((i = alloc_blk()) > 0) {
+        ck_assert_int_lt(n, 400);
+        got[n++] = i;
+    }
+    ck_assert_int_eq(i, -ENOSPC);
+    ck_assert_int_eq(n, blks);
+    check_blocks(0);
+
+    // holes on either side of a word boundary, and the first one, are
+    // found in the order they come in after the last block allocated,
+    // wrapping around the end
+    lba_t w = (c / 64 + 1) * 64;
+    ck_assert(bitmap_test(w - 1) && bitmap_test(w));
+    free_blk(w);
+    free_blk(w - 1);
+    free_blk(a);
+    lba_t holes[] = {a, w - 1, w};
+    lba_t after = got[n - 1] + 1;
+    for (int k = 0; k < 3; k++) {
+        lba_t first = -1;
+        for (int h = 0; h < 3; h++) {
+            lba_t d = (holes[h] - after + size) % size;
+            if (holes[h] >= 0 && (first < 0 || d < (holes[first] - after + size) % size)) {
+                first = h;
+            }
+        }
+        ck_assert_int_eq(alloc_blk(), holes[first]);
+        after = holes[first] + 1;
+        holes[first] = -1;
+    }
+    ck_assert_int_eq(alloc_blk(), -ENOSPC);
+
+    free_blk(a);
+    for (int k = 0; k < n; k++) {
+        free_blk(got[k]);
+    }
+    check_blocks(blks);
+}
+END_TEST
+
+/* statfs's count of used blocks must be what the bitmap on the image
+ * (block 1 of test2.img) says, bit by bit
+ */
+void check_used(void)
+{
+    struct statvfs sv;
+    int rv = fs_ops.statfs("/", &sv);
+    ck_assert_int_eq(rv, 0);
+
+    unsigned char map[FS_BLOCK_SIZE];
+    int fd = open("test2.img", O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pread(fd, map, sizeof(map), FS_BLOCK_SIZE), sizeof(map));
+    close(fd);
+    int used = 0;
+    for (int i = 0; i < sv.f_blocks; i++) {
+        used += (map[i / 8] >> (i % 8)) & 1;
+    }
+    ck_assert_int_eq(sv.f_blocks - sv.f_bfree, used);
+}
+
+START_TEST(statfs_count)
+{
+    printf("statfs_count------->\n");
+    new_image();
+    check_used();
+
+    int rv = fs_ops.mkdir("/d", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.create("/d/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    check_used();
+
+    void *data = rnd_data(50000);
+    _do_write("/d/f", data, 50000, 7000);
+    check_used();
+    rv = fs_ops.write("/d/f", data, 10000, 45000, NULL);   // overwrite and extend
+    ck_assert_int_eq(rv, 10000);
+    check_used();
+    free(data);
+
+    rv = fs_ops.truncate("/d/f", 0);
+    ck_assert_int_eq(rv, 0);
+    check_used();
+
+    rv = fs_ops.unlink("/d/f");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.rmdir("/d");
+    ck_assert_int_eq(rv, 0);
+    check_used();
+
+    // and what a fresh mount counts
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    check_used();
+}
+END_TEST
+
+START_TEST(alloc_contig)
+{
+    printf("alloc_contig------->\n");
+    new_image();
+    int blks = start_blocks();
+
+    // runs of the size asked for, one after the other
+    lba_t s1, s2;
+    ck_assert_int_eq(alloc_run(16, &s1), 16);
+    ck_assert_int_eq(alloc_run(16, &s2), 16);
+    ck_assert_int_eq(s2, s1 + 16);
+    for (int i = 0; i < 32; i++) {
+        ck_assert(bitmap_test(s1 + i));
+    }
+
+    // with no run that long, the longest there is
+    for (int i = 0; i < 16; i += 2) {
+        free_blk(s1 + i);
+    }
+    lba_t s3;
+    lba_t n3 = alloc_run(1000, &s3);
+    ck_assert_int_gt(n3, 1);
+    ck_assert_int_lt(n3, 1000);
+    for (lba_t i = s3; i < s3 + n3; i++) {
+        ck_assert(bitmap_test(i));
+    }
+    ck_assert(bitmap_test(s3 - 1) && bitmap_test(s3 + n3));
+
+    // pairs until only single blocks are left, then those
+    lba_t got[400], n, s4;
+    int ngot = 0, singles = 0;
+    while ((n = alloc_run(2, &s4)) > 0) {
+        ck_assert_int_lt(ngot + 1, 400);
+        if (n == 1) {
+            singles = 1;
+        }
+        ck_assert(n == 1 || !singles);
+        got[ngot++] = s4;
+        if (n == 2) {
+            got[ngot++] = s4 + 1;
+        }
+    }
+    ck_assert_int_eq(n, -ENOSPC);
+    check_blocks(0);
+
+    for (int i = 0; i < ngot; i++) {
+        free_blk(got[i]);
+    }
+    for (lba_t i = s1 + 1; i < s1 + 16; i += 2) {
+        free_blk(i);
+    }
+    for (lba_t i = s2; i < s2 + 16; i++) {
+        free_blk(i);
+    }
+    for (lba_t i = s3; i < s3 + n3; i++) {
+        free_blk(i);
+    }
+    check_blocks(blks);
+}
+END_TEST
+
+/* a write that runs out of space after taking some runs gives them
+ * all back
+ */
+START_TEST(alloc_fail_frees)
+{
+    printf("alloc_fail_frees------->\n");
+    new_image();
+    void *data = rnd_data(400 * 4096);
+
+    // leave the free space in several pieces
+    char path[32];
+    for (int i = 0; i < 6; i++) {
+        sprintf(path, "/frag%d", i);
+        int rv = fs_ops.create(path, S_IFREG|0777, NULL);
+        ck_assert_int_eq(rv, 0);
+        _do_write(path, data, 3 * 4096, 3 * 4096);
+    }
+    for (int i = 0; i < 6; i += 2) {
+        sprintf(path, "/frag%d", i);
+        int rv = fs_ops.unlink(path);
+        ck_assert_int_eq(rv, 0);
+    }
+
+    int rv = fs_ops.create("/big", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    int blks = start_blocks();
+    // (create gave it its first block already)
+    rv = fs_ops.write("/big", data, (blks + 2) * 4096, 0, NULL);
+    ck_assert_int_eq(rv, -ENOSPC);
+    check_blocks(blks);
+    check_used();
+
+    struct stat sb;
+    rv = fs_ops.getattr("/big", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 0);
+
+    // and the space is there to be used
+    rv = fs_ops.write("/big", data, (blks + 1) * 4096, 0, NULL);
+    ck_assert_int_eq(rv, (blks + 1) * 4096);
+    check_blocks(0);
+    free(data);
+}
+END_TEST
+
+/* what getattr says must follow every change to a file, including
+ * one that gets a removed file's inode block
+ */
+START_TEST(icache_coherent)
+{
+    printf("icache_coherent------->\n");
+    new_image();
+    struct stat sb;
+
+    int rv = fs_ops.create("/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    void *data = rnd_data(5000);
+    _do_write("/f", data, 5000, 5000);
+    free(data);
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 5000);
+    lba_t inum = sb.st_ino;
+
+    rv = fs_ops.chmod("/f", 0600);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.truncate("/f", 0);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_mode, S_IFREG|0600);
+    ck_assert_int_eq(sb.st_size, 0);
+
+    // a directory made in the freed inode block (the only two free
+    // blocks left)
+    rv = fs_ops.unlink("/f");
+    ck_assert_int_eq(rv, 0);
+    lba_t got[400], i;
+    int n = 0;
+    while ((i = alloc_blk()) > 0) {
+        if (i != inum && i != inum + 1) {
+            got[n++] = i;
+        }
+    }
+    free_blk(inum);
+    free_blk(inum + 1);
+    rv = fs_ops.mkdir("/g", 0755);
+    ck_assert_int_eq(rv, 0);
+    for (int k = 0; k < n; k++) {
+        free_blk(got[k]);
+    }
+    rv = fs_ops.getattr("/g", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_ino, inum);
+    ck_assert_int_eq(sb.st_mode, S_IFDIR|0755);
+    ck_assert_int_eq(sb.st_size, 0);
+
+    // and it was written through to the image
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    rv = fs_ops.getattr("/g", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_ino, inum);
+    ck_assert_int_eq(sb.st_mode, S_IFDIR|0755);
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+}
+END_TEST
+
+/* names looked up before (found or not) must follow create, rename,
+ * unlink and rmdir
+ */
+START_TEST(dcache_coherent)
+{
+    printf("dcache_coherent------->\n");
+    new_image();
+    struct stat sb;
+
+    // a name found missing, then created
+    int rv = fs_ops.mkdir("/d", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/x", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.create("/d/x", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/x", &sb);
+    ck_assert_int_eq(rv, 0);
+    lba_t x = sb.st_ino;
+
+    // renamed: the old name is gone, the new one (missing before) is it
+    rv = fs_ops.getattr("/d/y", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.rename("/d/x", "/d/y");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/x", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/d/y", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_ino, x);
+
+    // unlinked
+    rv = fs_ops.unlink("/d/y");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/y", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.create("/d/y", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/y", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.unlink("/d/y");
+    ck_assert_int_eq(rv, 0);
+
+    // the directory removed, with names in it cached both ways, and
+    // made again
+    rv = fs_ops.create("/d/z", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/z", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.unlink("/d/z");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.rmdir("/d");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/d/x", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.mkdir("/d", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.create("/d/x", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/x", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/d/z", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+}
+END_TEST
+
+/* whole paths resolved before must not outlive a rename, unlink or
+ * rmdir of any directory on them
+ */
+START_TEST(pcache_coherent)
+{
+    printf("pcache_coherent------->\n");
+    new_image();
+    struct stat sb;
+
+    char *dirs[] = {"/a", "/a/b", "/a/b/c", 0};
+    for (int i = 0; dirs[i] != NULL; i++) {
+        int rv = fs_ops.mkdir(dirs[i], 0777);
+        ck_assert_int_eq(rv, 0);
+    }
+    int rv = fs_ops.create("/a/b/c/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/a/b/c/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    lba_t f = sb.st_ino;
+
+    // a directory on the path renamed
+    rv = fs_ops.rename("/a", "/e");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/a/b/c/f", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/a/b", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/e/b/c/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_ino, f);
+
+    // a new directory by the old name has none of it
+    rv = fs_ops.mkdir("/a", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/a/b/c/f", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+
+    // the file, then the directories under it, removed
+    rv = fs_ops.unlink("/e/b/c/f");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/e/b/c/f", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/e/b/c", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.rmdir("/e/b/c");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/e/b/c", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.rmdir("/e/b");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/e/b", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+
+    // and made again, by another path
+    rv = fs_ops.mkdir("/a/b", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/a/b", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert(S_ISDIR(sb.st_mode));
+    rv = fs_ops.getattr("/a/b/c", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/e/b", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+}
+END_TEST
+
+/* a fresh test2.img with a buffer cache of 64 blocks, less than the
+ * files below take
+ */
+void new_image_cached(int dirty_pct)
+{
+    system("python2 gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    int rv = block_cache_init(64, dirty_pct, BCACHE_LRU, 0);
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* mount what test2.img holds right now, as if the machine had stopped
+ * here: a copy of it, without the cache
+ */
+void mount_snapshot(void)
+{
+    system("cp test2.img test2-copy.img");
+    block_init("test2-copy.img");
+    fs_ops.init(NULL);
+}
+
+/* with a write-through cache every write is on the image when it
+ * returns
+ */
+START_TEST(cache_write_through)
+{
+    printf("cache_write_through------->\n");
+    new_image_cached(0);
+    int rv = fs_ops.mkdir("/d", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.create("/d/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    void *data = rnd_data(300000);
+    _do_write("/d/f", data, 300000, 7000);
+    void *out = read_back("/d/f", 300000);
+    ck_assert(memcmp(data, out, 300000) == 0);
+    free(out);
+
+    mount_snapshot();
+    out = read_back("/d/f", 300000);
+    ck_assert(memcmp(data, out, 300000) == 0);
+    free(out);
+    free(data);
+}
+END_TEST
+
+/* with a write-back cache: what fsync returned for is on the image,
+ * file size included; what flush started is there after unmount
+ */
+START_TEST(cache_write_back)
+{
+    printf("cache_write_back------->\n");
+    new_image_cached(50);
+    void *data = rnd_data(300000);
+    int rv = fs_ops.create("/f1", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/f1", data, 300000, 7000);
+    rv = fs_ops.fsync("/f1", 0, NULL);
+    ck_assert_int_eq(rv, 0);
+
+    // (a copy taken now is what a crash would leave)
+    system("cp test2.img test2-copy.img");
+    rv = fs_ops.create("/f2", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/f2", data, 200000, 5000);
+    rv = fs_ops.flush("/f2", NULL);
+    ck_assert_int_eq(rv, 0);
+
+    // remounted: block_init writes back everything first
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    void *out = read_back("/f1", 300000);
+    ck_assert(memcmp(data, out, 300000) == 0);
+    free(out);
+    out = read_back("/f2", 200000);
+    ck_assert(memcmp(data, out, 200000) == 0);
+    free(out);
+
+    block_init("test2-copy.img");
+    fs_ops.init(NULL);
+    out = read_back("/f1", 300000);
+    ck_assert(memcmp(data, out, 300000) == 0);
+    free(out);
+    free(data);
+}
+END_TEST
+
+/* with a write-back cache inodes are written out late: the inode of a
+ * removed file must not be written over its block's next use
+ */
+START_TEST(icache_reuse_write_back)
+{
+    printf("icache_reuse_write_back------->\n");
+    new_image_cached(50);
+    struct stat sb;
+    int rv = fs_ops.create("/g", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.create("/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.chmod("/f", 0600);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    lba_t inum = sb.st_ino;
+    rv = fs_ops.unlink("/f");
+    ck_assert_int_eq(rv, 0);
+
+    // the second block of /g goes where /f's inode was
+    lba_t got[400], i;
+    int n = 0;
+    while ((i = alloc_blk()) > 0) {
+        if (i != inum) {
+            got[n++] = i;
+        }
+    }
+    free_blk(inum);
+    void *data = rnd_data(8192);
+    _do_write("/g", data, 8192, 8192);
+    for (int k = 0; k < n; k++) {
+        free_blk(got[k]);
+    }
+    rv = fs_ops.fsync("/g", 0, NULL);
+    ck_assert_int_eq(rv, 0);
+
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    void *out = read_back("/g", 8192);
+    ck_assert(memcmp(data, out, 8192) == 0);
+    free(out);
+    free(data);
+}
+END_TEST
+
+/* a block pointer past the end of the image (a damaged inode) is not
+ * a block in use: writing there gets a new block, and the image file
+ * does not grow
+ */
+START_TEST(write_bad_ptr)
+{
+    printf("write_bad_ptr------->\n");
+    new_image();
+    int rv = fs_ops.create("/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    void *data = rnd_data(8192);
+    _do_write("/f", data, 8192, 8192);
+    struct stat sb;
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, 0);
+
+    // point its second block far past the end, on the image
+    struct fs_inode in;
+    int fd = open("test2.img", O_RDWR);
+    ck_assert_int_ge(fd, 0);
+    off_t at = (off_t)sb.st_ino * FS_BLOCK_SIZE;
+    ck_assert_int_eq(pread(fd, &in, sizeof(in), at), sizeof(in));
+    in.ptrs[1] = 1000000;
+    ck_assert_int_eq(pwrite(fd, &in, sizeof(in), at), sizeof(in));
+    struct stat img;
+    fstat(fd, &img);
+
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    int blks = start_blocks();
+    rv = fs_ops.write("/f", data, 8192, 0, NULL);
+    ck_assert_int_eq(rv, 8192);
+    check_blocks(blks - 1);
+    void *out = read_back("/f", 8192);
+    ck_assert(memcmp(data, out, 8192) == 0);
+    free(out);
+
+    struct stat img2;
+    fstat(fd, &img2);
+    ck_assert_int_eq(img2.st_size, img.st_size);
+    close(fd);
+    free(data);
+}
+END_TEST
+
+/* a free run with the next-fit cursor in the middle of it is found,
+ * both when asked for exactly and as the longest run there is
+ */
+START_TEST(alloc_across_cursor)
+{
+    printf("alloc_across_cursor------->\n");
+    new_image();
+    int blks = start_blocks();
+
+    lba_t got[400], i;
+    int n = 0;
+    while ((i = alloc_blk()) > 0) {
+        got[n++] = i;
+    }
+    // a block with 3 of ours before it and 6 after, to put the cursor on
+    int c = -1;
+    for (int k = 3; k + 6 < n && c < 0; k++) {
+        if (got[k - 3] == got[k] - 3 && got[k + 6] == got[k] + 6) {
+            c = k;
+        }
+    }
+    ck_assert_int_ge(c, 0);
+    lba_t mid = got[c];
+    free_blk(mid);
+    ck_assert_int_eq(alloc_blk(), mid);
+
+    lba_t s;
+    for (lba_t b = mid - 3; b < mid + 5; b++) {
+        free_blk(b);
+    }
+    ck_assert_int_eq(alloc_run(8, &s), 8);
+    ck_assert_int_eq(s, mid - 3);
+
+    for (lba_t b = mid - 3; b < mid + 5; b++) {
+        free_blk(b);
+    }
+    free_blk(mid + 6);
+    ck_assert_int_eq(alloc_run(20, &s), 8);
+    ck_assert_int_eq(s, mid - 3);
+    for (int k = 0; k < n; k++) {
+        free_blk(got[k]);
+    }
+    check_blocks(blks);
+}
+END_TEST
+
+/* the used-block count statfs keeps is the bitmap's count, during a
+ * session and after a remount
+ */
+START_TEST(statfs_remount)
+{
+    printf("statfs_remount------->\n");
+    new_image();
+    void *data = rnd_data(40000);
+    char path[32];
+    for (int i = 0; i < 5; i++) {
+        sprintf(path, "/f%d", i);
+        int rv = fs_ops.create(path, S_IFREG|0777, NULL);
+        ck_assert_int_eq(rv, 0);
+        _do_write(path, data, 40000 - i * 7000, 4000);
+    }
+    int rv = fs_ops.unlink("/f1");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.truncate("/f3", 0);
+    ck_assert_int_eq(rv, 0);
+    free(data);
+
+    struct statvfs sv;
+    rv = fs_ops.statfs("/", &sv);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(bitmap_verify(), sv.f_blocks - sv.f_bfree);
+    int blks = sv.f_bfree;
+
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    check_blocks(blks);
+    ck_assert_int_eq(bitmap_verify(), sv.f_blocks - blks);
+}
+END_TEST
+
+/* the caches share a -mem budget: inodes that keep being asked for
+ * hold more of it than a fixed split would give them (8%), and when
+ * a big file comes through, the buffer cache gives memory back rather
+ * than the inode and path caches
+ */
+START_TEST(mem_budget_shared)
+{
+    printf("mem_budget_shared------->\n");
+    size_t mem = 2 << 20, left;
+    system("python2 gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    int rv = fs_cache_budget(mem, &left);
+    ck_assert_int_eq(rv, 0);
+    rv = block_cache_init(bcache_blocks_for(left), 0, BCACHE_2Q, 0);
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+
+    // 1. hot files, looked at over and over
+    char path[32];
+    struct stat sb;
+    rv = fs_ops.mkdir("/hot", 0777);
+    ck_assert_int_eq(rv, 0);
+    for (int i = 0; i < 30; i++) {
+        sprintf(path, "/hot/f%d", i);
+        rv = fs_ops.create(path, S_IFREG|0777, NULL);
+        ck_assert_int_eq(rv, 0);
+    }
+    for (int k = 0; k < 20; k++) {
+        for (int i = 0; i < 30; i++) {
+            sprintf(path, "/hot/f%d", i);
+            rv = fs_ops.getattr(path, &sb);
+            ck_assert_int_eq(rv, 0);
+        }
+    }
+
+    // 2. a big file, written and read once
+    void *data = rnd_data(600000);
+    rv = fs_ops.create("/big", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/big", data, 600000, 8000);
+    void *out = read_back("/big", 600000);
+    ck_assert(memcmp(data, out, 600000) == 0);
+    free(out);
+    free(data);
+
+    // 3. within budget, with the blocks giving way to the inodes
+    struct budget_stats st;
+    budget_get_stats(&st);
+    ck_assert(st.used <= st.limit);
+    ck_assert(st.shrunk[BUDGET_BCACHE] > 0);
+    ck_assert(st.shrunk[BUDGET_ICACHE] == 0);
+    ck_assert(st.shrunk[BUDGET_PCACHE] == 0);
+    ck_assert(st.bytes[BUDGET_ICACHE] > mem * 8 / 100);
+
+    budget_init(0);
+    fs_icache_size(512);
+    block_init("test2.img");
+}
+END_TEST
+
+
+/* the files round_trip wrote ('data') read back right */
+void check_round_trip(void *data)
+{
+    void *out = read_back("/rt/big", 300000);
+    ck_assert(memcmp(data, out, 300000) == 0);
+    free(out);
+    out = read_back("/rt/small", 117);
+    ck_assert(memcmp(data, out, 117) == 0);
+    free(out);
+}
+
+/* write a big and a small file through fs_ops on a block layer set up
+ * by 'mount' (which runs fs_ops.init too), read them back, unmount,
+ * and check them on a second mount set up the same way. Returns the
+ * data written.
+ */
+void *round_trip(void (*mount)(void))
+{
+    mount();
+    void *data = rnd_data(300000);
+    int rv = fs_ops.mkdir("/rt", 0777);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.create("/rt/big", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/rt/big", data, 300000, 7000);
+    rv = fs_ops.create("/rt/small", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/rt/small", data, 117, 117);
+    check_round_trip(data);
+    fs_ops.destroy(NULL);
+
+    mount();
+    check_round_trip(data);
+    return data;
+}
+
+void mount_uring(void)
+{
+    block_init("test2.img");
+    if (block_uring_init(64) < 0) {
+        printf("  (no io_uring here, synchronous I/O)\n");
+    }
+    fs_ops.init(NULL);
+}
+
+START_TEST(uring_round_trip)
+{
+    printf("uring_round_trip------->\n");
+    new_image();
+    free(round_trip(mount_uring));
+}
+END_TEST
+
+
+void mount_mmap(void)
+{
+    block_init("test2.img");
+    int rv = block_mmap_init();
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+START_TEST(mmap_round_trip)
+{
+    printf("mmap_round_trip------->\n");
+    new_image();
+    free(round_trip(mount_mmap));
+}
+END_TEST
+
+
+void mount_direct(void)
+{
+    block_init("test2.img");
+    if (block_direct_init() < 0) {
+        printf("  (no O_DIRECT here, buffered I/O)\n");
+    }
+    fs_ops.init(NULL);
+}
+
+/* with O_DIRECT, pool buffers are aligned for it, and the unaligned
+ * buffers fs_ops.write and fs_ops.read are given still work
+ */
+START_TEST(direct_round_trip)
+{
+    printf("direct_round_trip------->\n");
+    new_image();
+    void *bufs[4];
+    for (int i = 0; i < 4; i++) {
+        bufs[i] = block_buf_get();
+        ck_assert(bufs[i] != NULL && (uintptr_t)bufs[i] % 4096 == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        block_buf_put(bufs[i]);
+    }
+    free(round_trip(mount_direct));
+}
+END_TEST
+
+
+void mount_plain(void)
+{
+    block_init("test2.img");
+    fs_ops.init(NULL);
+}
+
+/* a 64-bit LBA image: files survive a remount, and their inodes are
+ * on disk in the 64-bit layout
+ */
+START_TEST(lba64_round_trip)
+{
+    printf("lba64_round_trip------->\n");
+    system("python2 gen-disk.py -q -64 disk2.in test2.img");
+    free(round_trip(mount_plain));
+
+    struct stat sb;
+    int rv = fs_ops.getattr("/rt/big", &sb);
+    ck_assert_int_eq(rv, 0);
+    struct fs_inode64 *in = block_buf_get();
+    rv = block_read(in, sb.st_ino, 1);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(in->size, 300000);
+    for (int i = 0; i < (300000 + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE; i++) {
+        ck_assert(in->ptrs[i] >= 3 && in->ptrs[i] < 400);
+        ck_assert(bitmap_test(in->ptrs[i]));
+    }
+    block_buf_put(in);
+
+    struct statvfs sv;
+    rv = fs_ops.statfs("/", &sv);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sv.f_blocks, 400);
+}
+END_TEST
+
+
+#define SET3 "test2-s0.img,test2-s1.img,test2-s2.img"
+
+/* split a new test2.img into test2-s0.img .. test2-s2.img, with
+ * split-img.py 'opts' and a stripe unit of 4. A set still mounted is
+ * closed first, as closing it writes its labels.
+ */
+void new_image_set(char *opts)
+{
+    char cmd[256];
+    block_close();
+    system("python2 gen-disk.py -q disk2.in test2.img");
+    sprintf(cmd, "python2 split-img.py -unit 4 %s test2.img "
+            "test2-s0.img test2-s1.img test2-s2.img", opts);
+    system(cmd);
+}
+
+void mount_stripe(void)
+{
+    block_init(SET3);
+    int rv = block_stripe_init(4);
+    ck_assert_int_eq(rv, 0);
+    rv = block_stripe_check();
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* RAID-0: files survive a remount; the members must be given in the
+ * order of the set, with its stripe unit
+ */
+START_TEST(stripe_round_trip)
+{
+    printf("stripe_round_trip------->\n");
+    new_image_set("");
+    free(round_trip(mount_stripe));
+
+    block_init("test2-s1.img,test2-s0.img,test2-s2.img");
+    block_stripe_init(4);
+    ck_assert_int_lt(block_stripe_check(), 0);
+    block_init(SET3);
+    block_stripe_init(8);
+    ck_assert_int_lt(block_stripe_check(), 0);
+}
+END_TEST
+
+
+void mount_mirror(void)
+{
+    block_init(SET3);
+    int rv = block_mirror_init();
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* zero image file 'name', keeping its size, as if the disk under it
+ * had been replaced. Not while it is in use.
+ */
+void wipe_image(char *name)
+{
+    int fd = open(name, O_RDWR);
+    ck_assert(fd >= 0);
+    off_t size = lseek(fd, 0, SEEK_END);
+    ck_assert(ftruncate(fd, 0) == 0 && ftruncate(fd, size) == 0);
+    close(fd);
+}
+
+/* RAID-1: files survive a remount, and can still be read with two of
+ * the three copies wiped (they are resynced from the third)
+ */
+START_TEST(mirror_round_trip)
+{
+    printf("mirror_round_trip------->\n");
+    new_image_set("-mirror");
+    void *data = round_trip(mount_mirror);
+    fs_ops.destroy(NULL);
+    block_close();
+
+    wipe_image("test2-s0.img");
+    wipe_image("test2-s1.img");
+    mount_mirror();
+    check_round_trip(data);
+    free(data);
+}
+END_TEST
+
+
+void mount_raid5(void)
+{
+    block_init(SET3);
+    block_stripe_init(4);
+    int rv = block_raid5_init();
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* RAID-5: files survive a remount, and with a member wiped they are
+ * rebuilt from the other two as they are read; with two wiped the set
+ * is refused
+ */
+START_TEST(raid5_round_trip)
+{
+    printf("raid5_round_trip------->\n");
+    new_image_set("-raid5");
+    void *data = round_trip(mount_raid5);
+    fs_ops.destroy(NULL);
+    block_close();
+
+    wipe_image("test2-s1.img");
+    mount_raid5();
+    check_round_trip(data);
+    fs_ops.destroy(NULL);
+    block_close();
+
+    wipe_image("test2-s0.img");
+    block_init(SET3);
+    block_stripe_init(4);
+    ck_assert_int_lt(block_raid5_init(), 0);
+    block_close();
+    free(data);
+}
+END_TEST
+
+
+/* ./blkserver (built by make all) serving test2.img on test2.sock */
+pid_t start_blkserver(void)
+{
+    pid_t pid = fork();
+    ck_assert(pid >= 0);
+    if (pid == 0) {
+        execl("./blkserver", "blkserver", "test2.img", "unix:test2.sock", (char *)NULL);
+        _exit(1);
+    }
+    return pid;
+}
+
+void stop_blkserver(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/* connect, giving a server just started a few seconds to listen */
+void mount_remote(void)
+{
+    int rv = -1;
+    for (int i = 0; i < 100 && rv < 0; i++) {
+        if ((rv = block_remote_init("unix:test2.sock")) < 0) {
+            usleep(50000);
+        }
+    }
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* the remote backend: files survive a reconnect, and a restart of the
+ * server (they are on its image)
+ */
+START_TEST(remote_round_trip)
+{
+    printf("remote_round_trip------->\n");
+    block_close();
+    system("python2 gen-disk.py -q disk2.in test2.img");
+    unlink("test2.sock");
+    pid_t pid = start_blkserver();
+    void *data = round_trip(mount_remote);
+    fs_ops.destroy(NULL);
+    block_close();
+    stop_blkserver(pid);
+
+    unlink("test2.sock");
+    pid = start_blkserver();
+    mount_remote();
+    check_round_trip(data);
+    fs_ops.destroy(NULL);
+    block_close();
+    stop_blkserver(pid);
+    free(data);
+}
+END_TEST
+
+
+void mount_discard(void)
+{
+    block_init("test2.img");
+    int rv = block_discard_init();
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* with discard on, files survive a remount, and the blocks of a file
+ * that is unlinked are punched out of the image: they read back as
+ * zeros and no longer take space on the host
+ */
+START_TEST(discard_round_trip)
+{
+    printf("discard_round_trip------->\n");
+    new_image();
+    void *data = round_trip(mount_discard);
+
+    struct stat sb;
+    int rv = fs_ops.getattr("/rt/big", &sb);
+    ck_assert_int_eq(rv, 0);
+    struct fs_inode *in = block_buf_get();
+    rv = block_read(in, sb.st_ino, 1);
+    ck_assert_int_eq(rv, 0);
+    int nblks = (300000 + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    lba_t ptrs[nblks];
+    for (int i = 0; i < nblks; i++) {
+        ptrs[i] = in->ptrs[i];
+    }
+    block_buf_put(in);
+
+    struct stat before, after;
+    ck_assert_int_eq(stat("test2.img", &before), 0);
+    rv = fs_ops.unlink("/rt/big");
+    ck_assert_int_eq(rv, 0);
+    fs_ops.destroy(NULL);
+    block_close();          /* punches whatever is still queued */
+
+    ck_assert_int_eq(stat("test2.img", &after), 0);
+    ck_assert(after.st_blocks * 512 <= before.st_blocks * 512 - 300000);
+    int fd = open("test2.img", O_RDONLY);
+    ck_assert(fd >= 0);
+    char buf[FS_BLOCK_SIZE], zeros[FS_BLOCK_SIZE] = {0};
+    for (int i = 0; i < nblks; i++) {
+        rv = pread(fd, buf, FS_BLOCK_SIZE, (off_t)ptrs[i] * FS_BLOCK_SIZE);
+        ck_assert_int_eq(rv, FS_BLOCK_SIZE);
+        ck_assert(memcmp(buf, zeros, FS_BLOCK_SIZE) == 0);
+    }
+    close(fd);
+
+    /* and a remount knows nothing of /rt/big, while /rt/small is
+     * still there */
+    mount_discard();
+    rv = fs_ops.getattr("/rt/big", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    void *out = read_back("/rt/small", 117);
+    ck_assert(memcmp(data, out, 117) == 0);
+    free(out);
+    free(data);
+}
+END_TEST
+
+
+void mount_ram(void)
+{
+    block_init("test2.img");
+    int rv = block_ram_init();
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* on the RAM backend, what is written reaches the image by unmount:
+ * it reads back on a second RAM mount and on a plain one
+ */
+START_TEST(ram_round_trip)
+{
+    printf("ram_round_trip------->\n");
+    new_image();
+    void *data = round_trip(mount_ram);
+    fs_ops.destroy(NULL);
+    block_close();
+
+    mount_plain();
+    check_round_trip(data);
+    free(data);
+}
+END_TEST
+
+
+/* on a 64-block cache with 'policy', cache the inode block of a small
+ * file, read a 300-block file through twice, and look the inode block
+ * up again. Returns 1 if that was a hit.
+ */
+int meta_kept_by_scan(int policy)
+{
+    system("python2 gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    int rv = block_cache_init(64, 0, policy, 0);
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+
+    int len = 300 * FS_BLOCK_SIZE;
+    void *data = rnd_data(len);
+    rv = fs_ops.create("/big", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/big", data, len, 64 * FS_BLOCK_SIZE);
+    rv = fs_ops.create("/small", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    struct stat sb;
+    rv = fs_ops.getattr("/small", &sb);
+    ck_assert_int_eq(rv, 0);
+    void *buf = block_buf_get();
+    rv = block_read(buf, sb.st_ino, 1);
+    ck_assert_int_eq(rv, 0);
+
+    for (int i = 0; i < 2; i++) {
+        void *out = read_back("/big", len);
+        ck_assert(memcmp(data, out, len) == 0);
+        free(out);
+    }
+
+    struct bcache_stats before, after;
+    bcache_get_stats(&before);
+    rv = block_read(buf, sb.st_ino, 1);
+    ck_assert_int_eq(rv, 0);
+    bcache_get_stats(&after);
+    block_buf_put(buf);
+    free(data);
+    block_init("test2.img");
+    return after.hits == before.hits + 1 && after.misses == before.misses;
+}
+
+/* a scan through a file bigger than the cache, read twice, pushes a
+ * metadata block out of an LRU cache but not out of a 2Q one
+ */
+START_TEST(cache_2q_scan)
+{
+    printf("cache_2q_scan------->\n");
+    ck_assert(meta_kept_by_scan(BCACHE_2Q));
+    ck_assert(!meta_kept_by_scan(BCACHE_LRU));
+}
+END_TEST
+
+
+/* mount test2.img with a 512-block cache and nothing in it (no
+ * warm-cache list either)
+ */
+void mount_cold_cache(void)
+{
+    unlink("test2.img.warm");
+    block_init("test2.img");
+    int rv = block_cache_init(512, 0, BCACHE_LRU, 0);
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+}
+
+/* read the first 'nblks' blocks of 'path' in 4-block pieces, in order
+ * or backwards, and check them against 'data'; like a reader that does
+ * something with each piece, it pauses after it, or the readahead
+ * thread may never get a turn. Returns the blocks the cache read ahead
+ * meanwhile.
+ */
+uint64_t read_pieces(char *path, char *data, int nblks, int backwards)
+{
+    struct bcache_stats st;
+    bcache_get_stats(&st);
+    uint64_t prefetched = st.prefetched;
+    char buf[4 * FS_BLOCK_SIZE];
+    for (int i = 0; i < nblks; i += 4) {
+        int blk = backwards ? nblks - 4 - i : i;
+        off_t off = (off_t)blk * FS_BLOCK_SIZE;
+        int rv = fs_ops.read(path, buf, sizeof(buf), off, NULL);
+        ck_assert_int_eq(rv, sizeof(buf));
+        ck_assert(memcmp(buf, data + off, sizeof(buf)) == 0);
+        usleep(2000);
+    }
+    bcache_get_stats(&st);
+    return st.prefetched - prefetched;
+}
+
+/* a file read in order is read ahead of the reader, and comes back
+ * right; one read backwards isn't
+ */
+START_TEST(readahead_seq)
+{
+    printf("readahead_seq------->\n");
+    int nblks = 200, len = nblks * FS_BLOCK_SIZE;
+    char *data = rnd_data(len);
+    new_image();
+    int rv = fs_ops.create("/seq", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/seq", data, len, 64 * FS_BLOCK_SIZE);
+    fs_ops.destroy(NULL);
+
+    mount_cold_cache();
+    ck_assert(read_pieces("/seq", data, nblks, 1) == 0);
+    fs_ops.destroy(NULL);
+
+    mount_cold_cache();
+    ck_assert(read_pieces("/seq", data, nblks, 0) > 0);
+    fs_ops.destroy(NULL);
+    unlink("test2.img.warm");
+    block_init("test2.img");
+    free(data);
+}
+END_TEST
+
+
+/* the blocks a mount had cached are listed next to the image at
+ * unmount, and loaded back in the background by the next mount with a
+ * cache, so that reading the same file again misses nothing
+ */
+START_TEST(warm_cache_reload)
+{
+    printf("warm_cache_reload------->\n");
+    int len = 20 * FS_BLOCK_SIZE;
+    char *data = rnd_data(len);
+    new_image();
+    int rv = fs_ops.create("/warm", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+    _do_write("/warm", data, len, len);
+    fs_ops.destroy(NULL);
+
+    mount_cold_cache();
+    void *out = read_back("/warm", len);
+    ck_assert(memcmp(data, out, len) == 0);
+    free(out);
+    fs_ops.destroy(NULL);
+    ck_assert(access("test2.img.warm", R_OK) == 0);
+
+    block_init("test2.img");
+    rv = block_cache_init(512, 0, BCACHE_LRU, 0);
+    ck_assert_int_eq(rv, 0);
+    fs_ops.init(NULL);
+    struct bcache_stats st;
+    for (int i = 0; i < 100; i++) {
+        bcache_get_stats(&st);
+        if (st.warmed >= 20)
+            break;
+        usleep(50000);
+    }
+    ck_assert(st.warmed >= 20);
+
+    uint64_t misses = st.misses;
+    out = read_back("/warm", len);
+    ck_assert(memcmp(data, out, len) == 0);
+    free(out);
+    bcache_get_stats(&st);
+    ck_assert(st.misses == misses);
+
+    fs_ops.destroy(NULL);
+    unlink("test2.img.warm");
+    block_init("test2.img");
+    free(data);
+}
+END_TEST
+
+
+/* set the times of 'path' back to 'when', wait for the clock to pass
+ * the status change that made, and return its ctime
+ */
+time_t age_file(char *path, time_t when)
+{
+    struct utimbuf ut = {.actime = when, .modtime = when};
+    int rv = fs_ops.utime(path, &ut);
+    ck_assert_int_eq(rv, 0);
+    struct stat sb;
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_mtime, when);
+    printf("  sleep 1 sec\n");
+    sleep(1);
+    return sb.st_ctime;
+}
+
+/* a write and a truncate both set the file's mtime and ctime to now
+ */
+START_TEST(write_truncate_times)
+{
+    printf("write_truncate_times------->\n");
+    new_image();
+    int rv = fs_ops.create("/f", S_IFREG|0777, NULL);
+    ck_assert_int_eq(rv, 0);
+
+    time_t ctime = age_file("/f", 1000000);
+    time_t now = time(NULL);
+    void *data = rnd_data(5000);
+    _do_write("/f", data, 5000, 5000);
+    free(data);
+    struct stat sb;
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_ge(sb.st_mtime, now);
+    ck_assert_int_lt(sb.st_mtime, now + 10);
+    ck_assert_int_ge(sb.st_ctime, now);
+    ck_assert_int_gt(sb.st_ctime, ctime);
+
+    ctime = age_file("/f", 1000000);
+    now = time(NULL);
+    rv = fs_ops.truncate("/f", 0);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/f", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 0);
+    ck_assert_int_ge(sb.st_mtime, now);
+    ck_assert_int_lt(sb.st_mtime, now + 10);
+    ck_assert_int_ge(sb.st_ctime, now);
+    ck_assert_int_gt(sb.st_ctime, ctime);
+}
+END_TEST
+
+
 int lengths[] = {1, 117, 4091, 4096, 5010, 8190, 8192, 8300, 12200, 12288, 12300, 0};
 
 
@@ -1127,6 +2668,35 @@ int main(int argc, char **argv)
     tcase_add_test(tc, cross_eof);
     tcase_add_test(tc, truncate_test);
     tcase_add_test(tc, utime_0);
+    tcase_add_test(tc, multi_bitmap);
+    tcase_add_test(tc, alloc_next_fit);
+    tcase_add_test(tc, statfs_count);
+    tcase_add_test(tc, alloc_contig);
+    tcase_add_test(tc, alloc_fail_frees);
+    tcase_add_test(tc, icache_coherent);
+    tcase_add_test(tc, dcache_coherent);
+    tcase_add_test(tc, pcache_coherent);
+    tcase_add_test(tc, cache_write_through);
+    tcase_add_test(tc, cache_write_back);
+    tcase_add_test(tc, icache_reuse_write_back);
+    tcase_add_test(tc, write_bad_ptr);
+    tcase_add_test(tc, alloc_across_cursor);
+    tcase_add_test(tc, statfs_remount);
+    tcase_add_test(tc, mem_budget_shared);
+    tcase_add_test(tc, uring_round_trip);
+    tcase_add_test(tc, mmap_round_trip);
+    tcase_add_test(tc, direct_round_trip);
+    tcase_add_test(tc, lba64_round_trip);
+    tcase_add_test(tc, stripe_round_trip);
+    tcase_add_test(tc, mirror_round_trip);
+    tcase_add_test(tc, raid5_round_trip);
+    tcase_add_test(tc, remote_round_trip);
+    tcase_add_test(tc, discard_round_trip);
+    tcase_add_test(tc, ram_round_trip);
+    tcase_add_test(tc, cache_2q_scan);
+    tcase_add_test(tc, readahead_seq);
+    tcase_add_test(tc, warm_cache_reload);
+    tcase_add_test(tc, write_truncate_times);
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);
@@ -0,0 +1,318 @@
+/*
+ * file:        uring.c
+ * description: minimal io_uring engine for the block layer (misc.c).
+ *
+ * Talks to the kernel through the raw io_uring_setup/io_uring_enter
+ * system calls so there is no liburing dependency. A batch of requests
+ * is queued on the submission ring and handed to the kernel with one
+ * io_uring_enter; completions are polled from the completion ring for
+ * a short while before falling back to a blocking wait.
+ *
+ * Several threads may submit at once: the submission side is
+ * serialized by sq_lock, and whichever thread holds cq_lock reaps
+ * completions for everybody.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/* how many times to look at the completion ring before sleeping in
+ * io_uring_enter. Block I/O to a cached image usually completes within
+ * a few microseconds, so a short spin saves a system call.
+ */
+#define URING_POLL_SPINS 2000
+
+/* one in-flight request; its address is the SQE user_data
+ */
+struct uring_slot {
+    struct uring_req   *req;
+    struct uring_batch *batch;
+};
+
+struct uring_batch {
+    int pending;
+    struct uring_slot slots[];
+};
+
+static int ring_fd = -1;
+
+static struct {
+    unsigned *head, *tail, *mask, *entries, *array;
+    struct io_uring_sqe *sqes;
+} sq;
+
+static struct {
+    unsigned *head, *tail, *mask, *entries;
+    struct io_uring_cqe *cqes;
+} cq;
+
+static void  *sq_map, *cq_map;
+static size_t sq_map_sz, cq_map_sz, sqes_sz;
+static int    inflight;
+
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(unsigned to_submit, unsigned min_complete,
+                           unsigned flags)
+{
+    int rv = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                     flags, NULL, 0);
+    return rv < 0 ? -errno : rv;
+}
+
+int uring_setup(unsigned depth)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring_fd = sys_uring_setup(depth, &p)) < 0)
+        return -errno;
+
+    sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_map_sz > sq_map_sz)
+            sq_map_sz = cq_map_sz;
+        cq_map_sz = sq_map_sz;
+    }
+
+    sq_map = mmap(NULL, sq_map_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_map = sq_map;
+    else {
+        cq_map = mmap(NULL, cq_map_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED)
+            goto fail;
+    }
+    sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    sq.sqes = mmap(NULL, sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq.sqes == MAP_FAILED)
+        goto fail;
+
+    sq.head = (unsigned *)((char *)sq_map + p.sq_off.head);
+    sq.tail = (unsigned *)((char *)sq_map + p.sq_off.tail);
+    sq.mask = (unsigned *)((char *)sq_map + p.sq_off.ring_mask);
+    sq.entries = (unsigned *)((char *)sq_map + p.sq_off.ring_entries);
+    sq.array = (unsigned *)((char *)sq_map + p.sq_off.array);
+
+    cq.head = (unsigned *)((char *)cq_map + p.cq_off.head);
+    cq.tail = (unsigned *)((char *)cq_map + p.cq_off.tail);
+    cq.mask = (unsigned *)((char *)cq_map + p.cq_off.ring_mask);
+    cq.entries = (unsigned *)((char *)cq_map + p.cq_off.ring_entries);
+    cq.cqes = (struct io_uring_cqe *)((char *)cq_map + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_teardown();
+    return -ENOMEM;
+}
+
+size_t uring_mem(void)
+{
+    if (ring_fd < 0)
+        return 0;
+    return sq_map_sz + sqes_sz + (cq_map != sq_map ? cq_map_sz : 0);
+}
+
+void uring_teardown(void)
+{
+    if (sq.sqes && sq.sqes != MAP_FAILED)
+        munmap(sq.sqes, sqes_sz);
+    if (cq_map && cq_map != MAP_FAILED && cq_map != sq_map)
+        munmap(cq_map, cq_map_sz);
+    if (sq_map && sq_map != MAP_FAILED)
+        munmap(sq_map, sq_map_sz);
+    if (ring_fd >= 0)
+        close(ring_fd);
+    sq.sqes = NULL;
+    sq_map = cq_map = NULL;
+    ring_fd = -1;
+}
+
+/* move every available completion to its request. Called with
+ * cq_lock held; returns the number of completions reaped.
+ */
+static int reap_locked(void)
+{
+    unsigned head = *cq.head;
+    unsigned tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    for (; head != tail; head++, n++) {
+        struct io_uring_cqe *cqe = &cq.cqes[head & *cq.mask];
+        struct uring_slot *slot = (struct uring_slot *)(uintptr_t)cqe->user_data;
+        slot->req->res = cqe->res;
+        __atomic_sub_fetch(&slot->batch->pending, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+    if (n > 0)
+        __atomic_sub_fetch(&inflight, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+/* reap at least one completion, spinning on the ring before sleeping
+ */
+static int wait_one_locked(void)
+{
+    for (int i = 0; i < URING_POLL_SPINS; i++) {
+        if (reap_locked() > 0)
+            return 0;
+    }
+    int rv = sys_uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+    if (rv < 0 && rv != -EINTR)
+        return rv;
+    reap_locked();
+    return 0;
+}
+
+/* hand 'n' queued SQEs to the kernel, called with sq_lock held
+ */
+static int flush_sq_locked(unsigned n)
+{
+    while (n > 0) {
+        int rv = sys_uring_enter(n, 0, 0);
+        if (rv == -EINTR)
+            continue;
+        if (rv == -EAGAIN || rv == -EBUSY) {
+            pthread_mutex_lock(&cq_lock);
+            rv = wait_one_locked();
+            pthread_mutex_unlock(&cq_lock);
+            if (rv < 0)
+                return rv;
+            continue;
+        }
+        if (rv < 0)
+            return rv;
+        n -= rv;
+    }
+    return 0;
+}
+
+/* after a failed io_uring_enter: hand the kernel whatever is still
+ * queued on the submission ring, retrying until it has taken it all,
+ * so that every request queued will complete. Called with sq_lock
+ * held.
+ */
+static void submit_rest_locked(void)
+{
+    unsigned left;
+    while ((left = *sq.tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE)) > 0) {
+        if (sys_uring_enter(left, 0, 0) >= 0)
+            continue;
+        pthread_mutex_lock(&cq_lock);
+        if (wait_one_locked() < 0)
+            usleep(1000);
+        pthread_mutex_unlock(&cq_lock);
+    }
+}
+
+/* Requests point at the caller's iovecs and buffers (on its stack, in
+ * pio_submit), so this never returns while any request of the batch
+ * is still with the kernel, even after an error: what was queued is
+ * submitted and waited for, and only then is the error returned.
+ */
+int uring_submit_wait(struct uring_req *reqs, int n)
+{
+    struct uring_batch *bs = malloc(sizeof(*bs) + n * sizeof(struct uring_slot));
+    unsigned queued = 0;
+    int rv = 0;
+
+    if (!bs)
+        return -ENOMEM;
+    bs->pending = n;
+    struct uring_slot *slots = bs->slots;
+
+    pthread_mutex_lock(&sq_lock);
+    for (int i = 0; i < n; i++) {
+        unsigned tail = *sq.tail;
+        unsigned head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+
+        /* SQ full, or the CQ could overflow: push what we have to the
+         * kernel and make room before queueing more.
+         */
+        while (tail - head == *sq.entries ||
+               __atomic_load_n(&inflight, __ATOMIC_RELAXED) >= *cq.entries) {
+            if (queued > 0) {
+                if ((rv = flush_sq_locked(queued)) < 0)
+                    break;
+                queued = 0;
+            } else {
+                pthread_mutex_lock(&cq_lock);
+                rv = wait_one_locked();
+                pthread_mutex_unlock(&cq_lock);
+                if (rv < 0)
+                    break;
+            }
+            head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+        }
+        if (rv < 0) {
+            /* nothing past request i was queued; don't wait for it */
+            __atomic_sub_fetch(&bs->pending, n - i, __ATOMIC_RELEASE);
+            break;
+        }
+
+        unsigned idx = tail & *sq.mask;
+        struct io_uring_sqe *sqe = &sq.sqes[idx];
+        slots[i].req = &reqs[i];
+        slots[i].batch = bs;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = reqs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = reqs[i].fd;
+        sqe->addr = (uintptr_t)reqs[i].iov;
+        sqe->len = reqs[i].iovcnt;
+        sqe->off = reqs[i].off;
+        sqe->user_data = (uintptr_t)&slots[i];
+        sq.array[idx] = idx;
+        __atomic_store_n(sq.tail, tail + 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        queued++;
+    }
+    if (rv == 0 && queued > 0)
+        rv = flush_sq_locked(queued);
+    if (rv < 0)
+        submit_rest_locked();
+    pthread_mutex_unlock(&sq_lock);
+
+    /* wait for all of our own batch; other threads' completions reaped
+     * along the way are credited to their batches. A failed wait is
+     * remembered and retried.
+     */
+    pthread_mutex_lock(&cq_lock);
+    while (__atomic_load_n(&bs->pending, __ATOMIC_ACQUIRE) > 0) {
+        int err = wait_one_locked();
+        if (err < 0) {
+            rv = err;
+            pthread_mutex_unlock(&cq_lock);
+            usleep(1000);
+            pthread_mutex_lock(&cq_lock);
+        }
+    }
+    pthread_mutex_unlock(&cq_lock);
+
+    free(bs);
+    return rv;
+}
@@ -0,0 +1,45 @@
+/*
+ * file:        uring.h
+ * description: minimal io_uring engine used by the block layer in misc.c
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* one vectored transfer in a batch. 'res' is filled in on completion
+ * with the byte count or -errno.
+ */
+struct uring_req {
+    int           fd;
+    int           write;
+    struct iovec *iov;
+    int           iovcnt;
+    off_t         off;
+    ssize_t       res;
+};
+
+/* set up a ring with room for 'depth' requests in flight.
+ * Returns 0, or -errno if io_uring is not available.
+ */
+int uring_setup(unsigned depth);
+
+/* submit all 'n' requests (with as few io_uring_enter calls as the
+ * ring size allows) and wait until every one has completed.
+ * Safe to call from several threads at once.
+ * Returns 0, or -errno if the ring itself failed; per-request errors
+ * are reported in reqs[i].res. Even after a failure it only returns
+ * once the kernel is done with every request it was given, so the
+ * caller may reuse (or redo synchronously) the iovecs and buffers.
+ */
+int uring_submit_wait(struct uring_req *reqs, int n);
+
+/* memory the rings take (0 without a ring). Each batch also takes a
+ * few dozen bytes per request while it is in flight.
+ */
+size_t uring_mem(void);
+
+void uring_teardown(void);
+
+#endif